@@ -2,22 +2,52 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 char* gets(char* s);
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using TokenID = uint64_t;
+using Unicode = uint32_t;
 
 enum class Type {
-  cell, token,
+  cell, token, number, character, future, string, vector, hashtable,
+  procedure, flonum, f64vector,
 };
 
 enum class TokenType {
@@ -34,70 +64,313 @@ enum class SpecialTokenID {
   dot, dots,
   cons, car, cdr, atom, eq, cond, lambda, define, quote2,
   add, sub, mul, div, mod, le, lt, ge, gt,
+  future, touch, pmap,
+  spawn, yield, socketpair, read_byte, write_byte, close,
+  string_length, string_ref, substring, string_append, string_eq,
+  string_contains, string_split, string_hash,
+  make_vector, vector_ref, vector_set, vector_length,
+  make_eq_hashtable, make_eqv_hashtable, make_equal_hashtable,
+  hashtable_ref, hashtable_set, hashtable_contains, hashtable_delete,
+  hashtable_size,
+  append, define_syntax, syntax_rules, underscore,
+  num_eq,
+  make_f64vector, f64vector_ref, f64vector_set, f64vector_length,
+  list_to_f64vector,
+  f64vector_add, f64vector_sub, f64vector_mul, f64vector_div,
+  f64vector_dot, f64vector_sum, f64vector_min, f64vector_max,
   Max
 };
 
-class Object {
+// the counters of the runtime. every thread counts into a slot of its own,
+// with plain loads and stores, and a dump sums the slots up; so counting
+// costs no more than an increment.
+enum class Counter {
+  objects, objects_freed, cells, symbols, dispatched,
+  read_ns, expand_ns, compile_ns, eval_ns,
+  Max
+};
+
+class Metrics {
+ private:
+  using Slot = std::array<std::atomic<uint64_t>,
+                          static_cast<std::size_t>(Counter::Max)>;
+
+  std::mutex mutex;
+  std::vector<Slot*> slots;
+
  public:
-  virtual ~Object() {
+  Metrics() : mutex{}, slots{} {
+    return;
+  }
+
+  void add(Counter counter, uint64_t n) {
+    auto& x = local()[static_cast<std::size_t>(counter)];
+    x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    return;
+  }
+
+  uint64_t get(Counter counter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t sum = 0;
+    for (auto slot : slots) {
+      sum += (*slot)[static_cast<std::size_t>(counter)].load(
+          std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  void dump(FILE* fp) {
+    auto ms = [this](Counter counter) {
+      return static_cast<double>(get(counter)) / 1e6;
+    };
+    auto objects = get(Counter::objects);
+    auto freed = get(Counter::objects_freed);
+    fprintf(fp, "metrics:\n");
+    fprintf(fp, "  objects allocated: %" PRIu64 "\n", objects);
+    fprintf(fp, "  objects live: %" PRIu64 "\n", objects - freed);
+    fprintf(fp, "  cells allocated: %" PRIu64 "\n", get(Counter::cells));
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    // the heap itself knows the bytes in use; asking it costs nothing
+    // until the dump.
+    auto heap = mallinfo2();
+    fprintf(fp, "  bytes live: %zu\n", heap.uordblks + heap.hblkhd);
+#endif
+    fprintf(fp, "  symbols interned: %" PRIu64 "\n", get(Counter::symbols));
+    fprintf(fp, "  instructions dispatched: %" PRIu64 "\n",
+            get(Counter::dispatched));
+    fprintf(fp, "  read: %.3f ms\n", ms(Counter::read_ns));
+    fprintf(fp, "  expand: %.3f ms\n", ms(Counter::expand_ns));
+    fprintf(fp, "  compile: %.3f ms\n", ms(Counter::compile_ns));
+    fprintf(fp, "  eval: %.3f ms\n", ms(Counter::eval_ns));
     return;
   }
 
-  virtual Type type() const = 0;
-  virtual void print() const = 0;
+ private:
+  // the slots are never freed, so the counts of the finished threads stay.
+  Slot& local() {
+    static thread_local Slot* slot = nullptr;
+    if (slot == nullptr) {
+      slot = new Slot();
+      for (auto& x : *slot) {
+        x.store(0, std::memory_order_relaxed);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      slots.push_back(slot);
+    }
+    return *slot;
+  }
 };
 
-class Cell : public Object {
+Metrics& metrics() {
+  static auto metrics = new Metrics();
+  return *metrics;
+}
+
+// the spans of the phases in the chrome trace event format, which
+// chrome://tracing and perfetto read. it holds them until the end.
+class Trace {
  private:
-  std::shared_ptr<Object> a, d;
+  struct Event {
+    const char* name;
+    std::string detail;
+    uint64_t start, duration;
+    uint64_t thread;
+  };
+
+  static constexpr std::size_t event_limit = 1 << 20;
+
+  std::mutex mutex;
+  std::vector<Event> events;
+  std::size_t dropped;
+  bool enabled;
+  const std::chrono::steady_clock::time_point origin;
 
  public:
-  Cell() : Object(), a(nullptr), d(nullptr) {
+  Trace()
+      : mutex{},
+        events{},
+        dropped(0),
+        enabled(false),
+        origin(std::chrono::steady_clock::now()) {
     return;
   }
 
-  template <typename T, typename U>
-  Cell(T&& a_, U&& d_)
-      : Object(),
-        a(std::forward<T>(a_)),
-        d(std::forward<U>(d_)) {
+  void enable() {
+    enabled = true;
     return;
   }
 
-  ~Cell() override {
-    return;
+  bool is_enabled() const {
+    return enabled;
   }
 
-  Type type() const override {
-    return Type::cell;
+  // the microseconds since the start.
+  uint64_t now() const {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - origin).count());
   }
 
-  void print(const std::shared_ptr<Object>& object) const {
-    if (object == nullptr) {
-      printf("()");
-    } else {
-      object->print();
+  void record(const char* name,
+              std::string detail,
+              uint64_t start,
+              uint64_t end) {
+    static std::atomic<uint64_t> threads{0};
+    static thread_local uint64_t thread = ++threads;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (events.size() == event_limit) {
+      dropped++;
+      return;
     }
+    events.push_back(Event{name, std::move(detail), start, end - start,
+                           thread});
     return;
   }
 
-  void print() const override {
-    printf("(");
-    print(a);
-    auto object_d = d;
-    for (; object_d != nullptr;) {
-      printf(" ");
-      if (object_d->type() == Type::cell) {
-        auto cell = std::dynamic_pointer_cast<Cell>(object_d);
-        print(cell->car());
-        object_d = cell->cdr();
-      } else {
-        printf(". ");
-        object_d->print();
-        break;
+  bool write(const char* path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto fp = fopen(path, "w");
+    if (fp == nullptr) {
+      return false;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (std::size_t i = 0; i < events.size(); ++i) {
+      auto& event = events[i];
+      fprintf(fp,
+              "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRIu64
+              ",\"dur\":%" PRIu64 ",\"pid\":1,\"tid\":%" PRIu64,
+              event.name, event.start, event.duration, event.thread);
+      if (!event.detail.empty()) {
+        fprintf(fp, ",\"args\":{\"of\":\"%s\"}", event.detail.c_str());
       }
+      fprintf(fp, "}%s\n", i + 1 < events.size() ? "," : "");
+    }
+    fprintf(fp, "],\"otherData\":{\"dropped\":\"%zu\"}}\n", dropped);
+    fclose(fp);
+    return true;
+  }
+};
+
+Trace& trace() {
+  static auto trace = new Trace();
+  return *trace;
+}
+
+// times a phase while it lives: the time goes to its counter, and to the
+// trace if there is one. a lambda compiled in the middle of a run counts
+// in both, as the spans nest.
+class Span {
+ private:
+  const char* name;
+  Counter counter;
+  std::string detail;
+  const std::chrono::steady_clock::time_point start;
+  const uint64_t trace_start;
+
+ public:
+  Span(const char* name_, Counter counter_, std::string detail_ = {})
+      : name(name_),
+        counter(counter_),
+        detail(std::move(detail_)),
+        start(std::chrono::steady_clock::now()),
+        trace_start(trace().is_enabled() ? trace().now() : 0) {
+    return;
+  }
+
+  ~Span() {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metrics().add(counter, static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            elapsed).count()));
+    if (trace().is_enabled()) {
+      trace().record(name, std::move(detail), trace_start, trace().now());
+    }
+    return;
+  }
+};
+
+// the errors of a thread: how many there were and the last message. a
+// session counts them to tell a form which failed from one whose value is
+// (), and the server sends the message to the client. while capture is set,
+// the messages go there instead of stderr.
+struct ErrorLog {
+  std::size_t count;
+  char last[128];
+  std::string* capture;
+};
+
+ErrorLog& error_log() {
+  static thread_local ErrorLog log{0, {}, nullptr};
+  return log;
+}
+
+// reports an error on stderr, as fprintf would, and logs it.
+void report(const char* fmt, ...) {
+  auto& log = error_log();
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(log.last, sizeof(log.last), fmt, args);
+  va_end(args);
+  if (log.capture != nullptr) {
+    log.capture->append(log.last);
+  } else {
+    fputs(log.last, stderr);
+  }
+  ++log.count;
+  return;
+}
+
+class Object {
+ private:
+  // a field rather than a virtual, so that a type check is a load; the
+  // guards of the quickened instructions are just that.
+  const Type tag;
+
+ public:
+  explicit Object(Type tag_) : tag(tag_) {
+    metrics().add(Counter::objects, 1);
+    return;
+  }
+
+  virtual ~Object() {
+    metrics().add(Counter::objects_freed, 1);
+    return;
+  }
+
+  Type type() const {
+    return tag;
+  }
+};
+
+class Cell : public Object {
+ private:
+  std::shared_ptr<Object> a, d;
+
+ public:
+  Cell() : Object(Type::cell), a(nullptr), d(nullptr) {
+    metrics().add(Counter::cells, 1);
+    return;
+  }
+
+  template <typename T, typename U>
+  Cell(T&& a_, U&& d_)
+      : Object(Type::cell),
+        a(std::forward<T>(a_)),
+        d(std::forward<U>(d_)) {
+    metrics().add(Counter::cells, 1);
+    return;
+  }
+
+  // unlinks the cdr chain one by one, so that freeing a long list doesn't
+  // recurse as deep as the list is long.
+  ~Cell() override {
+    auto next = std::move(d);
+    while (next != nullptr &&
+           next->type() == Type::cell &&
+           next.use_count() == 1) {
+      auto after = std::move(static_cast<Cell*>(next.get())->d);
+      next = std::move(after);
     }
-    printf(")");
     return;
   }
 
@@ -126,7 +399,7 @@ class Token : public Object {
  private:
   const TokenID id;
 
-  explicit Token(TokenID id_) : id(id_) {
+  explicit Token(TokenID id_) : Object(Type::token), id(id_) {
     return;
   }
 
@@ -144,865 +417,8159 @@ class Token : public Object {
     return;
   }
 
-  Type type() const override {
-    return Type::token;
+  TokenID get_id() const {
+    return id;
   }
+};
+
+class Number : public Object {
+ private:
+  const int64_t value;
 
-  void print() const override {
-    printf("%zd", id);
+ public:
+  explicit Number(int64_t value_) : Object(Type::number), value(value_) {
     return;
   }
 
-  TokenID get_id() const {
-    return id;
+  ~Number() override {
+    return;
+  }
+
+  int64_t get_value() const {
+    return value;
   }
 };
 
-using Unicode = uint32_t;
-class File {
+class Flonum : public Object {
  private:
-  std::vector<uint8_t> source;
-  std::size_t index;
+  double value;
 
-  std::map<std::vector<Unicode>, TokenID> forward_map;
-  std::map<TokenID, std::vector<Unicode>> backword_map;
-  std::map<TokenID, TokenType> type_from_id;
+ public:
+  explicit Flonum(double value_) : Object(Type::flonum), value(value_) {
+    return;
+  }
+
+  ~Flonum() override {
+    return;
+  }
+
+  double get_value() const {
+    return value;
+  }
+
+  // only for a flonum which nothing else holds; see Machine::set_flonum.
+  void set_value(double value_) {
+    value = value_;
+    return;
+  }
+
+  // the bits of the value, which tell the flonums apart as eqv does.
+  uint64_t bits() const {
+    uint64_t x;
+    memcpy(&x, &value, sizeof(x));
+    return x;
+  }
+};
+
+class Character : public Object {
+ private:
+  const Unicode value;
 
  public:
-  explicit File(std::vector<uint8_t>&& source_)
-      : source(std::move(source_)),
-        index(0),
-        forward_map{},
-        backword_map{} {
-    init_maps();
+  explicit Character(Unicode value_) : Object(Type::character), value(value_) {
     return;
   }
 
-  std::shared_ptr<Object> read() {
-    auto first_token = get_next_token_id();
-    switch (type_from_id[first_token]) {
-      case TokenType::boolean:
-      case TokenType::number:
-      case TokenType::character:
-      case TokenType::string:
-      case TokenType::id:
-        return Token::make(first_token);
-      case TokenType::prefix:
-        // prefix item -> '(prefix item)
-        return std::make_shared<Cell>(Token::make(first_token),
-               std::make_shared<Cell>(read(), nullptr));
-      case TokenType::dot:
-      case TokenType::unknown:
-        return nullptr;
-      case TokenType::parent:
-        break;
-    }
-    if (first_token == static_cast<TokenID>(SpecialTokenID::rparent)) {
-      return nullptr;
-    }
-    auto ret = std::make_shared<Cell>();
-    auto current = ret;
-    std::shared_ptr<Cell> current_prev = nullptr;
-    for (;;) {
-      auto old_index = index;
-      auto second_token = get_next_token_id();
-      if (second_token == static_cast<TokenID>(SpecialTokenID::rparent)) {
-        if (current_prev == nullptr) {
-          // (a b) == (a . (b . nil))
-          // (a) == (a . nil)
-          // () == nil
-          return nullptr;
-        } else {
-          return ret;
-        }
-      } else if (second_token == static_cast<TokenID>(SpecialTokenID::dot)) {
-        if (current_prev == nullptr) {
-          // invalid `("(" "." ,@any)
-          return nullptr;
-        } else {
-          current_prev->set_cdr(read());
-          auto last_token = get_next_token_id();
-          if (last_token != static_cast<TokenID>(SpecialTokenID::rparent)) {
-            return nullptr;
-          }
-          return ret;
-        }
-      }
-      index = old_index;
-      current->set_car(read());
-      if (current_prev != nullptr) {
-        current_prev->set_cdr(current);
-      }
-      current_prev = std::move(current);
-      current = std::make_shared<Cell>();
-    }
+  ~Character() override {
+    return;
   }
 
-  bool eof() {
-    return index == source.size();
+  Unicode get_value() const {
+    return value;
   }
+};
 
-  TokenType token_type_from_id(TokenID id) const {
-    auto it = type_from_id.find(id);
-    if (it == type_from_id.end()) {
-      return TokenType::unknown;
-    } else {
-      return it->second;
+// an immutable utf-8 string. the short ones are stored inline, and the long
+// ones are slices of a shared buffer, so that substrings don't copy.
+class String : public Object {
+ private:
+  static constexpr std::size_t inline_capacity = 24;
+  // every n-th code point remembers its byte offset for string-ref.
+  static constexpr std::size_t index_interval = 64;
+
+  const std::shared_ptr<const std::vector<uint8_t>> buffer;
+  const uint8_t* bytes;
+  const std::size_t size;
+  std::size_t length;
+  std::array<uint8_t, inline_capacity> inline_bytes;
+  mutable std::atomic<uint64_t> hash_value;
+  mutable std::once_flag index_once;
+  mutable std::vector<std::size_t> index;
+
+  String(const std::shared_ptr<const std::vector<uint8_t>>& buffer_,
+         const uint8_t* bytes_,
+         std::size_t size_,
+         std::size_t length_)
+      : Object(Type::string),
+        buffer(buffer_),
+        bytes(bytes_),
+        size(size_),
+        length(length_),
+        inline_bytes{},
+        hash_value(0),
+        index_once{},
+        index{} {
+    if (buffer == nullptr) {
+      memcpy(inline_bytes.data(), bytes_, size);
+      bytes = inline_bytes.data();
     }
+    return;
   }
 
-  const std::vector<Unicode>& token_from_id(TokenID id) const {
-    auto it = backword_map.find(id);
-    if (it == backword_map.end()) {
-      auto nil = static_cast<TokenID>(SpecialTokenID::nil);
-      return backword_map.find(nil)->second;
+  static std::shared_ptr<String> make(
+      const std::shared_ptr<const std::vector<uint8_t>>& buffer,
+      const uint8_t* bytes,
+      std::size_t size,
+      std::size_t length) {
+    struct impl : public String {
+      impl(const std::shared_ptr<const std::vector<uint8_t>>& buffer_,
+           const uint8_t* bytes_,
+           std::size_t size_,
+           std::size_t length_)
+          : String(buffer_, bytes_, size_, length_) {}
+    };
+    if (size <= inline_capacity) {
+      return std::make_shared<impl>(nullptr, bytes, size, length);
     } else {
-      return it->second;
+      return std::make_shared<impl>(buffer, bytes, size, length);
     }
   }
 
- private:
-  void init_maps() {
-    regist_as({},              SpecialTokenID::nil,         TokenType::unknown);
-    regist_as({'#', 't'},      SpecialTokenID::t,           TokenType::boolean);
-    regist_as({'#', 'f'},      SpecialTokenID::f,           TokenType::boolean);
-    regist_as({'('},           SpecialTokenID::lparent,     TokenType::parent);
-    regist_as({')'},           SpecialTokenID::rparent,     TokenType::parent);
-    regist_as({'\''},          SpecialTokenID::quote,       TokenType::prefix);
-    regist_as({'`'},           SpecialTokenID::quasiquote,  TokenType::prefix);
-    regist_as({','},           SpecialTokenID::comma,       TokenType::prefix);
-    regist_as({',', '@'},      SpecialTokenID::comma_at,    TokenType::prefix);
-    regist_as({'.'},           SpecialTokenID::dot,         TokenType::dot);
-    regist_as({'.', '.', '.'}, SpecialTokenID::dots,        TokenType::id);
-    regist_as({'c', 'o', 'n', 's'}, SpecialTokenID::cons,   TokenType::id);
-    regist_as({'c', 'a', 'r'},      SpecialTokenID::car,    TokenType::id);
-    regist_as({'c', 'd', 'r'},      SpecialTokenID::cdr,    TokenType::id);
-    regist_as({'a', 't', 'o', 'm'}, SpecialTokenID::atom,   TokenType::id);
-    regist_as({'e', 'q'},           SpecialTokenID::eq,     TokenType::id);
-    regist_as({'c', 'o', 'n', 'd'},
-              SpecialTokenID::cond,   TokenType::id);
-    regist_as({'l', 'a', 'm', 'b', 'd', 'a'},
-              SpecialTokenID::lambda, TokenType::id);
-    regist_as({'d', 'e', 'f', 'i', 'n', 'e'},
-              SpecialTokenID::define, TokenType::id);
-    regist_as({'q', 'u', 'o', 't', 'e'},
-              SpecialTokenID::quote2, TokenType::id);
-    regist_as({'+'},      SpecialTokenID::add, TokenType::id);
-    regist_as({'-'},      SpecialTokenID::sub, TokenType::id);
-    regist_as({'*'},      SpecialTokenID::mul, TokenType::id);
-    regist_as({'/'},      SpecialTokenID::div, TokenType::id);
-    regist_as({'%'},      SpecialTokenID::mod, TokenType::id);
-    regist_as({'<', '='}, SpecialTokenID::le,  TokenType::id);
-    regist_as({'<'},      SpecialTokenID::lt,  TokenType::id);
-    regist_as({'>', '='}, SpecialTokenID::ge,  TokenType::id);
-    regist_as({'>'},      SpecialTokenID::gt,  TokenType::id);
-    return;
+  static std::size_t count_code_points(const uint8_t* bytes,
+                                       std::size_t size) {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      count += (bytes[i] & 0xc0) != 0x80;
+    }
+    return count;
   }
 
-  // it decodes from utf-8 stream
-  Unicode get_next_unicode() {
-    if (index >= source.size()) {
-      return 0;
-    }
-    auto c0 = static_cast<Unicode>(source[index]); index++;
-    if (c0 < 0x80) {
-      return c0;
-    } else if (c0 < 0xc2) {
-      return 0;
-    } else if (c0 < 0xe0) {
-      if (index >= source.size()) {
-        return 0;
-      }
-      auto c1 = static_cast<Unicode>(source[index]); index++;
-      if ((c1 & 0xc0) != 0x80) {
-        return 0;
-      }
-      return ((c0 & 0x1f) << 6) |
-              (c1 & 0x3f);
-    } else if (c0 < 0xf0) {
-      if (index + 1 >= source.size()) {
-        return 0;
-      }
-      auto c1 = static_cast<Unicode>(source[index]); index++;
-      auto c2 = static_cast<Unicode>(source[index]); index++;
-      if (((c1 & 0xc0) != 0x80) ||
-          ((c2 & 0xc0) != 0x80)) {
-        return 0;
-      }
-      return ((c0 & 0x0f) << 12) |
-             ((c1 & 0x3f) <<  6) |
-              (c2 & 0x3f);
-    } else if (c0 < 0xf8) {
-      if (index + 2 >= source.size()) {
-        return 0;
-      }
-      auto c1 = static_cast<Unicode>(source[index]); index++;
-      auto c2 = static_cast<Unicode>(source[index]); index++;
-      auto c3 = static_cast<Unicode>(source[index]); index++;
-      if (((c1 & 0xc0) != 0x80) ||
-          ((c2 & 0xc0) != 0x80) ||
-          ((c3 & 0xc0) != 0x80)) {
-        return 0;
-      }
-      return ((c0 & 0x07) << 18) |
-             ((c1 & 0x3f) << 12) |
-             ((c2 & 0x3f) <<  6) |
-              (c3 & 0x3f);
-    } else if (c0 < 0xfc) {
-      if (index + 3 >= source.size()) {
-        return 0;
-      }
-      auto c1 = static_cast<Unicode>(source[index]); index++;
-      auto c2 = static_cast<Unicode>(source[index]); index++;
-      auto c3 = static_cast<Unicode>(source[index]); index++;
-      auto c4 = static_cast<Unicode>(source[index]); index++;
-      if (((c1 & 0xc0) != 0x80) ||
-          ((c2 & 0xc0) != 0x80) ||
-          ((c3 & 0xc0) != 0x80) ||
-          ((c4 & 0xc0) != 0x80)) {
-        return 0;
-      }
-      return ((c0 & 0x03) << 24) |
-             ((c1 & 0x3f) << 18) |
-             ((c2 & 0x3f) << 12) |
-             ((c3 & 0x3f) <<  6) |
-              (c4 & 0x3f);
-    } else if (c0 < 0xfe) {
-      if (index + 4 >= source.size()) {
-        return 0;
-      }
-      auto c1 = static_cast<Unicode>(source[index]); index++;
-      auto c2 = static_cast<Unicode>(source[index]); index++;
-      auto c3 = static_cast<Unicode>(source[index]); index++;
-      auto c4 = static_cast<Unicode>(source[index]); index++;
-      auto c5 = static_cast<Unicode>(source[index]); index++;
-      if (((c1 & 0xc0) != 0x80) ||
-          ((c2 & 0xc0) != 0x80) ||
-          ((c3 & 0xc0) != 0x80) ||
-          ((c4 & 0xc0) != 0x80) ||
-          ((c5 & 0xc0) != 0x80)) {
-        return 0;
-      }
-      return ((c0 & 0x01) << 30) |
-             ((c1 & 0x3f) << 24) |
-             ((c2 & 0x3f) << 18) |
-             ((c3 & 0x3f) << 12) |
-             ((c4 & 0x3f) <<  6) |
-              (c5 & 0x3f);
-    } else {
-      return 0;
-    }
+ public:
+  String() = delete;
+
+  static std::shared_ptr<String> make(std::vector<uint8_t>&& data) {
+    return make(std::move(data), count_code_points(data.data(), data.size()));
   }
 
-  TokenID get_next_token_id() {
-    auto c0 = get_next_unicode();
-    while (c0 == ' ' || c0 == '\t' || c0 == '\r' || c0 == '\n') {
-      c0 = get_next_unicode();
-    }
-    switch (c0) {
-      case 0:
-        return static_cast<TokenID>(SpecialTokenID::nil);
-      case '(':
-        return static_cast<TokenID>(SpecialTokenID::lparent);
-      case ')':
-        return static_cast<TokenID>(SpecialTokenID::rparent);
-      case '\'':
-        return static_cast<TokenID>(SpecialTokenID::quote);
-      case '`':
-        return static_cast<TokenID>(SpecialTokenID::quasiquote);
-      case ',': {
-        auto old_index = index;
-        auto c1 = get_next_unicode();
-        if (c1 == '@') {
-          return static_cast<TokenID>(SpecialTokenID::comma_at);
-        } else {
-          index = old_index;
-          return static_cast<TokenID>(SpecialTokenID::comma);
-        }
-      }
-      case '"': {
-        std::vector<Unicode> token{};
-        for (;;) {
-          auto ck = get_next_unicode();
-          if (ck == '"') {
-            return regist(std::move(token), TokenType::string);
-          } else if (ck == 0) {
-            return static_cast<TokenID>(SpecialTokenID::nil);
-          } else if (ck == '\\') {
-            ck = get_next_unicode();
-            switch (ck) {
-              case 't':
-                ck = '\t';
-                break;
-              case 'n':
-                ck = '\n';
-                break;
-              default:
-                break;
-            }
-          }
-          token.push_back(ck);
-        }
-      }
-      case ';':
-        while (!(c0 == '\r' || c0 == '\n' || c0 == 0)) {
-          c0 = get_next_unicode();
-        }
-        if (c0 == 0) {
-          return static_cast<TokenID>(SpecialTokenID::nil);
-        }
-        return get_next_token_id();
-      case '.':
-      case '+':
-      case '-': {
-        auto old_index = index;
-        auto c1 = get_next_unicode();
-        if ('0' <= c1 && c1 <= '9') {
-          index = old_index;
-          break;
-        } else if (c0 == '.') {
-          if (c1 == '.') {
-            if (get_next_unicode() == '.') {
-              return static_cast<TokenID>(SpecialTokenID::dots);
-            } else {
-              return 0;
-            }
-          } else {
-            index = old_index;
-            return static_cast<TokenID>(SpecialTokenID::dot);
-          }
-        } else {
-          index = old_index;
-          std::vector<Unicode> token{c0};
-          return regist(std::move(token), TokenType::id);
-        }
-      }
-      case '#': {
-        auto c1 = get_next_unicode();
-        if (c1 == 't') {
-          return static_cast<TokenID>(SpecialTokenID::t);
-        } else if (c1 == 'f') {
-          return static_cast<TokenID>(SpecialTokenID::f);
-        } else if (c1 == '\\') {
-          auto c2 = get_next_unicode();
-          std::vector<Unicode> token{c0, c1, c2};
-          return regist(std::move(token), TokenType::character);
-        } else {
-          return static_cast<TokenID>(SpecialTokenID::nil);
-        }
-      }
-      default:
-        break;
+  static std::shared_ptr<String> make(std::vector<uint8_t>&& data,
+                                      std::size_t length) {
+    if (data.size() <= inline_capacity) {
+      return make(nullptr, data.data(), data.size(), length);
     }
-    std::vector<Unicode> token{c0};
-    auto type = TokenType::unknown;
-    if (c0 == '.' || c0 == '+' || c0 == '-' || ('0' <= c0 && c0 <= '9')) {
-      type = TokenType::number;
-      bool dotted = c0 == '.';
-      for (;;) {
-        auto old_index = index;
-        auto ck = get_next_unicode();
-        if ((dotted && ck == '.') || !('0' <= ck && ck <= '9')) {
-          index = old_index;
-          break;
-        } else if (ck == '.') {
-          dotted = true;
-        }
-        token.push_back(ck);
-      }
-    } else {
-      type = TokenType::id;
-      for (;;) {
-        auto old_index = index;
-        auto ck = get_next_unicode();
-        if (ck == '!' || ck == '$' || ck == '%' || ck == '&' || ck == '*' ||
-            ck == '+' || ck == '-' || ck == '.' || ck == '/' || ck == ':' ||
-            ck == '<' || ck == '=' || ck == '>' || ck == '?' || ck == '@' ||
-            ck == '^' || ck == '_' || ck == '~' ||
-            ('a' <= ck && ck <= 'z') ||
-            ('A' <= ck && ck <= 'Z') ||
-            ('0' <= ck && ck <= '9')) {
-          token.push_back(ck);
-        } else {
-          index = old_index;
-          break;
-        }
-      }
+    auto buffer = std::make_shared<const std::vector<uint8_t>>(
+        std::move(data));
+    return make(buffer, buffer->data(), buffer->size(), length);
+  }
+
+  static std::shared_ptr<String> make(const std::vector<Unicode>& text) {
+    std::vector<uint8_t> data{};
+    for (auto&& ch : text) {
+      encode(ch, &data);
     }
-    return regist(std::move(token), type);
+    return make(std::move(data));
   }
 
-  TokenID regist(std::vector<Unicode>&& token, TokenType type) {
-    auto it = forward_map.find(token);
-    if (it == forward_map.end()) {
-      auto new_id = static_cast<TokenID>(forward_map.size());
-      forward_map[token] = new_id;
-      backword_map[new_id] = std::move(token);
-      type_from_id[new_id] = type;
-      return new_id;
-    } else {
-      return it->second;
+  static void encode(Unicode ch, std::vector<uint8_t>* data) {
+    if (ch < 0x80) {
+      data->push_back(static_cast<uint8_t>(ch));
+      return;
     }
+    int n = ch < 0x800 ? 1 : ch < 0x10000 ? 2 : ch < 0x200000 ? 3
+          : ch < 0x4000000 ? 4 : 5;
+    data->push_back(static_cast<uint8_t>((0xff << (7 - n)) | (ch >> (6 * n))));
+    for (int i = n - 1; i >= 0; --i) {
+      data->push_back(static_cast<uint8_t>(0x80 | ((ch >> (6 * i)) & 0x3f)));
+    }
+    return;
   }
 
-  void regist_as(std::vector<Unicode>&& token,
-                 SpecialTokenID sid,
-                 TokenType type) {
-    auto id = static_cast<TokenID>(sid);
-    forward_map[token] = id;
-    backword_map[id] = std::move(token);
-    type_from_id[id] = type;
+  ~String() override {
     return;
   }
-};
 
-enum class ISA {
-  load_true, load_false, load_number, load_character, load_string,
-  load_dynamic, load_up, mov,
-  cons, car, cdr, atom, eq, br, bfalse, label,
-};
+  std::size_t get_length() const {
+    return length;
+  }
 
-struct Instruction {
-  ISA instruction;
-  uint64_t operand[3];
+  const uint8_t* data() const {
+    return bytes;
+  }
 
-  explicit Instruction(ISA inst,
-                       uint64_t o1 = 0,
-                       uint64_t o2 = 0,
-                       uint64_t o3 = 0)
-      : instruction(inst),
-        operand{o1, o2, o3} {
-    return;
+  std::size_t byte_size() const {
+    return size;
   }
 
-  void print() {
-    switch (instruction) {
-      case ISA::load_true:
-        printf("r%zu <- true\n", operand[0]);
-        break;
-      case ISA::load_false:
-        printf("r%zu <- false\n", operand[0]);
-        break;
-      case ISA::load_number:
-        printf("r%zu <- %zd\n", operand[0], operand[1]);
-        break;
-      case ISA::load_character:
-        printf("r%zu <- '%c'\n",
-               operand[0],
-               static_cast<int>(operand[1]));
-        break;
-      case ISA::load_string:
-        printf("r%zu <- token[%zu]\n", operand[0], operand[1]);
-        break;
-      case ISA::load_dynamic:
-        printf("r%zu <- dynamic_table[%zu]\n", operand[0], operand[1]);
-        break;
-      case ISA::load_up:
-        printf("r%zu <- up_table[%zu]\n", operand[0], operand[1]);
-        break;
-      case ISA::mov:
-        printf("r%zu <- r%zu\n", operand[0], operand[1]);
-        break;
-      case ISA::cons:
-        printf("r%zu <- cons r%zu, r%zu\n", operand[0], operand[1], operand[2]);
-        break;
-      case ISA::car:
-        printf("r%zu <- car r%zu\n", operand[0], operand[1]);
-        break;
-      case ISA::cdr:
-        printf("r%zu <- cdr r%zu\n", operand[0], operand[1]);
-        break;
-      case ISA::atom:
-        printf("r%zu <- atom r%zu\n", operand[0], operand[1]);
-        break;
-      case ISA::eq:
-        printf("r%zu <- eq r%zu, r%zu\n", operand[0], operand[1], operand[2]);
-        break;
-      case ISA::br:
-        printf("br %zu\n", operand[0]);
-        break;
-      case ISA::bfalse:
-        printf("bfalse r%zu, %zu\n", operand[0], operand[1]);
-        break;
-      case ISA::label:
-        printf("label %zu:\n", operand[0]);
-        break;
+  // k < get_length()
+  Unicode ref(std::size_t k) const {
+    auto i = byte_offset(k);
+    Unicode ch = bytes[i];
+    if (ch < 0x80) {
+      return ch;
     }
-    return;
+    int n = ch < 0xe0 ? 1 : ch < 0xf0 ? 2 : ch < 0xf8 ? 3 : ch < 0xfc ? 4 : 5;
+    ch &= 0x3fu >> n;
+    for (int j = 1; j <= n; ++j) {
+      ch = (ch << 6) | (bytes[i + static_cast<std::size_t>(j)] & 0x3fu);
+    }
+    return ch;
   }
-};
 
-int64_t itoa(const std::vector<Unicode>& v) {
-  int64_t ret = 0;
-  bool sign = false;
-  for (auto&& ch : v) {
-    if (ch == '-') {
-      sign = true;
-    } else if ('0' <= ch && ch <= '9') {
-      ret = ret * 10 + ch - '0';
-    } else if (ch == '.') {
-      break;
+  // start <= end <= get_length()
+  std::shared_ptr<String> slice(std::size_t start, std::size_t end) const {
+    auto from = byte_offset(start);
+    return make(buffer, bytes + from, byte_offset(end) - from, end - start);
+  }
+
+  std::shared_ptr<String> append(const String& other) const {
+    std::vector<uint8_t> data{};
+    data.reserve(size + other.size);
+    data.insert(data.end(), bytes, bytes + size);
+    data.insert(data.end(), other.bytes, other.bytes + other.size);
+    return make(std::move(data), length + other.length);
+  }
+
+  // returns the code point index of the pattern, or -1.
+  int64_t find(const String& pattern) const {
+    auto found = static_cast<const uint8_t*>(
+        memmem(bytes, size, pattern.bytes, pattern.size));
+    if (found == nullptr) {
+      return -1;
     }
+    auto offset = static_cast<std::size_t>(found - bytes);
+    if (length == size) {
+      return static_cast<int64_t>(offset);
+    }
+    return static_cast<int64_t>(count_code_points(bytes, offset));
   }
-  if (sign) {
-    return -ret;
-  } else {
-    return ret;
+
+  // the pieces share the buffer with this string.
+  std::vector<std::shared_ptr<String>> split(Unicode delimiter) const {
+    std::vector<uint8_t> pattern{};
+    encode(delimiter, &pattern);
+    std::vector<std::shared_ptr<String>> pieces{};
+    std::size_t from = 0;
+    for (;;) {
+      const uint8_t* found;
+      if (pattern.size() == 1) {
+        found = static_cast<const uint8_t*>(
+            memchr(bytes + from, pattern[0], size - from));
+      } else {
+        found = static_cast<const uint8_t*>(
+            memmem(bytes + from, size - from, pattern.data(), pattern.size()));
+      }
+      auto to = found == nullptr ? size
+                                 : static_cast<std::size_t>(found - bytes);
+      pieces.push_back(make(buffer,
+                            bytes + from,
+                            to - from,
+                            count_code_points(bytes + from, to - from)));
+      if (found == nullptr) {
+        return pieces;
+      }
+      from = to + pattern.size();
+    }
   }
-}
 
-struct Snippet {
-  std::shared_ptr<std::vector<Instruction>> instructions;
+  // fnv-1a; 0 means not computed yet.
+  uint64_t hash() const {
+    auto h = hash_value.load(std::memory_order_relaxed);
+    if (h != 0) {
+      return h;
+    }
+    h = 0xcbf29ce484222325ull;
+    for (std::size_t i = 0; i < size; ++i) {
+      h = (h ^ bytes[i]) * 0x100000001b3ull;
+    }
+    if (h == 0) {
+      h = 1;
+    }
+    hash_value.store(h, std::memory_order_relaxed);
+    return h;
+  }
 
-  Snippet() : instructions(std::make_shared<std::vector<Instruction>>()) {
+  bool equals(const String& other) const {
+    if (this == &other) {
+      return true;
+    } else if (size != other.size) {
+      return false;
+    }
+    auto h1 = hash_value.load(std::memory_order_relaxed);
+    auto h2 = other.hash_value.load(std::memory_order_relaxed);
+    if (h1 != 0 && h2 != 0 && h1 != h2) {
+      return false;
+    }
+    return memcmp(bytes, other.bytes, size) == 0;
+  }
+
+ private:
+  std::size_t byte_offset(std::size_t k) const {
+    if (length == size) {
+      return k;
+    } else if (k == length) {
+      return size;
+    }
+    std::call_once(index_once, [this] {
+      std::size_t count = 0;
+      for (std::size_t i = 0; i < size; ++i) {
+        if ((bytes[i] & 0xc0) != 0x80) {
+          if (count % index_interval == 0) {
+            index.push_back(i);
+          }
+          count++;
+        }
+      }
+    });
+    auto i = index[k / index_interval];
+    for (auto n = k % index_interval; n > 0; --n) {
+      do {
+        i++;
+      } while ((bytes[i] & 0xc0) == 0x80);
+    }
+    return i;
+  }
+};
+
+// the result of (future x); filled in exactly once by the task running x.
+class Future : public Object {
+ private:
+  std::atomic<bool> ready;
+  std::shared_ptr<Object> value;
+
+ public:
+  Future() : Object(Type::future), ready(false), value(nullptr) {
     return;
   }
 
-  void push_back(Instruction&& inst) {
-    instructions->push_back(std::move(inst));
+  ~Future() override {
     return;
   }
 
-  void print() {
-    for (auto it = instructions->begin(); it != instructions->end(); ++it) {
-      it->print();
-    }
+  bool is_ready() const {
+    return ready.load(std::memory_order_acquire);
+  }
+
+  void set_value(std::shared_ptr<Object>&& value_) {
+    value = std::move(value_);
+    ready.store(true, std::memory_order_release);
+    return;
+  }
+
+  const std::shared_ptr<Object>& get_value() const {
+    return value;
   }
 };
 
-class Scope {
+class Vector : public Object {
+ private:
+  std::vector<std::shared_ptr<Object>> elements;
+
  public:
-  static constexpr uint64_t not_found = 0xffffffff;
-  static constexpr uint64_t found_but_in_the_up = 0xfffffffe;
+  Vector(std::size_t size, const std::shared_ptr<Object>& fill)
+      : Object(Type::vector),
+        elements(size, fill) {
+    return;
+  }
+
+  ~Vector() override {
+    return;
+  }
+
+  std::size_t size() const {
+    return elements.size();
+  }
 
+  const std::shared_ptr<Object>& ref(std::size_t k) const {
+    return elements[k];
+  }
+
+  template <typename T>
+  void set(std::size_t k, T&& x) {
+    elements[k] = std::forward<T>(x);
+    return;
+  }
+};
+
+// a vector of unboxed doubles, which the numeric kernels below work on.
+class F64Vector : public Object {
  private:
-  std::shared_ptr<Scope> up_values;
-  std::map<TokenID, uint64_t> lexical_scope;
+  std::vector<double> elements;
 
  public:
-  Scope() : up_values(nullptr), lexical_scope{} {
+  F64Vector(std::size_t size, double fill)
+      : Object(Type::f64vector),
+        elements(size, fill) {
     return;
   }
 
-  explicit Scope(std::shared_ptr<Scope> scope)
-      : up_values(scope),
-        lexical_scope{} {
+  explicit F64Vector(std::vector<double>&& elements_)
+      : Object(Type::f64vector),
+        elements(std::move(elements_)) {
     return;
   }
 
-  uint64_t find(TokenID id) const {
-    auto it = lexical_scope.find(id);
-    if (it != lexical_scope.end()) {
-      return it->second;
-    } else if (up_values != nullptr && up_values->find(id) != not_found) {
-      return found_but_in_the_up;
+  ~F64Vector() override {
+    return;
+  }
+
+  std::size_t size() const {
+    return elements.size();
+  }
+
+  double ref(std::size_t k) const {
+    return elements[k];
+  }
+
+  void set(std::size_t k, double x) {
+    elements[k] = x;
+    return;
+  }
+
+  const double* data() const {
+    return elements.data();
+  }
+
+  double* data() {
+    return elements.data();
+  }
+};
+
+// the kernels of the f64vector primitives. x86-64 builds carry avx and sse2
+// versions of the loops besides the scalar one, and pick one by the cpu.
+enum class F64Level {
+  scalar, sse2, avx,
+};
+
+F64Level f64_level() {
+#if defined(__x86_64__)
+  static const auto level = __builtin_cpu_supports("avx") ? F64Level::avx
+                                                          : F64Level::sse2;
+  return level;
+#else
+  return F64Level::scalar;
+#endif
+}
+
+enum class F64Op {
+  add, sub, mul, div,
+};
+
+template <F64Op op>
+inline double f64_apply(double x, double y) {
+  switch (op) {
+    case F64Op::add:
+      return x + y;
+    case F64Op::sub:
+      return x - y;
+    case F64Op::mul:
+      return x * y;
+    case F64Op::div:
+      return x / y;
+  }
+  return 0.0;
+}
+
+// the folds keep 16 partial results, one for each k % 16, so that the adds
+// don't wait on each other, and merge them pairwise. every version adds in
+// that order, so the results don't depend on the cpu.
+enum class F64Fold {
+  sum, dot, min, max,
+};
+
+constexpr std::size_t f64_lanes = 16;
+
+template <F64Fold op>
+inline double f64_step(double acc, double x, double y) {
+  switch (op) {
+    case F64Fold::sum:
+      return acc + x;
+    case F64Fold::dot:
+      return acc + x * y;
+    case F64Fold::min:
+      return x < acc ? x : acc;
+    case F64Fold::max:
+      return x > acc ? x : acc;
+  }
+  return acc;
+}
+
+template <F64Fold op>
+inline double f64_merge(double x, double y) {
+  switch (op) {
+    case F64Fold::sum:
+    case F64Fold::dot:
+      return x + y;
+    case F64Fold::min:
+      return y < x ? y : x;
+    case F64Fold::max:
+      return y > x ? y : x;
+  }
+  return x;
+}
+
+// folds x[k..n) into the partial results and merges them.
+template <F64Fold op>
+double f64_finish(double* lanes,
+                  const double* x,
+                  const double* y,
+                  std::size_t k,
+                  std::size_t n) {
+  for (; k < n; ++k) {
+    lanes[k % f64_lanes] = f64_step<op>(lanes[k % f64_lanes], x[k], y[k]);
+  }
+  for (std::size_t width = f64_lanes / 2; width > 0; width /= 2) {
+    for (std::size_t l = 0; l < width; ++l) {
+      lanes[l] = f64_merge<op>(lanes[l], lanes[l + width]);
     }
-    return not_found;
   }
+  return lanes[0];
+}
 
-  bool define(TokenID id) {
-    if (lexical_scope.find(id) == lexical_scope.end()) {
-      auto reg_num = lexical_scope.size();
-      lexical_scope[id] = static_cast<uint64_t>(reg_num);
+template <F64Op op>
+void f64_map_scalar(const double* x,
+                    const double* y,
+                    double* z,
+                    std::size_t n) {
+  for (std::size_t k = 0; k < n; ++k) {
+    z[k] = f64_apply<op>(x[k], y[k]);
+  }
+  return;
+}
+
+template <F64Fold op>
+double f64_fold_scalar(const double* x,
+                       const double* y,
+                       std::size_t n,
+                       double init) {
+  std::array<double, f64_lanes> lanes;
+  lanes.fill(init);
+  std::size_t k = 0;
+  for (; k + f64_lanes <= n; k += f64_lanes) {
+    for (std::size_t l = 0; l < f64_lanes; ++l) {
+      lanes[l] = f64_step<op>(lanes[l], x[k + l], y[k + l]);
+    }
+  }
+  return f64_finish<op>(lanes.data(), x, y, k, n);
+}
+
+#if defined(__x86_64__)
+template <F64Op op>
+inline __m128d f64_apply(__m128d x, __m128d y) {
+  switch (op) {
+    case F64Op::add:
+      return _mm_add_pd(x, y);
+    case F64Op::sub:
+      return _mm_sub_pd(x, y);
+    case F64Op::mul:
+      return _mm_mul_pd(x, y);
+    case F64Op::div:
+      return _mm_div_pd(x, y);
+  }
+  return x;
+}
+
+// minpd and maxpd give the second operand unless the first one wins,
+// as f64_step does.
+template <F64Fold op>
+inline __m128d f64_step(__m128d acc, __m128d x, __m128d y) {
+  switch (op) {
+    case F64Fold::sum:
+      return _mm_add_pd(acc, x);
+    case F64Fold::dot:
+      return _mm_add_pd(acc, _mm_mul_pd(x, y));
+    case F64Fold::min:
+      return _mm_min_pd(x, acc);
+    case F64Fold::max:
+      return _mm_max_pd(x, acc);
+  }
+  return acc;
+}
+
+template <F64Op op>
+void f64_map_sse2(const double* x,
+                  const double* y,
+                  double* z,
+                  std::size_t n) {
+  std::size_t k = 0;
+  for (; k + 2 <= n; k += 2) {
+    _mm_storeu_pd(z + k, f64_apply<op>(_mm_loadu_pd(x + k),
+                                       _mm_loadu_pd(y + k)));
+  }
+  for (; k < n; ++k) {
+    z[k] = f64_apply<op>(x[k], y[k]);
+  }
+  return;
+}
+
+template <F64Fold op>
+double f64_fold_sse2(const double* x,
+                     const double* y,
+                     std::size_t n,
+                     double init) {
+  static_assert(f64_lanes == 16, "one accumulator for every two lanes");
+  auto a0 = _mm_set1_pd(init), a1 = a0, a2 = a0, a3 = a0;
+  auto a4 = a0, a5 = a0, a6 = a0, a7 = a0;
+  std::size_t k = 0;
+  for (; k + f64_lanes <= n; k += f64_lanes) {
+    a0 = f64_step<op>(a0, _mm_loadu_pd(x + k), _mm_loadu_pd(y + k));
+    a1 = f64_step<op>(a1, _mm_loadu_pd(x + k + 2), _mm_loadu_pd(y + k + 2));
+    a2 = f64_step<op>(a2, _mm_loadu_pd(x + k + 4), _mm_loadu_pd(y + k + 4));
+    a3 = f64_step<op>(a3, _mm_loadu_pd(x + k + 6), _mm_loadu_pd(y + k + 6));
+    a4 = f64_step<op>(a4, _mm_loadu_pd(x + k + 8), _mm_loadu_pd(y + k + 8));
+    a5 = f64_step<op>(a5, _mm_loadu_pd(x + k + 10), _mm_loadu_pd(y + k + 10));
+    a6 = f64_step<op>(a6, _mm_loadu_pd(x + k + 12), _mm_loadu_pd(y + k + 12));
+    a7 = f64_step<op>(a7, _mm_loadu_pd(x + k + 14), _mm_loadu_pd(y + k + 14));
+  }
+  std::array<double, f64_lanes> lanes;
+  _mm_storeu_pd(lanes.data(), a0);
+  _mm_storeu_pd(lanes.data() + 2, a1);
+  _mm_storeu_pd(lanes.data() + 4, a2);
+  _mm_storeu_pd(lanes.data() + 6, a3);
+  _mm_storeu_pd(lanes.data() + 8, a4);
+  _mm_storeu_pd(lanes.data() + 10, a5);
+  _mm_storeu_pd(lanes.data() + 12, a6);
+  _mm_storeu_pd(lanes.data() + 14, a7);
+  return f64_finish<op>(lanes.data(), x, y, k, n);
+}
+
+template <F64Op op>
+__attribute__((target("avx")))
+inline __m256d f64_apply(__m256d x, __m256d y) {
+  switch (op) {
+    case F64Op::add:
+      return _mm256_add_pd(x, y);
+    case F64Op::sub:
+      return _mm256_sub_pd(x, y);
+    case F64Op::mul:
+      return _mm256_mul_pd(x, y);
+    case F64Op::div:
+      return _mm256_div_pd(x, y);
+  }
+  return x;
+}
+
+template <F64Fold op>
+__attribute__((target("avx")))
+inline __m256d f64_step(__m256d acc, __m256d x, __m256d y) {
+  switch (op) {
+    case F64Fold::sum:
+      return _mm256_add_pd(acc, x);
+    case F64Fold::dot:
+      return _mm256_add_pd(acc, _mm256_mul_pd(x, y));
+    case F64Fold::min:
+      return _mm256_min_pd(x, acc);
+    case F64Fold::max:
+      return _mm256_max_pd(x, acc);
+  }
+  return acc;
+}
+
+template <F64Op op>
+__attribute__((target("avx")))
+void f64_map_avx(const double* x,
+                 const double* y,
+                 double* z,
+                 std::size_t n) {
+  std::size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    _mm256_storeu_pd(z + k, f64_apply<op>(_mm256_loadu_pd(x + k),
+                                          _mm256_loadu_pd(y + k)));
+  }
+  for (; k < n; ++k) {
+    z[k] = f64_apply<op>(x[k], y[k]);
+  }
+  return;
+}
+
+template <F64Fold op>
+__attribute__((target("avx")))
+double f64_fold_avx(const double* x,
+                    const double* y,
+                    std::size_t n,
+                    double init) {
+  static_assert(f64_lanes == 16, "one accumulator for every four lanes");
+  auto a0 = _mm256_set1_pd(init), a1 = a0, a2 = a0, a3 = a0;
+  std::size_t k = 0;
+  for (; k + f64_lanes <= n; k += f64_lanes) {
+    a0 = f64_step<op>(a0, _mm256_loadu_pd(x + k), _mm256_loadu_pd(y + k));
+    a1 = f64_step<op>(a1,
+                      _mm256_loadu_pd(x + k + 4),
+                      _mm256_loadu_pd(y + k + 4));
+    a2 = f64_step<op>(a2,
+                      _mm256_loadu_pd(x + k + 8),
+                      _mm256_loadu_pd(y + k + 8));
+    a3 = f64_step<op>(a3,
+                      _mm256_loadu_pd(x + k + 12),
+                      _mm256_loadu_pd(y + k + 12));
+  }
+  std::array<double, f64_lanes> lanes;
+  _mm256_storeu_pd(lanes.data(), a0);
+  _mm256_storeu_pd(lanes.data() + 4, a1);
+  _mm256_storeu_pd(lanes.data() + 8, a2);
+  _mm256_storeu_pd(lanes.data() + 12, a3);
+  return f64_finish<op>(lanes.data(), x, y, k, n);
+}
+#endif
+
+// z[k] = x[k] op y[k] for k in [0, n); z may be x or y.
+template <F64Op op>
+void f64_map(const double* x, const double* y, double* z, std::size_t n) {
+  switch (f64_level()) {
+#if defined(__x86_64__)
+    case F64Level::avx:
+      f64_map_avx<op>(x, y, z, n);
+      return;
+    case F64Level::sse2:
+      f64_map_sse2<op>(x, y, z, n);
+      return;
+#endif
+    default:
+      f64_map_scalar<op>(x, y, z, n);
+      return;
+  }
+}
+
+// y is read only by dot; the others pass x for it.
+template <F64Fold op>
+double f64_fold(const double* x, const double* y, std::size_t n, double init) {
+  switch (f64_level()) {
+#if defined(__x86_64__)
+    case F64Level::avx:
+      return f64_fold_avx<op>(x, y, n, init);
+    case F64Level::sse2:
+      return f64_fold_sse2<op>(x, y, n, init);
+#endif
+    default:
+      return f64_fold_scalar<op>(x, y, n, init);
+  }
+}
+
+enum class Equivalence {
+  eq, eqv, equal,
+};
+
+// eq compares the numbers and the characters by value in this lisp,
+// so eq and eqv are the same thing.
+bool is_eqv(const Object* x, const Object* y) {
+  if (x == y) {
+    return true;
+  } else if (x == nullptr || y == nullptr || x->type() != y->type()) {
+    return false;
+  }
+  switch (x->type()) {
+    case Type::token:
+      return static_cast<const Token*>(x)->get_id() ==
+             static_cast<const Token*>(y)->get_id();
+    case Type::number:
+      return static_cast<const Number*>(x)->get_value() ==
+             static_cast<const Number*>(y)->get_value();
+    case Type::flonum:
+      return static_cast<const Flonum*>(x)->bits() ==
+             static_cast<const Flonum*>(y)->bits();
+    case Type::character:
+      return static_cast<const Character*>(x)->get_value() ==
+             static_cast<const Character*>(y)->get_value();
+    default:
+      return false;
+  }
+}
+
+bool is_equal(const Object* x, const Object* y) {
+  for (;;) {
+    if (is_eqv(x, y)) {
       return true;
-    } else {
+    } else if (x == nullptr || y == nullptr || x->type() != y->type()) {
       return false;
     }
+    switch (x->type()) {
+      case Type::string:
+        return static_cast<const String*>(x)->equals(
+            *static_cast<const String*>(y));
+      case Type::vector: {
+        auto x_ = static_cast<const Vector*>(x);
+        auto y_ = static_cast<const Vector*>(y);
+        if (x_->size() != y_->size()) {
+          return false;
+        }
+        for (std::size_t i = 0; i < x_->size(); ++i) {
+          if (!is_equal(x_->ref(i).get(), y_->ref(i).get())) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case Type::f64vector: {
+        auto x_ = static_cast<const F64Vector*>(x);
+        auto y_ = static_cast<const F64Vector*>(y);
+        return x_->size() == y_->size() &&
+               memcmp(x_->data(), y_->data(),
+                      x_->size() * sizeof(double)) == 0;
+      }
+      case Type::cell: {
+        auto x_ = static_cast<const Cell*>(x);
+        auto y_ = static_cast<const Cell*>(y);
+        if (!is_equal(x_->car().get(), y_->car().get())) {
+          return false;
+        }
+        x = x_->cdr().get();
+        y = y_->cdr().get();
+        break;
+      }
+      default:
+        return false;
+    }
   }
+}
 
-  uint64_t base() {
-    return lexical_scope.size();
+uint64_t mix(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+uint64_t hash_eqv(const Object* x) {
+  if (x == nullptr) {
+    return mix(0);
   }
-};
+  switch (x->type()) {
+    case Type::token:
+      return mix(static_cast<const Token*>(x)->get_id());
+    case Type::number:
+      return mix(static_cast<uint64_t>(
+          static_cast<const Number*>(x)->get_value()));
+    case Type::flonum:
+      return mix(static_cast<const Flonum*>(x)->bits());
+    case Type::character:
+      return mix(static_cast<const Character*>(x)->get_value());
+    default:
+      return mix(reinterpret_cast<uintptr_t>(x));
+  }
+}
 
-Snippet compile(std::shared_ptr<Object> x,
-             const File& file,
-             uint64_t shift_width,
-             struct Snippet&& snippet,
-             std::shared_ptr<Scope> scope,
-             uint64_t* max_label_id) {
-  if (x->type() == Type::token) {
-    auto id = std::dynamic_pointer_cast<Token>(x)->get_id();
-    auto type = file.token_type_from_id(id);
-    if (type == TokenType::boolean) {
-      if (file.token_from_id(id)[1] == 't') {
-        snippet.push_back(Instruction(ISA::load_true, shift_width));
-      } else {
-        snippet.push_back(Instruction(ISA::load_false, shift_width));
+// looks at the first elements only, so that hashing is cheap on
+// long lists; equal objects still get the same hash.
+uint64_t hash_equal(const Object* x, int budget = 16) {
+  if (x == nullptr || budget <= 0) {
+    return mix(0);
+  }
+  switch (x->type()) {
+    case Type::string:
+      return static_cast<const String*>(x)->hash();
+    case Type::vector: {
+      auto x_ = static_cast<const Vector*>(x);
+      uint64_t h = mix(x_->size());
+      for (std::size_t i = 0; i < x_->size() && budget > 0; ++i, --budget) {
+        h = mix(h ^ hash_equal(x_->ref(i).get(), budget / 2));
       }
-    } else if (type == TokenType::number) {
-      auto value = static_cast<uint64_t>(itoa(file.token_from_id(id)));
-      snippet.push_back(Instruction(ISA::load_number, shift_width, value));
-    } else if (type == TokenType::character) {
-      auto value = file.token_from_id(id)[2];
-      snippet.push_back(Instruction(ISA::load_character, shift_width, value));
-    } else if (type == TokenType::string) {
-      snippet.push_back(Instruction(ISA::load_string, shift_width, id));
-    } else {
-      auto reg_num = scope->find(id);
-      if (reg_num == Scope::not_found) {
-        snippet.push_back(Instruction(ISA::load_dynamic, shift_width, id));
-      } else if (reg_num == Scope::found_but_in_the_up) {
-        snippet.push_back(Instruction(ISA::load_up, shift_width, id));
-      } else {
-        snippet.push_back(Instruction(ISA::mov, shift_width, reg_num));
+      return h;
+    }
+    case Type::cell: {
+      uint64_t h = mix(1);
+      for (; x != nullptr && x->type() == Type::cell && budget > 0; --budget) {
+        auto x_ = static_cast<const Cell*>(x);
+        h = mix(h ^ hash_equal(x_->car().get(), budget / 2));
+        x = x_->cdr().get();
       }
+      return mix(h ^ hash_equal(x, budget / 2));
     }
-  } else {
-    auto x_ = std::dynamic_pointer_cast<Cell>(x);
+    default:
+      return hash_eqv(x);
+  }
+}
+
+// open addressing with linear probing. every slot keeps the hash of its
+// key, so the probing and the growing never hash a key twice.
+class HashTable : public Object {
+ private:
+  // hashes 0 and 1 mark the empty and the deleted slots.
+  static constexpr uint64_t empty = 0;
+  static constexpr uint64_t deleted = 1;
+
+  struct Slot {
+    uint64_t hash;
+    std::shared_ptr<Object> key, value;
+  };
+
+  const Equivalence equivalence;
+  std::vector<Slot> slots;
+  std::size_t count;
+  std::size_t used;
+
+ public:
+  explicit HashTable(Equivalence equivalence_)
+      : Object(Type::hashtable),
+        equivalence(equivalence_),
+        slots(8),
+        count(0),
+        used(0) {
+    return;
+  }
+
+  ~HashTable() override {
+    return;
+  }
+
+  std::size_t size() const {
+    return count;
+  }
+
+  // returns nullptr if the key is not found.
+  const std::shared_ptr<Object>* find(
+      const std::shared_ptr<Object>& key) const {
+    auto i = find_slot(key.get(), hash(key.get()));
+    if (i == slots.size()) {
+      return nullptr;
+    }
+    return &slots[i].value;
+  }
+
+  void set(const std::shared_ptr<Object>& key,
+           const std::shared_ptr<Object>& value) {
+    auto h = hash(key.get());
+    auto i = find_slot(key.get(), h);
+    if (i != slots.size()) {
+      slots[i].value = value;
+      return;
+    }
+    if ((used + 1) * 4 > slots.size() * 3) {
+      rehash();
+    }
+    auto mask = slots.size() - 1;
+    for (i = h & mask; slots[i].hash > deleted; i = (i + 1) & mask) {
+      continue;
+    }
+    if (slots[i].hash == empty) {
+      used++;
+    }
+    slots[i].hash = h;
+    slots[i].key = key;
+    slots[i].value = value;
+    count++;
+    return;
+  }
+
+  bool erase(const std::shared_ptr<Object>& key) {
+    auto i = find_slot(key.get(), hash(key.get()));
+    if (i == slots.size()) {
+      return false;
+    }
+    slots[i].hash = deleted;
+    slots[i].key = nullptr;
+    slots[i].value = nullptr;
+    count--;
+    return true;
+  }
+
+ private:
+  uint64_t hash(const Object* key) const {
+    auto h = equivalence == Equivalence::equal ? hash_equal(key)
+                                               : hash_eqv(key);
+    return h <= deleted ? h + 2 : h;
+  }
+
+  std::size_t find_slot(const Object* key, uint64_t h) const {
+    auto mask = slots.size() - 1;
+    for (auto i = h & mask; slots[i].hash != empty; i = (i + 1) & mask) {
+      if (slots[i].hash != h) {
+        continue;
+      }
+      auto slot_key = slots[i].key.get();
+      if (equivalence == Equivalence::equal ? is_equal(slot_key, key)
+                                            : is_eqv(slot_key, key)) {
+        return i;
+      }
+    }
+    return slots.size();
+  }
+
+  // also sweeps the deleted slots away.
+  void rehash() {
+    std::size_t capacity = 8;
+    while (capacity < (count + 1) * 2) {
+      capacity *= 2;
+    }
+    std::vector<Slot> old(capacity);
+    old.swap(slots);
+    auto mask = capacity - 1;
+    for (auto&& slot : old) {
+      if (slot.hash <= deleted) {
+        continue;
+      }
+      auto i = slot.hash & mask;
+      while (slots[i].hash != empty) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = std::move(slot);
+    }
+    used = count;
+    return;
+  }
+};
+
+// hands out fixed-size blocks from chunks owned by the calling thread,
+// so that conses on the worker threads don't contend on the global heap.
+// a block freed on another thread joins that thread's free list.
+// the chunks are kept until the process exits.
+template <typename T>
+class LocalAllocator {
+ private:
+  union Block {
+    Block* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  static constexpr std::size_t blocks_per_chunk = 4096;
+
+ public:
+  using value_type = T;
+
+  LocalAllocator() {
+    return;
+  }
+
+  template <typename U>
+  explicit LocalAllocator(const LocalAllocator<U>&) {
+    return;
+  }
+
+  T* allocate(std::size_t n) {
+    if (n != 1) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    auto& list = free_list();
+    if (list == nullptr) {
+      refill();
+    }
+    auto block = list;
+    list = block->next;
+    return reinterpret_cast<T*>(block);
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    if (n != 1) {
+      ::operator delete(p);
+      return;
+    }
+    auto block = reinterpret_cast<Block*>(p);
+    block->next = free_list();
+    free_list() = block;
+    return;
+  }
+
+ private:
+  static Block*& free_list() {
+    static thread_local Block* list = nullptr;
+    return list;
+  }
+
+  static void refill() {
+    auto chunk = new Block[blocks_per_chunk];
+    for (std::size_t i = 0; i + 1 < blocks_per_chunk; ++i) {
+      chunk[i].next = &chunk[i + 1];
+    }
+    chunk[blocks_per_chunk - 1].next = nullptr;
+    free_list() = chunk;
+    return;
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const LocalAllocator<T>&, const LocalAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const LocalAllocator<T>&, const LocalAllocator<U>&) {
+  return false;
+}
+
+class File {
+ private:
+  std::vector<uint8_t> source;
+  std::size_t index;
+
+  std::map<std::vector<Unicode>, TokenID> forward_map;
+  // the string literals have ids of their own, apart from the symbols.
+  std::map<std::vector<Unicode>, TokenID> string_map;
+  std::map<TokenID, std::vector<Unicode>> backword_map;
+  std::map<TokenID, TokenType> type_from_id;
+
+ public:
+  explicit File(std::vector<uint8_t>&& source_)
+      : source(std::move(source_)),
+        index(0),
+        forward_map{},
+        string_map{},
+        backword_map{} {
+    init_maps();
+    return;
+  }
+
+  std::shared_ptr<Object> read() {
+    auto first_token = get_next_token_id();
+    switch (type_from_id[first_token]) {
+      case TokenType::boolean:
+      case TokenType::number:
+      case TokenType::character:
+      case TokenType::string:
+      case TokenType::id:
+        return Token::make(first_token);
+      case TokenType::prefix:
+        // prefix item -> '(prefix item)
+        return std::make_shared<Cell>(Token::make(first_token),
+               std::make_shared<Cell>(read(), nullptr));
+      case TokenType::dot:
+      case TokenType::unknown:
+        return nullptr;
+      case TokenType::parent:
+        break;
+    }
+    if (first_token == static_cast<TokenID>(SpecialTokenID::rparent)) {
+      return nullptr;
+    }
+    auto ret = std::make_shared<Cell>();
+    auto current = ret;
+    std::shared_ptr<Cell> current_prev = nullptr;
+    for (;;) {
+      auto old_index = index;
+      auto second_token = get_next_token_id();
+      if (second_token == static_cast<TokenID>(SpecialTokenID::rparent)) {
+        if (current_prev == nullptr) {
+          // (a b) == (a . (b . nil))
+          // (a) == (a . nil)
+          // () == nil
+          return nullptr;
+        } else {
+          return ret;
+        }
+      } else if (second_token == static_cast<TokenID>(SpecialTokenID::dot)) {
+        if (current_prev == nullptr) {
+          // invalid `("(" "." ,@any)
+          return nullptr;
+        } else {
+          current_prev->set_cdr(read());
+          auto last_token = get_next_token_id();
+          if (last_token != static_cast<TokenID>(SpecialTokenID::rparent)) {
+            return nullptr;
+          }
+          return ret;
+        }
+      }
+      index = old_index;
+      current->set_car(read());
+      if (current_prev != nullptr) {
+        current_prev->set_cdr(current);
+      }
+      current_prev = std::move(current);
+      current = std::make_shared<Cell>();
+    }
+  }
+
+  bool eof() {
+    return index == source.size();
+  }
+
+  // drops the rest of the source, e.g. after a datum which didn't read.
+  void skip() {
+    index = source.size();
+    return;
+  }
+
+  // appends more source to read; the part already read is dropped, as the
+  // tokens don't point into it.
+  void append(const uint8_t* bytes, std::size_t size) {
+    source.erase(source.begin(),
+                 source.begin() + static_cast<std::ptrdiff_t>(index));
+    index = 0;
+    source.insert(source.end(), bytes, bytes + size);
+    return;
+  }
+
+  TokenType token_type_from_id(TokenID id) const {
+    auto it = type_from_id.find(id);
+    if (it == type_from_id.end()) {
+      return TokenType::unknown;
+    } else {
+      return it->second;
+    }
+  }
+
+  const std::vector<Unicode>& token_from_id(TokenID id) const {
+    auto it = backword_map.find(id);
+    if (it == backword_map.end()) {
+      auto nil = static_cast<TokenID>(SpecialTokenID::nil);
+      return backword_map.find(nil)->second;
+    } else {
+      return it->second;
+    }
+  }
+
+ private:
+  void init_maps() {
+    regist_as({},              SpecialTokenID::nil,         TokenType::unknown);
+    regist_as({'#', 't'},      SpecialTokenID::t,           TokenType::boolean);
+    regist_as({'#', 'f'},      SpecialTokenID::f,           TokenType::boolean);
+    regist_as({'('},           SpecialTokenID::lparent,     TokenType::parent);
+    regist_as({')'},           SpecialTokenID::rparent,     TokenType::parent);
+    regist_as({'\''},          SpecialTokenID::quote,       TokenType::prefix);
+    regist_as({'`'},           SpecialTokenID::quasiquote,  TokenType::prefix);
+    regist_as({','},           SpecialTokenID::comma,       TokenType::prefix);
+    regist_as({',', '@'},      SpecialTokenID::comma_at,    TokenType::prefix);
+    regist_as({'.'},           SpecialTokenID::dot,         TokenType::dot);
+    regist_as({'.', '.', '.'}, SpecialTokenID::dots,        TokenType::id);
+    regist_as({'c', 'o', 'n', 's'}, SpecialTokenID::cons,   TokenType::id);
+    regist_as({'c', 'a', 'r'},      SpecialTokenID::car,    TokenType::id);
+    regist_as({'c', 'd', 'r'},      SpecialTokenID::cdr,    TokenType::id);
+    regist_as({'a', 't', 'o', 'm'}, SpecialTokenID::atom,   TokenType::id);
+    regist_as({'e', 'q'},           SpecialTokenID::eq,     TokenType::id);
+    regist_as({'c', 'o', 'n', 'd'},
+              SpecialTokenID::cond,   TokenType::id);
+    regist_as({'l', 'a', 'm', 'b', 'd', 'a'},
+              SpecialTokenID::lambda, TokenType::id);
+    regist_as({'d', 'e', 'f', 'i', 'n', 'e'},
+              SpecialTokenID::define, TokenType::id);
+    regist_as({'q', 'u', 'o', 't', 'e'},
+              SpecialTokenID::quote2, TokenType::id);
+    regist_as({'+'},      SpecialTokenID::add, TokenType::id);
+    regist_as({'-'},      SpecialTokenID::sub, TokenType::id);
+    regist_as({'*'},      SpecialTokenID::mul, TokenType::id);
+    regist_as({'/'},      SpecialTokenID::div, TokenType::id);
+    regist_as({'%'},      SpecialTokenID::mod, TokenType::id);
+    regist_as({'<', '='}, SpecialTokenID::le,  TokenType::id);
+    regist_as({'<'},      SpecialTokenID::lt,  TokenType::id);
+    regist_as({'>', '='}, SpecialTokenID::ge,  TokenType::id);
+    regist_as({'>'},      SpecialTokenID::gt,  TokenType::id);
+    regist_as({'f', 'u', 't', 'u', 'r', 'e'},
+              SpecialTokenID::future, TokenType::id);
+    regist_as({'t', 'o', 'u', 'c', 'h'},
+              SpecialTokenID::touch,  TokenType::id);
+    regist_as({'p', 'm', 'a', 'p'},
+              SpecialTokenID::pmap,   TokenType::id);
+    regist_as({'s', 'p', 'a', 'w', 'n'},
+              SpecialTokenID::spawn,  TokenType::id);
+    regist_as({'y', 'i', 'e', 'l', 'd'},
+              SpecialTokenID::yield,  TokenType::id);
+    regist_as({'s', 'o', 'c', 'k', 'e', 't', 'p', 'a', 'i', 'r'},
+              SpecialTokenID::socketpair, TokenType::id);
+    regist_as({'r', 'e', 'a', 'd', '-', 'b', 'y', 't', 'e'},
+              SpecialTokenID::read_byte,  TokenType::id);
+    regist_as({'w', 'r', 'i', 't', 'e', '-', 'b', 'y', 't', 'e'},
+              SpecialTokenID::write_byte, TokenType::id);
+    regist_as({'c', 'l', 'o', 's', 'e'},
+              SpecialTokenID::close,  TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 'l', 'e', 'n', 'g', 't', 'h'},
+              SpecialTokenID::string_length, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 'r', 'e', 'f'},
+              SpecialTokenID::string_ref, TokenType::id);
+    regist_as({'s', 'u', 'b', 's', 't', 'r', 'i', 'n', 'g'},
+              SpecialTokenID::substring, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 'a', 'p', 'p', 'e', 'n', 'd'},
+              SpecialTokenID::string_append, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '=', '?'},
+              SpecialTokenID::string_eq, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 'c', 'o', 'n', 't', 'a', 'i',
+               'n', 's'},
+              SpecialTokenID::string_contains, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 's', 'p', 'l', 'i', 't'},
+              SpecialTokenID::string_split, TokenType::id);
+    regist_as({'s', 't', 'r', 'i', 'n', 'g', '-', 'h', 'a', 's', 'h'},
+              SpecialTokenID::string_hash, TokenType::id);
+    regist_as({'m', 'a', 'k', 'e', '-', 'v', 'e', 'c', 't', 'o', 'r'},
+              SpecialTokenID::make_vector, TokenType::id);
+    regist_as({'v', 'e', 'c', 't', 'o', 'r', '-', 'r', 'e', 'f'},
+              SpecialTokenID::vector_ref, TokenType::id);
+    regist_as({'v', 'e', 'c', 't', 'o', 'r', '-', 's', 'e', 't', '!'},
+              SpecialTokenID::vector_set, TokenType::id);
+    regist_as({'v', 'e', 'c', 't', 'o', 'r', '-', 'l', 'e', 'n', 'g', 't', 'h'},
+              SpecialTokenID::vector_length, TokenType::id);
+    regist_as({'m', 'a', 'k', 'e', '-', 'e', 'q', '-', 'h', 'a', 's', 'h', 't',
+               'a', 'b', 'l', 'e'},
+              SpecialTokenID::make_eq_hashtable, TokenType::id);
+    regist_as({'m', 'a', 'k', 'e', '-', 'e', 'q', 'v', '-', 'h', 'a', 's', 'h',
+               't', 'a', 'b', 'l', 'e'},
+              SpecialTokenID::make_eqv_hashtable, TokenType::id);
+    regist_as({'m', 'a', 'k', 'e', '-', 'e', 'q', 'u', 'a', 'l', '-', 'h', 'a',
+               's', 'h', 't', 'a', 'b', 'l', 'e'},
+              SpecialTokenID::make_equal_hashtable, TokenType::id);
+    regist_as({'h', 'a', 's', 'h', 't', 'a', 'b', 'l', 'e', '-', 'r', 'e', 'f'},
+              SpecialTokenID::hashtable_ref, TokenType::id);
+    regist_as({'h', 'a', 's', 'h', 't', 'a', 'b', 'l', 'e', '-', 's', 'e', 't',
+               '!'},
+              SpecialTokenID::hashtable_set, TokenType::id);
+    regist_as({'h', 'a', 's', 'h', 't', 'a', 'b', 'l', 'e', '-', 'c', 'o', 'n',
+               't', 'a', 'i', 'n', 's', '?'},
+              SpecialTokenID::hashtable_contains, TokenType::id);
+    regist_as({'h', 'a', 's', 'h', 't', 'a', 'b', 'l', 'e', '-', 'd', 'e', 'l',
+               'e', 't', 'e', '!'},
+              SpecialTokenID::hashtable_delete, TokenType::id);
+    regist_as({'h', 'a', 's', 'h', 't', 'a', 'b', 'l', 'e', '-', 's', 'i', 'z',
+               'e'},
+              SpecialTokenID::hashtable_size, TokenType::id);
+    regist_as({'a', 'p', 'p', 'e', 'n', 'd'},
+              SpecialTokenID::append, TokenType::id);
+    regist_as({'d', 'e', 'f', 'i', 'n', 'e', '-', 's', 'y', 'n', 't', 'a',
+               'x'},
+              SpecialTokenID::define_syntax, TokenType::id);
+    regist_as({'s', 'y', 'n', 't', 'a', 'x', '-', 'r', 'u', 'l', 'e', 's'},
+              SpecialTokenID::syntax_rules, TokenType::id);
+    regist_as({'_'}, SpecialTokenID::underscore, TokenType::id);
+    regist_as({'='}, SpecialTokenID::num_eq, TokenType::id);
+    regist_as({'m', 'a', 'k', 'e', '-', 'f', '6', '4', 'v', 'e', 'c', 't', 'o',
+               'r'},
+              SpecialTokenID::make_f64vector, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'r', 'e', 'f'},
+              SpecialTokenID::f64vector_ref, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 's', 'e', 't',
+               '!'},
+              SpecialTokenID::f64vector_set, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'l', 'e', 'n',
+               'g', 't', 'h'},
+              SpecialTokenID::f64vector_length, TokenType::id);
+    regist_as({'l', 'i', 's', 't', '-', '>', 'f', '6', '4', 'v', 'e', 'c', 't',
+               'o', 'r'},
+              SpecialTokenID::list_to_f64vector, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'a', 'd', 'd'},
+              SpecialTokenID::f64vector_add, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 's', 'u', 'b'},
+              SpecialTokenID::f64vector_sub, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'm', 'u', 'l'},
+              SpecialTokenID::f64vector_mul, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'd', 'i', 'v'},
+              SpecialTokenID::f64vector_div, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'd', 'o', 't'},
+              SpecialTokenID::f64vector_dot, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 's', 'u', 'm'},
+              SpecialTokenID::f64vector_sum, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'm', 'i', 'n'},
+              SpecialTokenID::f64vector_min, TokenType::id);
+    regist_as({'f', '6', '4', 'v', 'e', 'c', 't', 'o', 'r', '-', 'm', 'a', 'x'},
+              SpecialTokenID::f64vector_max, TokenType::id);
+    return;
+  }
+
+  // it decodes from utf-8 stream
+  Unicode get_next_unicode() {
+    if (index >= source.size()) {
+      return 0;
+    }
+    auto c0 = static_cast<Unicode>(source[index]); index++;
+    if (c0 < 0x80) {
+      return c0;
+    } else if (c0 < 0xc2) {
+      return 0;
+    } else if (c0 < 0xe0) {
+      if (index >= source.size()) {
+        return 0;
+      }
+      auto c1 = static_cast<Unicode>(source[index]); index++;
+      if ((c1 & 0xc0) != 0x80) {
+        return 0;
+      }
+      return ((c0 & 0x1f) << 6) |
+              (c1 & 0x3f);
+    } else if (c0 < 0xf0) {
+      if (index + 1 >= source.size()) {
+        return 0;
+      }
+      auto c1 = static_cast<Unicode>(source[index]); index++;
+      auto c2 = static_cast<Unicode>(source[index]); index++;
+      if (((c1 & 0xc0) != 0x80) ||
+          ((c2 & 0xc0) != 0x80)) {
+        return 0;
+      }
+      return ((c0 & 0x0f) << 12) |
+             ((c1 & 0x3f) <<  6) |
+              (c2 & 0x3f);
+    } else if (c0 < 0xf8) {
+      if (index + 2 >= source.size()) {
+        return 0;
+      }
+      auto c1 = static_cast<Unicode>(source[index]); index++;
+      auto c2 = static_cast<Unicode>(source[index]); index++;
+      auto c3 = static_cast<Unicode>(source[index]); index++;
+      if (((c1 & 0xc0) != 0x80) ||
+          ((c2 & 0xc0) != 0x80) ||
+          ((c3 & 0xc0) != 0x80)) {
+        return 0;
+      }
+      return ((c0 & 0x07) << 18) |
+             ((c1 & 0x3f) << 12) |
+             ((c2 & 0x3f) <<  6) |
+              (c3 & 0x3f);
+    } else if (c0 < 0xfc) {
+      if (index + 3 >= source.size()) {
+        return 0;
+      }
+      auto c1 = static_cast<Unicode>(source[index]); index++;
+      auto c2 = static_cast<Unicode>(source[index]); index++;
+      auto c3 = static_cast<Unicode>(source[index]); index++;
+      auto c4 = static_cast<Unicode>(source[index]); index++;
+      if (((c1 & 0xc0) != 0x80) ||
+          ((c2 & 0xc0) != 0x80) ||
+          ((c3 & 0xc0) != 0x80) ||
+          ((c4 & 0xc0) != 0x80)) {
+        return 0;
+      }
+      return ((c0 & 0x03) << 24) |
+             ((c1 & 0x3f) << 18) |
+             ((c2 & 0x3f) << 12) |
+             ((c3 & 0x3f) <<  6) |
+              (c4 & 0x3f);
+    } else if (c0 < 0xfe) {
+      if (index + 4 >= source.size()) {
+        return 0;
+      }
+      auto c1 = static_cast<Unicode>(source[index]); index++;
+      auto c2 = static_cast<Unicode>(source[index]); index++;
+      auto c3 = static_cast<Unicode>(source[index]); index++;
+      auto c4 = static_cast<Unicode>(source[index]); index++;
+      auto c5 = static_cast<Unicode>(source[index]); index++;
+      if (((c1 & 0xc0) != 0x80) ||
+          ((c2 & 0xc0) != 0x80) ||
+          ((c3 & 0xc0) != 0x80) ||
+          ((c4 & 0xc0) != 0x80) ||
+          ((c5 & 0xc0) != 0x80)) {
+        return 0;
+      }
+      return ((c0 & 0x01) << 30) |
+             ((c1 & 0x3f) << 24) |
+             ((c2 & 0x3f) << 18) |
+             ((c3 & 0x3f) << 12) |
+             ((c4 & 0x3f) <<  6) |
+              (c5 & 0x3f);
+    } else {
+      return 0;
+    }
+  }
+
+  TokenID get_next_token_id() {
+    auto c0 = get_next_unicode();
+    while (c0 == ' ' || c0 == '\t' || c0 == '\r' || c0 == '\n') {
+      c0 = get_next_unicode();
+    }
+    switch (c0) {
+      case 0:
+        return static_cast<TokenID>(SpecialTokenID::nil);
+      case '(':
+        return static_cast<TokenID>(SpecialTokenID::lparent);
+      case ')':
+        return static_cast<TokenID>(SpecialTokenID::rparent);
+      case '\'':
+        return static_cast<TokenID>(SpecialTokenID::quote);
+      case '`':
+        return static_cast<TokenID>(SpecialTokenID::quasiquote);
+      case ',': {
+        auto old_index = index;
+        auto c1 = get_next_unicode();
+        if (c1 == '@') {
+          return static_cast<TokenID>(SpecialTokenID::comma_at);
+        } else {
+          index = old_index;
+          return static_cast<TokenID>(SpecialTokenID::comma);
+        }
+      }
+      case '"': {
+        std::vector<Unicode> token{};
+        for (;;) {
+          auto ck = get_next_unicode();
+          if (ck == '"') {
+            return regist(std::move(token), TokenType::string);
+          } else if (ck == 0) {
+            return static_cast<TokenID>(SpecialTokenID::nil);
+          } else if (ck == '\\') {
+            ck = get_next_unicode();
+            switch (ck) {
+              case 't':
+                ck = '\t';
+                break;
+              case 'n':
+                ck = '\n';
+                break;
+              default:
+                break;
+            }
+          }
+          token.push_back(ck);
+        }
+      }
+      case ';':
+        while (!(c0 == '\r' || c0 == '\n' || c0 == 0)) {
+          c0 = get_next_unicode();
+        }
+        if (c0 == 0) {
+          return static_cast<TokenID>(SpecialTokenID::nil);
+        }
+        return get_next_token_id();
+      case '.':
+      case '+':
+      case '-': {
+        auto old_index = index;
+        auto c1 = get_next_unicode();
+        if ('0' <= c1 && c1 <= '9') {
+          index = old_index;
+          break;
+        } else if (c0 == '.') {
+          if (c1 == '.') {
+            if (get_next_unicode() == '.') {
+              return static_cast<TokenID>(SpecialTokenID::dots);
+            } else {
+              return 0;
+            }
+          } else {
+            index = old_index;
+            return static_cast<TokenID>(SpecialTokenID::dot);
+          }
+        } else {
+          index = old_index;
+          std::vector<Unicode> token{c0};
+          return regist(std::move(token), TokenType::id);
+        }
+      }
+      case '#': {
+        auto c1 = get_next_unicode();
+        if (c1 == 't') {
+          return static_cast<TokenID>(SpecialTokenID::t);
+        } else if (c1 == 'f') {
+          return static_cast<TokenID>(SpecialTokenID::f);
+        } else if (c1 == '\\') {
+          auto c2 = get_next_unicode();
+          std::vector<Unicode> token{c0, c1, c2};
+          return regist(std::move(token), TokenType::character);
+        } else {
+          return static_cast<TokenID>(SpecialTokenID::nil);
+        }
+      }
+      default:
+        break;
+    }
+    std::vector<Unicode> token{c0};
+    auto type = TokenType::unknown;
+    if (c0 == '.' || c0 == '+' || c0 == '-' || ('0' <= c0 && c0 <= '9')) {
+      type = TokenType::number;
+      bool dotted = c0 == '.';
+      for (;;) {
+        auto old_index = index;
+        auto ck = get_next_unicode();
+        if ('0' <= ck && ck <= '9') {
+          token.push_back(ck);
+        } else if (ck == '.' && !dotted) {
+          dotted = true;
+          token.push_back(ck);
+        } else if (ck == 'e' || ck == 'E') {
+          // an exponent ends the number; without digits, the e isn't one.
+          std::vector<Unicode> exponent{ck};
+          ck = get_next_unicode();
+          if (ck == '+' || ck == '-') {
+            exponent.push_back(ck);
+            ck = get_next_unicode();
+          }
+          for (; '0' <= ck && ck <= '9'; ck = get_next_unicode()) {
+            exponent.push_back(ck);
+            old_index = index;
+          }
+          if ('0' <= exponent.back() && exponent.back() <= '9') {
+            token.insert(token.end(), exponent.begin(), exponent.end());
+          }
+          index = old_index;
+          break;
+        } else {
+          index = old_index;
+          break;
+        }
+      }
+    } else {
+      type = TokenType::id;
+      for (;;) {
+        auto old_index = index;
+        auto ck = get_next_unicode();
+        if (ck == '!' || ck == '$' || ck == '%' || ck == '&' || ck == '*' ||
+            ck == '+' || ck == '-' || ck == '.' || ck == '/' || ck == ':' ||
+            ck == '<' || ck == '=' || ck == '>' || ck == '?' || ck == '@' ||
+            ck == '^' || ck == '_' || ck == '~' ||
+            ('a' <= ck && ck <= 'z') ||
+            ('A' <= ck && ck <= 'Z') ||
+            ('0' <= ck && ck <= '9')) {
+          token.push_back(ck);
+        } else {
+          index = old_index;
+          break;
+        }
+      }
+    }
+    return regist(std::move(token), type);
+  }
+
+  TokenID regist(std::vector<Unicode>&& token, TokenType type) {
+    auto& map = type == TokenType::string ? string_map : forward_map;
+    auto it = map.find(token);
+    if (it == map.end()) {
+      if (type != TokenType::string) {
+        metrics().add(Counter::symbols, 1);
+      }
+      auto new_id = static_cast<TokenID>(backword_map.rbegin()->first + 1);
+      map[token] = new_id;
+      backword_map[new_id] = std::move(token);
+      type_from_id[new_id] = type;
+      return new_id;
+    } else {
+      return it->second;
+    }
+  }
+
+  void regist_as(std::vector<Unicode>&& token,
+                 SpecialTokenID sid,
+                 TokenType type) {
+    auto id = static_cast<TokenID>(sid);
+    forward_map[token] = id;
+    backword_map[id] = std::move(token);
+    type_from_id[id] = type;
+    return;
+  }
+};
+
+// writes the objects into a growable buffer which is flushed with write(2),
+// or writev(2) with the long strings in place. it walks the structure with
+// an explicit stack, so deep lists don't overflow the native stack, and
+// labels the vectors which contain themselves as #n= ... #n#.
+class Serializer {
+ private:
+  static constexpr std::size_t flush_threshold = 64 * 1024;
+  static constexpr std::size_t in_place_threshold = 4096;
+
+  enum class Step {
+    value, list, tail, vector, close,
+  };
+
+  struct Frame {
+    Step step;
+    const Object* object;
+    std::size_t index;
+  };
+
+  const File& file;
+  const int fd;
+  // if not null, the bytes go here instead of the fd.
+  std::vector<char>* const sink;
+  std::vector<char> buffer;
+  std::vector<Frame> stack;
+  // the vectors on a cycle, and their labels once they are written.
+  std::map<const Vector*, int64_t> labels;
+  int64_t next_label;
+
+ public:
+  Serializer(const File& file_, int fd_)
+      : file(file_),
+        fd(fd_),
+        sink(nullptr),
+        buffer{},
+        stack{},
+        labels{},
+        next_label(0) {
+    return;
+  }
+
+  Serializer(const File& file_, std::vector<char>* sink_)
+      : file(file_),
+        fd(-1),
+        sink(sink_),
+        buffer{},
+        stack{},
+        labels{},
+        next_label(0) {
+    return;
+  }
+
+  ~Serializer() {
+    flush();
+    return;
+  }
+
+  void write(const std::shared_ptr<Object>& x) {
+    find_cycles(x.get());
+    stack.push_back(Frame{Step::value, x.get(), 0});
+    while (!stack.empty()) {
+      auto frame = stack.back();
+      stack.pop_back();
+      switch (frame.step) {
+        case Step::value:
+          write_value(frame.object);
+          break;
+        case Step::list: {
+          auto cell = static_cast<const Cell*>(frame.object);
+          if (frame.index != 0) {
+            put(' ');
+          }
+          auto d = cell->cdr().get();
+          if (d == nullptr) {
+            stack.push_back(Frame{Step::close, nullptr, 0});
+          } else if (d->type() == Type::cell) {
+            stack.push_back(Frame{Step::list, d, 1});
+          } else {
+            stack.push_back(Frame{Step::tail, d, 0});
+          }
+          stack.push_back(Frame{Step::value, cell->car().get(), 0});
+          break;
+        }
+        case Step::tail:
+          text(" . ");
+          stack.push_back(Frame{Step::close, nullptr, 0});
+          stack.push_back(Frame{Step::value, frame.object, 0});
+          break;
+        case Step::vector: {
+          auto vector = static_cast<const Vector*>(frame.object);
+          if (frame.index == vector->size()) {
+            put(')');
+            break;
+          } else if (frame.index != 0) {
+            put(' ');
+          }
+          stack.push_back(Frame{Step::vector, vector, frame.index + 1});
+          stack.push_back(Frame{Step::value,
+                                vector->ref(frame.index).get(),
+                                0});
+          break;
+        }
+        case Step::close:
+          put(')');
+          break;
+      }
+      if (buffer.size() >= flush_threshold) {
+        flush();
+      }
+    }
+    labels.clear();
+    next_label = 0;
+    return;
+  }
+
+  void text(const char* s) {
+    buffer.insert(buffer.end(), s, s + strlen(s));
+    return;
+  }
+
+  void format(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char local[256];
+    auto n = vsnprintf(local, sizeof(local), fmt, args);
+    va_end(args);
+    if (n < 0) {
+      return;
+    } else if (static_cast<std::size_t>(n) < sizeof(local)) {
+      buffer.insert(buffer.end(), local, local + n);
+    } else {
+      auto size = buffer.size();
+      buffer.resize(size + static_cast<std::size_t>(n) + 1);
+      va_start(args, fmt);
+      vsnprintf(&buffer[size], static_cast<std::size_t>(n) + 1, fmt, args);
+      va_end(args);
+      buffer.pop_back();
+    }
+    return;
+  }
+
+  void flush() {
+    if (!buffer.empty()) {
+      struct iovec iov[1];
+      iov[0].iov_base = buffer.data();
+      iov[0].iov_len = buffer.size();
+      write_all(iov, 1);
+      buffer.clear();
+    }
+    return;
+  }
+
+ private:
+  void put(char c) {
+    buffer.push_back(c);
+    return;
+  }
+
+  // the cells can't be changed once they are made, so every cycle goes
+  // through a vector; it is enough to track the vectors on the path.
+  void find_cycles(const Object* x) {
+    std::set<const Vector*> on_path{}, done{};
+    // true in the second means leaving the vector in the first.
+    std::vector<std::pair<const Object*, bool>> work{{x, false}};
+    while (!work.empty()) {
+      auto item = work.back();
+      work.pop_back();
+      if (item.second) {
+        auto vector = static_cast<const Vector*>(item.first);
+        on_path.erase(vector);
+        done.insert(vector);
+        continue;
+      }
+      auto object = item.first;
+      while (object != nullptr && object->type() == Type::cell) {
+        auto cell = static_cast<const Cell*>(object);
+        if (cell->cdr() != nullptr) {
+          work.push_back({cell->cdr().get(), false});
+        }
+        object = cell->car().get();
+      }
+      if (object == nullptr || object->type() != Type::vector) {
+        continue;
+      }
+      auto vector = static_cast<const Vector*>(object);
+      if (on_path.count(vector) != 0) {
+        labels[vector] = -1;
+      } else if (done.count(vector) == 0) {
+        on_path.insert(vector);
+        work.push_back({vector, true});
+        for (std::size_t i = 0; i < vector->size(); ++i) {
+          work.push_back({vector->ref(i).get(), false});
+        }
+      }
+    }
+    return;
+  }
+
+  void write_value(const Object* x) {
+    if (x == nullptr) {
+      text("()");
+      return;
+    }
+    switch (x->type()) {
+      case Type::token:
+        write_token(static_cast<const Token*>(x)->get_id());
+        break;
+      case Type::number:
+        write_integer(static_cast<const Number*>(x)->get_value());
+        break;
+      case Type::flonum:
+        write_flonum(static_cast<const Flonum*>(x)->get_value());
+        break;
+      case Type::f64vector: {
+        auto vector = static_cast<const F64Vector*>(x);
+        text("#f64(");
+        for (std::size_t i = 0; i < vector->size(); ++i) {
+          if (i != 0) {
+            put(' ');
+          }
+          write_flonum(vector->ref(i));
+        }
+        put(')');
+        break;
+      }
+      case Type::character: {
+        text("#\\");
+        std::vector<uint8_t> bytes{};
+        String::encode(static_cast<const Character*>(x)->get_value(), &bytes);
+        buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+        break;
+      }
+      case Type::string:
+        write_string(static_cast<const String*>(x));
+        break;
+      case Type::future:
+        text("#<future>");
+        break;
+      case Type::hashtable:
+        text("#<hashtable>");
+        break;
+      case Type::procedure:
+        text("#<procedure>");
+        break;
+      case Type::cell: {
+        auto cell = static_cast<const Cell*>(x);
+        auto a = cell->car().get();
+        auto d = cell->cdr().get();
+        // (prefix item) is written back as 'item
+        if (a != nullptr && a->type() == Type::token &&
+            file.token_type_from_id(static_cast<const Token*>(a)->get_id()) ==
+                TokenType::prefix &&
+            d != nullptr && d->type() == Type::cell &&
+            static_cast<const Cell*>(d)->cdr() == nullptr) {
+          write_token(static_cast<const Token*>(a)->get_id());
+          stack.push_back(Frame{Step::value,
+                                static_cast<const Cell*>(d)->car().get(),
+                                0});
+          break;
+        }
+        put('(');
+        stack.push_back(Frame{Step::list, cell, 0});
+        break;
+      }
+      case Type::vector: {
+        auto vector = static_cast<const Vector*>(x);
+        auto it = labels.find(vector);
+        if (it != labels.end()) {
+          if (it->second >= 0) {
+            format("#%" PRId64 "#", it->second);
+            break;
+          }
+          it->second = next_label++;
+          format("#%" PRId64 "=", it->second);
+        }
+        text("#(");
+        stack.push_back(Frame{Step::vector, vector, 0});
+        break;
+      }
+    }
+    return;
+  }
+
+  void write_token(TokenID id) {
+    auto& name = file.token_from_id(id);
+    auto quoted = file.token_type_from_id(id) == TokenType::string;
+    if (quoted) {
+      put('"');
+    }
+    std::vector<uint8_t> bytes{};
+    for (auto&& ch : name) {
+      if (quoted && (ch == '"' || ch == '\\')) {
+        bytes.push_back('\\');
+      }
+      String::encode(ch, &bytes);
+    }
+    buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+    if (quoted) {
+      put('"');
+    }
+    return;
+  }
+
+  void write_integer(int64_t value) {
+    char digits[24];
+    auto p = digits + sizeof(digits);
+    auto magnitude = value < 0 ? 0 - static_cast<uint64_t>(value)
+                               : static_cast<uint64_t>(value);
+    do {
+      *--p = static_cast<char>('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+      *--p = '-';
+    }
+    buffer.insert(buffer.end(), p, digits + sizeof(digits));
+    return;
+  }
+
+  // the shortest digits which read back as the same value, with a point or
+  // an exponent so that they read back as a flonum.
+  void write_flonum(double value) {
+    if (std::isnan(value)) {
+      text("+nan.0");
+      return;
+    } else if (std::isinf(value)) {
+      text(value > 0 ? "+inf.0" : "-inf.0");
+      return;
+    }
+    char digits[32];
+    for (int precision = 1; precision <= 17; ++precision) {
+      snprintf(digits, sizeof(digits), "%.*g", precision, value);
+      auto back = strtod(digits, nullptr);
+      if (memcmp(&back, &value, sizeof(value)) == 0) {
+        break;
+      }
+    }
+    // %g goes to the exponent for 10.0 and the like; those are exact.
+    if (strchr(digits, 'e') != nullptr && std::fabs(value) >= 1.0 &&
+        std::fabs(value) < 1e16) {
+      snprintf(digits, sizeof(digits), "%.0f", value);
+    }
+    text(digits);
+    if (strpbrk(digits, ".e") == nullptr) {
+      text(".0");
+    }
+    return;
+  }
+
+  void write_string(const String* x) {
+    auto bytes = x->data();
+    auto size = x->byte_size();
+    put('"');
+    if (size >= in_place_threshold &&
+        memchr(bytes, '"', size) == nullptr &&
+        memchr(bytes, '\\', size) == nullptr) {
+      // no escapes; writes it from where it is.
+      struct iovec iov[2];
+      iov[0].iov_base = buffer.data();
+      iov[0].iov_len = buffer.size();
+      iov[1].iov_base = const_cast<uint8_t*>(bytes);
+      iov[1].iov_len = size;
+      write_all(iov, 2);
+      buffer.clear();
+    } else {
+      for (std::size_t i = 0; i < size; ++i) {
+        if (bytes[i] == '"' || bytes[i] == '\\') {
+          put('\\');
+        }
+        put(static_cast<char>(bytes[i]));
+      }
+    }
+    put('"');
+    return;
+  }
+
+  void write_all(struct iovec* iov, int count) {
+    if (sink != nullptr) {
+      for (int i = 0; i < count; ++i) {
+        auto base = static_cast<const char*>(iov[i].iov_base);
+        sink->insert(sink->end(), base, base + iov[i].iov_len);
+      }
+      return;
+    }
+    // the standard output may have been written with printf.
+    if (fd == STDOUT_FILENO) {
+      fflush(stdout);
+    }
+    while (count > 0) {
+      auto n = writev(fd, iov, count);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      auto written = static_cast<std::size_t>(n);
+      while (count > 0 && written >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+        iov->iov_len -= written;
+      }
+    }
+    return;
+  }
+};
+
+enum class ISA {
+  load_true, load_false, load_number, load_character, load_const,
+  load_dynamic, load_up, load_global, store_global, mov,
+  cons, car, cdr, atom, eq, br, bfalse, label,
+  future, touch, pmap, done,
+  spawn, yield, socketpair, read_byte, write_byte, close,
+  string_length, string_ref, substring, string_append, string_eq,
+  string_contains, string_split, string_hash,
+  make_vector, vector_ref, vector_set, vector_length,
+  make_hashtable, hashtable_ref, hashtable_set, hashtable_contains,
+  hashtable_delete, hashtable_size,
+  append,
+  closure, call,
+  add, sub, mul, div, mod, num_eq, lt, le, gt, ge,
+  make_f64vector, f64vector_ref, f64vector_set, f64vector_length,
+  list_to_f64vector,
+  f64vector_add, f64vector_sub, f64vector_mul, f64vector_div,
+  f64vector_dot, f64vector_sum, f64vector_min, f64vector_max,
+  // the quickened forms of the generic instructions above; see
+  // Machine::observe().
+  eq_token, eq_number, string_ref_number, vector_ref_number,
+  add_fixnum, sub_fixnum, mul_fixnum, num_eq_fixnum, lt_fixnum,
+  add_flonum, sub_flonum, mul_flonum, num_eq_flonum, lt_flonum,
+};
+
+// the generic instruction of a quickened one.
+ISA generic_of(ISA inst) {
+  switch (inst) {
+    case ISA::eq_token:
+    case ISA::eq_number:
+      return ISA::eq;
+    case ISA::string_ref_number:
+      return ISA::string_ref;
+    case ISA::vector_ref_number:
+      return ISA::vector_ref;
+    case ISA::add_fixnum:
+    case ISA::add_flonum:
+      return ISA::add;
+    case ISA::sub_fixnum:
+    case ISA::sub_flonum:
+      return ISA::sub;
+    case ISA::mul_fixnum:
+    case ISA::mul_flonum:
+      return ISA::mul;
+    case ISA::num_eq_fixnum:
+    case ISA::num_eq_flonum:
+      return ISA::num_eq;
+    case ISA::lt_fixnum:
+    case ISA::lt_flonum:
+      return ISA::lt;
+    default:
+      return inst;
+  }
+}
+
+const char* name_of(ISA inst);
+
+struct Instruction {
+  // the machine rewrites it in place with its quickened form, while the
+  // other threads may run the same snippet.
+  std::atomic<ISA> instruction;
+  uint64_t operand[3];
+  // the type feedback of the site: how many times in a row the generic
+  // instruction saw the operand types of a quickened form, and how many
+  // times a quickened form missed its guard.
+  std::atomic<uint32_t> streak;
+  std::atomic<uint32_t> misses;
+
+  explicit Instruction(ISA inst,
+                       uint64_t o1 = 0,
+                       uint64_t o2 = 0,
+                       uint64_t o3 = 0)
+      : instruction(inst),
+        operand{o1, o2, o3},
+        streak(0),
+        misses(0) {
+    return;
+  }
+
+  // a copy is a new site, so it starts without feedback.
+  Instruction(const Instruction& x)
+      : instruction(x.instruction.load(std::memory_order_relaxed)),
+        operand{x.operand[0], x.operand[1], x.operand[2]},
+        streak(0),
+        misses(0) {
+    return;
+  }
+
+  Instruction& operator=(const Instruction& x) {
+    instruction.store(x.instruction.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    operand[0] = x.operand[0];
+    operand[1] = x.operand[1];
+    operand[2] = x.operand[2];
+    streak.store(0, std::memory_order_relaxed);
+    misses.store(0, std::memory_order_relaxed);
+    return *this;
+  }
+
+  void print(Serializer* out) const {
+    switch (instruction) {
+      case ISA::load_true:
+        out->format("r%zu <- true\n", operand[0]);
+        break;
+      case ISA::load_false:
+        out->format("r%zu <- false\n", operand[0]);
+        break;
+      case ISA::load_number:
+        out->format("r%zu <- %zd\n", operand[0], operand[1]);
+        break;
+      case ISA::load_character:
+        out->format("r%zu <- '%c'\n",
+                    operand[0],
+                    static_cast<int>(operand[1]));
+        break;
+      case ISA::load_const:
+        out->format("r%zu <- const[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::load_dynamic:
+        out->format("r%zu <- dynamic_table[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::load_up:
+        out->format("r%zu <- up[%zu].r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::load_global:
+        out->format("r%zu <- global[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::store_global:
+        out->format("global[%zu] <- r%zu\n", operand[1], operand[0]);
+        break;
+      case ISA::mov:
+        out->format("r%zu <- r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::cons:
+        out->format("r%zu <- cons r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::car:
+        out->format("r%zu <- car r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::cdr:
+        out->format("r%zu <- cdr r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::atom:
+        out->format("r%zu <- atom r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::eq:
+      case ISA::eq_token:
+      case ISA::eq_number:
+        out->format("r%zu <- eq r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::br:
+        out->format("br %zu\n", operand[0]);
+        break;
+      case ISA::bfalse:
+        out->format("bfalse r%zu, %zu\n", operand[0], operand[1]);
+        break;
+      case ISA::label:
+        out->format("label %zu:\n", operand[0]);
+        break;
+      case ISA::future:
+        out->format("r%zu <- future lambda[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::touch:
+        out->format("r%zu <- touch r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::pmap:
+        out->format("r%zu <- pmap r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::done:
+        out->format("done r%zu\n", operand[0]);
+        break;
+      case ISA::spawn:
+        out->format("r%zu <- spawn lambda[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::yield:
+        out->format("r%zu <- yield\n", operand[0]);
+        break;
+      case ISA::socketpair:
+        out->format("r%zu <- socketpair\n", operand[0]);
+        break;
+      case ISA::read_byte:
+        out->format("r%zu <- read-byte r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::write_byte:
+        out->format("r%zu <- write-byte r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::close:
+        out->format("r%zu <- close r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::string_length:
+        out->format("r%zu <- string-length r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::string_ref:
+      case ISA::string_ref_number:
+        out->format("r%zu <- string-ref r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::substring:
+        out->format("r%zu <- substring r%zu, r%zu, r%zu\n",
+                    operand[0], operand[0], operand[1], operand[2]);
+        break;
+      case ISA::string_append:
+        out->format("r%zu <- string-append r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::string_eq:
+        out->format("r%zu <- string=? r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::string_contains:
+        out->format("r%zu <- string-contains r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::string_split:
+        out->format("r%zu <- string-split r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::string_hash:
+        out->format("r%zu <- string-hash r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::make_vector:
+        out->format("r%zu <- make-vector r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::vector_ref:
+      case ISA::vector_ref_number:
+        out->format("r%zu <- vector-ref r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::vector_set:
+        out->format("vector-set! r%zu, r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::vector_length:
+        out->format("r%zu <- vector-length r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::make_hashtable:
+        out->format("r%zu <- make-hashtable %zu\n", operand[0], operand[1]);
+        break;
+      case ISA::hashtable_ref:
+        out->format("r%zu <- hashtable-ref r%zu, r%zu, r%zu\n",
+                    operand[0], operand[0], operand[1], operand[2]);
+        break;
+      case ISA::hashtable_set:
+        out->format("hashtable-set! r%zu, r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::hashtable_contains:
+        out->format("r%zu <- hashtable-contains? r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::hashtable_delete:
+        out->format("hashtable-delete! r%zu, r%zu\n", operand[1], operand[2]);
+        break;
+      case ISA::hashtable_size:
+        out->format("r%zu <- hashtable-size r%zu\n", operand[0], operand[1]);
+        break;
+      case ISA::append:
+        out->format("r%zu <- append r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::closure:
+        out->format("r%zu <- closure lambda[%zu]\n", operand[0], operand[1]);
+        break;
+      case ISA::call:
+        out->format("r%zu <- call r%zu, %zu\n",
+                    operand[0], operand[0], operand[1]);
+        break;
+      case ISA::f64vector_length:
+      case ISA::list_to_f64vector:
+      case ISA::f64vector_sum:
+      case ISA::f64vector_min:
+      case ISA::f64vector_max:
+        out->format("r%zu <- %s r%zu\n",
+                    operand[0], name_of(instruction), operand[1]);
+        break;
+      case ISA::f64vector_set:
+        out->format("f64vector-set! r%zu, r%zu, r%zu\n",
+                    operand[0], operand[1], operand[2]);
+        break;
+      case ISA::add:
+      case ISA::sub:
+      case ISA::mul:
+      case ISA::div:
+      case ISA::mod:
+      case ISA::num_eq:
+      case ISA::lt:
+      case ISA::le:
+      case ISA::gt:
+      case ISA::ge:
+      case ISA::make_f64vector:
+      case ISA::f64vector_ref:
+      case ISA::f64vector_add:
+      case ISA::f64vector_sub:
+      case ISA::f64vector_mul:
+      case ISA::f64vector_div:
+      case ISA::f64vector_dot:
+      case ISA::add_fixnum:
+      case ISA::sub_fixnum:
+      case ISA::mul_fixnum:
+      case ISA::num_eq_fixnum:
+      case ISA::lt_fixnum:
+      case ISA::add_flonum:
+      case ISA::sub_flonum:
+      case ISA::mul_flonum:
+      case ISA::num_eq_flonum:
+      case ISA::lt_flonum:
+        out->format("r%zu <- %s r%zu, r%zu\n",
+                    operand[0],
+                    name_of(generic_of(instruction)),
+                    operand[1],
+                    operand[2]);
+        break;
+    }
+    return;
+  }
+};
+
+int64_t itoa(const std::vector<Unicode>& v) {
+  int64_t ret = 0;
+  bool sign = false;
+  for (auto&& ch : v) {
+    if (ch == '-') {
+      sign = true;
+    } else if ('0' <= ch && ch <= '9') {
+      ret = ret * 10 + ch - '0';
+    }
+  }
+  if (sign) {
+    return -ret;
+  } else {
+    return ret;
+  }
+}
+
+// a number token with a point or an exponent is a flonum.
+bool is_flonum_token(const std::vector<Unicode>& v) {
+  return std::any_of(v.begin(), v.end(), [](Unicode ch) {
+    return ch == '.' || ch == 'e' || ch == 'E';
+  });
+}
+
+double to_flonum(const std::vector<Unicode>& v) {
+  std::string digits(v.begin(), v.end());
+  return strtod(digits.c_str(), nullptr);
+}
+
+// slots which never move once they are made, so that the other threads may
+// read the filled ones while the main thread fills more. a slot which was
+// never filled reads as T{}.
+template <typename T>
+class Region {
+ private:
+  static constexpr std::size_t chunk_size = 4096;
+  static constexpr std::size_t chunk_count = 4096;
+  using Chunk = std::array<T, chunk_size>;
+
+  std::array<std::atomic<Chunk*>, chunk_count> chunks;
+  std::size_t count;
+
+ public:
+  Region() : chunks{}, count(0) {
+    for (auto&& chunk : chunks) {
+      chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+
+  ~Region() {
+    for (auto&& chunk : chunks) {
+      delete chunk.load(std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  std::size_t size() const {
+    return count;
+  }
+
+  bool set(std::size_t slot, T value) {
+    if (slot >= chunk_size * chunk_count) {
+      report("error: the region is full.\n");
+      return false;
+    }
+    auto& entry = chunks[slot / chunk_size];
+    auto chunk = entry.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      chunk = new Chunk{};
+      entry.store(chunk, std::memory_order_release);
+    }
+    (*chunk)[slot % chunk_size] = std::move(value);
+    count = std::max(count, slot + 1);
+    return true;
+  }
+
+  // the slot of the value, or 0 if the region is full.
+  uint64_t push_back(T value) {
+    auto slot = count;
+    return set(slot, std::move(value)) ? static_cast<uint64_t>(slot) : 0;
+  }
+
+  const T& get(std::size_t slot) const {
+    static const T none{};
+    if (slot >= chunk_size * chunk_count) {
+      return none;
+    }
+    auto chunk = chunks[slot / chunk_size].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      return none;
+    }
+    return (*chunk)[slot % chunk_size];
+  }
+};
+
+// the read-only region of the quoted data. the data are hash-consed: the
+// structurally equal literals share one copy wherever they appear, and each
+// value takes one slot. nothing in the region is ever changed or freed, so
+// it needs no tracking at run time; the VM just loads a slot by its index.
+class ConstantPool {
+ private:
+  using Pair = std::pair<const Object*, const Object*>;
+
+  struct PairHash {
+    std::size_t operator()(const Pair& p) const {
+      auto h = std::hash<const Object*>();
+      return h(p.first) * 31 + h(p.second);
+    }
+  };
+
+  Region<std::shared_ptr<Object>> region;
+  std::unordered_map<const Object*, uint64_t> slots;
+
+  std::unordered_map<TokenID, std::shared_ptr<Object>> tokens;
+  std::unordered_map<TokenID, std::shared_ptr<Object>> strings;
+  std::unordered_map<int64_t, std::shared_ptr<Object>> numbers;
+  std::unordered_map<uint64_t, std::shared_ptr<Object>> flonums;
+  std::unordered_map<Unicode, std::shared_ptr<Object>> characters;
+  std::unordered_map<Pair, std::shared_ptr<Object>, PairHash> cells;
+  // the top-level forms which are compiled at once add their constants.
+  std::mutex mutex;
+
+ public:
+  ConstantPool()
+      : region{},
+        slots{},
+        tokens{},
+        strings{},
+        numbers{},
+        flonums{},
+        characters{},
+        cells{},
+        mutex{} {
+    // the slot 0 is the empty list.
+    add_slot(nullptr);
+    return;
+  }
+
+  // the slot of the value which the quoted form x stands for.
+  uint64_t add(const std::shared_ptr<Object>& x, const File& file) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto value = intern(x, file);
+    auto it = slots.find(value.get());
+    if (it != slots.end()) {
+      return it->second;
+    }
+    return add_slot(std::move(value));
+  }
+
+  const std::shared_ptr<Object>& get(uint64_t slot) const {
+    return region.get(slot);
+  }
+
+ private:
+  uint64_t add_slot(std::shared_ptr<Object>&& value) {
+    auto key = value.get();
+    auto slot = static_cast<uint64_t>(region.size());
+    if (!region.set(slot, std::move(value))) {
+      return 0;
+    }
+    slots[key] = slot;
+    return slot;
+  }
+
+  template <typename Map, typename Key, typename Make>
+  static std::shared_ptr<Object> find_or_make(Map* map,
+                                              const Key& key,
+                                              Make make) {
+    auto it = map->find(key);
+    if (it != map->end()) {
+      return it->second;
+    }
+    auto value = make();
+    map->emplace(key, value);
+    return value;
+  }
+
+  // the canonical copy of the value which x stands for.
+  std::shared_ptr<Object> intern(const std::shared_ptr<Object>& x,
+                                 const File& file) {
+    if (x == nullptr) {
+      return nullptr;
+    }
+    if (x->type() == Type::token) {
+      auto id = std::dynamic_pointer_cast<Token>(x)->get_id();
+      switch (file.token_type_from_id(id)) {
+        case TokenType::number: {
+          auto& token = file.token_from_id(id);
+          if (is_flonum_token(token)) {
+            auto flonum = std::make_shared<Flonum>(to_flonum(token));
+            return find_or_make(&flonums, flonum->bits(), [&flonum]() {
+              return flonum;
+            });
+          }
+          auto value = itoa(token);
+          return find_or_make(&numbers, value, [value]() {
+            return std::make_shared<Number>(value);
+          });
+        }
+        case TokenType::character: {
+          auto value = file.token_from_id(id)[2];
+          return find_or_make(&characters, value, [value]() {
+            return std::make_shared<Character>(value);
+          });
+        }
+        case TokenType::string:
+          return find_or_make(&strings, id, [&file, id]() {
+            return String::make(file.token_from_id(id));
+          });
+        default:
+          return find_or_make(&tokens, id, [&x]() { return x; });
+      }
+    }
+    if (x->type() != Type::cell) {
+      return x;
+    }
+    // it goes along the cdrs by a loop, and into the cars by a recursion,
+    // then it conses the canonical items from the end.
+    std::vector<std::shared_ptr<Object>> items{};
+    auto rest = x;
+    for (; rest != nullptr && rest->type() == Type::cell;
+         rest = static_cast<Cell*>(rest.get())->cdr()) {
+      items.push_back(intern(static_cast<Cell*>(rest.get())->car(), file));
+    }
+    auto list = intern(rest, file);
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      auto key = Pair(it->get(), list.get());
+      list = find_or_make(&cells, key, [&it, &list]() {
+        return std::make_shared<Cell>(std::move(*it), list);
+      });
+    }
+    return list;
+  }
+};
+
+// the constants of the whole process.
+ConstantPool& constants() {
+  static auto pool = new ConstantPool();
+  return *pool;
+}
+
+class Lambda;
+
+struct Snippet {
+  std::shared_ptr<std::vector<Instruction>> instructions;
+  std::shared_ptr<std::map<uint64_t, std::size_t>> labels;
+  // the lambdas of its closure instructions, which live as long as it does;
+  // see LambdaTable.
+  std::shared_ptr<std::vector<std::shared_ptr<Lambda>>> closures;
+  uint64_t register_count;
+
+  Snippet()
+      : instructions(std::make_shared<std::vector<Instruction>>()),
+        labels(std::make_shared<std::map<uint64_t, std::size_t>>()),
+        closures(std::make_shared<std::vector<std::shared_ptr<Lambda>>>()),
+        register_count(0) {
+    return;
+  }
+
+  void push_back(Instruction&& inst) {
+    instructions->push_back(std::move(inst));
+    return;
+  }
+
+  // resolves the labels and counts the registers before it runs.
+  void link() {
+    labels->clear();
+    register_count = 0;
+    for (std::size_t i = 0; i < instructions->size(); ++i) {
+      auto& inst = (*instructions)[i];
+      uint64_t max_register = inst.operand[0];
+      switch (inst.instruction) {
+        case ISA::label:
+          (*labels)[inst.operand[0]] = i;
+          continue;
+        case ISA::br:
+          continue;
+        case ISA::call:
+          max_register += inst.operand[1];
+          break;
+        case ISA::mov:
+        case ISA::car:
+        case ISA::cdr:
+        case ISA::atom:
+        case ISA::touch:
+        case ISA::read_byte:
+        case ISA::close:
+        case ISA::string_length:
+        case ISA::string_hash:
+        case ISA::vector_length:
+        case ISA::hashtable_size:
+        case ISA::f64vector_length:
+        case ISA::list_to_f64vector:
+        case ISA::f64vector_sum:
+        case ISA::f64vector_min:
+        case ISA::f64vector_max:
+          max_register = std::max(max_register, inst.operand[1]);
+          break;
+        case ISA::cons:
+        case ISA::eq:
+        case ISA::eq_token:
+        case ISA::eq_number:
+        case ISA::pmap:
+        case ISA::write_byte:
+        case ISA::string_ref:
+        case ISA::string_ref_number:
+        case ISA::substring:
+        case ISA::string_append:
+        case ISA::string_eq:
+        case ISA::string_contains:
+        case ISA::string_split:
+        case ISA::make_vector:
+        case ISA::vector_ref:
+        case ISA::vector_ref_number:
+        case ISA::vector_set:
+        case ISA::hashtable_ref:
+        case ISA::hashtable_set:
+        case ISA::hashtable_contains:
+        case ISA::hashtable_delete:
+        case ISA::append:
+        case ISA::add:
+        case ISA::sub:
+        case ISA::mul:
+        case ISA::div:
+        case ISA::mod:
+        case ISA::num_eq:
+        case ISA::lt:
+        case ISA::le:
+        case ISA::gt:
+        case ISA::ge:
+        case ISA::add_fixnum:
+        case ISA::sub_fixnum:
+        case ISA::mul_fixnum:
+        case ISA::num_eq_fixnum:
+        case ISA::lt_fixnum:
+        case ISA::add_flonum:
+        case ISA::sub_flonum:
+        case ISA::mul_flonum:
+        case ISA::num_eq_flonum:
+        case ISA::lt_flonum:
+        case ISA::make_f64vector:
+        case ISA::f64vector_ref:
+        case ISA::f64vector_add:
+        case ISA::f64vector_sub:
+        case ISA::f64vector_mul:
+        case ISA::f64vector_div:
+        case ISA::f64vector_dot:
+        case ISA::f64vector_set:
+          max_register = std::max({max_register,
+                                   inst.operand[1],
+                                   inst.operand[2]});
+          break;
+        default:
+          break;
+      }
+      register_count = std::max(register_count, max_register + 1);
+    }
+    return;
+  }
+
+  void print(Serializer* out) const {
+    for (auto it = instructions->begin(); it != instructions->end(); ++it) {
+      it->print(out);
+    }
+  }
+};
+
+class Scope {
+ public:
+  static constexpr uint64_t not_found = 0xffffffff;
+  static constexpr uint64_t found_but_in_the_up = 0xfffffffe;
+
+ private:
+  std::shared_ptr<Scope> up_values;
+  std::map<TokenID, uint64_t> lexical_scope;
+  // the top-level defines of lambdas, by their registers.
+  std::map<uint64_t, std::shared_ptr<Lambda>> lambdas;
+  // set on the scope of a top-level form which is compiled apart from the
+  // others: it sees the globals of shared below limit, and the form defines
+  // those from first on, which were declared for it beforehand.
+  std::shared_ptr<Scope> shared;
+  uint64_t first;
+  uint64_t limit;
+
+ public:
+  Scope()
+      : up_values(nullptr),
+        lexical_scope{},
+        lambdas{},
+        shared(nullptr),
+        first(0),
+        limit(0) {
+    return;
+  }
+
+  explicit Scope(std::shared_ptr<Scope> scope)
+      : up_values(scope),
+        lexical_scope{},
+        lambdas{},
+        shared(nullptr),
+        first(0),
+        limit(0) {
+    return;
+  }
+
+  Scope(std::shared_ptr<Scope> shared_, uint64_t first_, uint64_t limit_)
+      : up_values(nullptr),
+        lexical_scope{},
+        lambdas{},
+        shared(shared_),
+        first(first_),
+        limit(limit_) {
+    return;
+  }
+
+  uint64_t find(TokenID id) const {
+    auto reg_num = local(id);
+    if (reg_num != not_found) {
+      return reg_num;
+    } else if (up_values != nullptr && up_values->find(id) != not_found) {
+      return found_but_in_the_up;
+    }
+    return not_found;
+  }
+
+  bool define(TokenID id) {
+    if (shared != nullptr) {
+      auto reg_num = shared->local(id);
+      if (reg_num < first || reg_num >= limit ||
+          lexical_scope.find(id) != lexical_scope.end()) {
+        return false;
+      }
+      lexical_scope[id] = reg_num;
+      return true;
+    } else if (lexical_scope.find(id) == lexical_scope.end()) {
+      auto reg_num = lexical_scope.size();
+      lexical_scope[id] = static_cast<uint64_t>(reg_num);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // finds the scope which defines id: depth is how many scopes up it is,
+  // and global tells whether it is the top-level one.
+  bool lookup(TokenID id,
+              uint64_t* depth,
+              uint64_t* reg_num,
+              bool* global) const {
+    uint64_t n = 0;
+    for (auto scope = this; scope != nullptr; scope = scope->up_values.get()) {
+      auto found = scope->local(id);
+      if (found != not_found) {
+        *depth = n;
+        *reg_num = found;
+        *global = scope->up_values == nullptr;
+        return true;
+      }
+      ++n;
+    }
+    return false;
+  }
+
+  bool is_global() const {
+    return up_values == nullptr;
+  }
+
+  const Scope& global() const {
+    auto scope = this;
+    while (scope->up_values != nullptr) {
+      scope = scope->up_values.get();
+    }
+    return *scope;
+  }
+
+  // the global defined by a lambda never changes, for a define can't be
+  // repeated; so the calls of it may be inlined.
+  void know(uint64_t reg_num, const std::shared_ptr<Lambda>& lambda) {
+    lambdas[reg_num] = lambda;
+    return;
+  }
+
+  Lambda* known(uint64_t reg_num) const {
+    auto it = lambdas.find(reg_num);
+    if (it != lambdas.end()) {
+      return it->second.get();
+    }
+    return shared != nullptr ? shared->known(reg_num) : nullptr;
+  }
+
+  // takes the lambdas which a form compiled apart has defined.
+  void merge(const Scope& form) {
+    lambdas.insert(form.lambdas.begin(), form.lambdas.end());
+    return;
+  }
+
+  uint64_t base() {
+    return shared != nullptr ? shared->base() : lexical_scope.size();
+  }
+
+  // the scope which the lambdas made in scope keep: for a form compiled
+  // apart, the global scope itself, for their bodies are compiled later.
+  static const std::shared_ptr<Scope>& enclosing(
+      const std::shared_ptr<Scope>& scope) {
+    return scope->shared != nullptr ? scope->shared : scope;
+  }
+
+ private:
+  // the register of id in this scope itself, or not_found.
+  uint64_t local(TokenID id) const {
+    auto it = lexical_scope.find(id);
+    if (it != lexical_scope.end()) {
+      return it->second;
+    } else if (shared != nullptr) {
+      auto reg_num = shared->local(id);
+      return reg_num < limit ? reg_num : not_found;
+    }
+    return not_found;
+  }
+};
+
+// the registers of a call, and the frame which its procedure was made in.
+// a call runs on a window of the call stack, and gets a frame only when a
+// closure or a future takes it; see CallStack.
+struct Frame {
+  std::vector<std::shared_ptr<Object>> registers;
+  std::shared_ptr<Frame> up;
+
+  Frame() : registers{}, up(nullptr) {
+    return;
+  }
+
+  explicit Frame(const std::shared_ptr<Frame>& up_)
+      : registers{},
+        up(up_) {
+    return;
+  }
+};
+
+// the bytes which the call stack of a thread or of a coroutine may take;
+// see CallStack.
+std::size_t& stack_limit() {
+  static std::size_t limit = std::size_t{1} << 30;
+  return limit;
+}
+
+// a stack in chunks on the heap. n items pushed together stay in one chunk
+// and never move until they are popped. the chunks above the top are kept
+// as spares up to spare_chunks, so a recursion which goes up and down over
+// the same depth does not allocate each time, and the rest are freed. the
+// chunks of the stacks of a thread are counted together against
+// stack_limit(). the chunks double from first_chunk up to chunk_capacity,
+// so the stack of a coroutine which calls a little takes a little.
+template <typename T>
+class SegmentedStack {
+ private:
+  static constexpr std::size_t first_chunk = 1 << 4;
+  static constexpr std::size_t chunk_capacity = 1 << 12;
+  static constexpr std::size_t spare_chunks = 16;
+
+  struct Chunk {
+    std::unique_ptr<T[]> items;
+    std::size_t capacity;
+    std::size_t top;
+  };
+
+  std::vector<Chunk> chunks;
+  std::size_t used;
+  std::size_t* held;
+  // the chunk on the top, out of the vector for the push and the pop.
+  T* items;
+  std::size_t top;
+  std::size_t capacity;
+
+ public:
+  explicit SegmentedStack(std::size_t* held_)
+      : chunks{},
+        used(0),
+        held(held_),
+        items(nullptr),
+        top(0),
+        capacity(0) {
+    return;
+  }
+
+  // n items on the top, or nullptr if a new chunk is over the limit.
+  T* push(std::size_t n) {
+    if (top + n > capacity && !grow(n)) {
+      return nullptr;
+    }
+    auto pushed = items + top;
+    top += n;
+    return pushed;
+  }
+
+  // pops the n items of the last push.
+  void pop(std::size_t n) {
+    top -= n;
+    if (top == 0) {
+      shrink();
+    }
+    return;
+  }
+
+  T& last() {
+    return items[top - 1];
+  }
+
+ private:
+  // moves on to a chunk for n items.
+  bool grow(std::size_t n) {
+    if (used == chunks.size() || chunks[used].capacity < n) {
+      auto size = used < 8 ? first_chunk << used : chunk_capacity;
+      size = n > size ? n : size;
+      if (*held + size * sizeof(T) > stack_limit()) {
+        return false;
+      }
+      release(used);
+      chunks.push_back(Chunk{std::make_unique<T[]>(size), size, 0});
+      *held += size * sizeof(T);
+    }
+    if (used != 0) {
+      chunks[used - 1].top = top;
+    }
+    items = chunks[used].items.get();
+    capacity = chunks[used].capacity;
+    top = 0;
+    ++used;
+    return true;
+  }
+
+  // goes back to the chunk below the empty one.
+  void shrink() {
+    --used;
+    release(used + spare_chunks);
+    if (used == 0) {
+      items = nullptr;
+      capacity = 0;
+    } else {
+      items = chunks[used - 1].items.get();
+      capacity = chunks[used - 1].capacity;
+      top = chunks[used - 1].top;
+    }
+    return;
+  }
+
+  // frees the chunks from the nth on.
+  void release(std::size_t n) {
+    while (chunks.size() > n) {
+      *held -= chunks.back().capacity * sizeof(T);
+      chunks.pop_back();
+    }
+    return;
+  }
+};
+
+// drops the frame of a call which returns; it is defined after Procedure.
+void drop_frame(std::shared_ptr<Frame>* frame);
+
+// the calls which are running on a thread, each with its register window.
+// the machine runs a call of a procedure in the same loop as its caller,
+// so the depth of a recursion is bound by stack_limit() instead of the
+// native stack. a call whose frame is taken moves its registers into the
+// frame, and runs on them from then on; the frame outlives the window.
+// a coroutine has a stack of its own, which stays as it is while the
+// coroutine is suspended.
+class CallStack {
+ public:
+  struct Activation {
+    // where the caller goes on, and its register for the result.
+    const Snippet* snippet = nullptr;
+    std::size_t pc = 0;
+    uint64_t result = 0;
+    // the procedure and the window of the callee, and its frame once a
+    // closure or a future takes it.
+    std::shared_ptr<Object> procedure{};
+    const std::shared_ptr<Frame>* up = nullptr;
+    std::shared_ptr<Object>* registers = nullptr;
+    std::size_t size = 0;
+    std::shared_ptr<Frame> frame{};
+  };
+
+ private:
+  std::size_t held;
+  std::size_t count;
+  SegmentedStack<Activation> activations;
+  SegmentedStack<std::shared_ptr<Object>> windows;
+
+ public:
+  CallStack()
+      : held(0),
+        count(0),
+        activations(&held),
+        windows(&held) {
+    return;
+  }
+
+  // the calls of a coroutine which never resumes.
+  ~CallStack() {
+    while (count > 0) {
+      pop();
+    }
+    return;
+  }
+
+  std::size_t depth() const {
+    return count;
+  }
+
+  // a new activation with a window of size registers, which must be at
+  // least one; nullptr if the stack is over the limit.
+  Activation* push(std::size_t size) {
+    auto registers = windows.push(size);
+    if (registers == nullptr) {
+      return nullptr;
+    }
+    auto activation = activations.push(1);
+    if (activation == nullptr) {
+      windows.pop(size);
+      return nullptr;
+    }
+    activation->registers = registers;
+    activation->size = size;
+    ++count;
+    return activation;
+  }
+
+  Activation& top() {
+    return activations.last();
+  }
+
+  void pop() {
+    auto& activation = activations.last();
+    if (activation.frame == nullptr) {
+      for (std::size_t i = 0; i < activation.size; ++i) {
+        activation.registers[i].reset();
+      }
+    } else {
+      drop_frame(&activation.frame);
+    }
+    windows.pop(activation.size);
+    activation.procedure.reset();
+    activation.frame.reset();
+    activations.pop(1);
+    --count;
+    return;
+  }
+};
+
+CallStack& call_stack() {
+  static thread_local CallStack stack;
+  return stack;
+}
+
+// a lambda expression as it was read. the body stays a form until the first
+// call, which compiles it once for all the closures of the lambda; or all of
+// them are compiled up front in the eager mode.
+class Lambda {
+ private:
+  const uint64_t id;
+  const std::vector<TokenID> params;
+  const std::shared_ptr<Object> body;
+  const std::shared_ptr<Scope> scope;
+  std::atomic<bool> ready;
+  // set while its body is compiled, which may inline the others.
+  bool compiling;
+  // set if its body didn't compile; the calls fail then.
+  bool broken;
+  Snippet snippet;
+
+ public:
+  Lambda(uint64_t id_,
+         std::vector<TokenID>&& params_,
+         const std::shared_ptr<Object>& body_,
+         const std::shared_ptr<Scope>& scope_)
+      : id(id_),
+        params(std::move(params_)),
+        body(body_),
+        scope(scope_),
+        ready(false),
+        compiling(false),
+        broken(false),
+        snippet{} {
+    return;
+  }
+
+  ~Lambda();
+
+  uint64_t get_id() const {
+    return id;
+  }
+
+  std::size_t arity() const {
+    return params.size();
+  }
+
+  bool is_compiling() const {
+    return compiling;
+  }
+
+  bool is_broken() const {
+    return broken;
+  }
+
+  const Snippet& compiled(const File& file);
+
+  void print_feedback(FILE* fp) const;
+};
+
+// every lambda which is alive, by the slot which its closure instructions
+// refer to. the snippets with the closure instructions own their lambdas,
+// and the procedures theirs, but the table doesn't: the slot of a lambda is
+// free again when the lambda is gone, as after a top-level form of the
+// server which made a closure for its value only.
+class LambdaTable {
+ private:
+  Region<std::weak_ptr<Lambda>> region;
+  // the top-level forms which are compiled at once add their lambdas under
+  // it, and the lambdas of any thread give their slots back.
+  std::mutex mutex;
+  std::vector<uint64_t> free;
+
+ public:
+  LambdaTable() : region{}, mutex{}, free{} {
+    return;
+  }
+
+  // nullptr if the region is full.
+  std::shared_ptr<Lambda> make(std::vector<TokenID>&& params,
+                               const std::shared_ptr<Object>& body,
+                               const std::shared_ptr<Scope>& scope) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto slot = static_cast<uint64_t>(region.size());
+    if (!free.empty()) {
+      slot = free.back();
+      free.pop_back();
+    }
+    auto lambda =
+        std::make_shared<Lambda>(slot, std::move(params), body, scope);
+    if (!region.set(slot, lambda)) {
+      return nullptr;
+    }
+    return lambda;
+  }
+
+  // the lambda of a slot, if it is still alive.
+  std::shared_ptr<Lambda> get(uint64_t slot) const {
+    return region.get(slot).lock();
+  }
+
+  std::size_t size() const {
+    return region.size();
+  }
+
+  void release(uint64_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free.push_back(slot);
+    return;
+  }
+};
+
+LambdaTable& lambdas() {
+  static auto table = new LambdaTable();
+  return *table;
+}
+
+Lambda::~Lambda() {
+  lambdas().release(id);
+  return;
+}
+
+// the compiler isn't reentrant: the main thread compiles the top-level forms
+// while the other threads may compile the bodies on their first calls. it is
+// recursive, for the inliner compiles the callees in the middle.
+std::recursive_mutex& compiler_mutex() {
+  static auto mutex = new std::recursive_mutex();
+  return *mutex;
+}
+
+class Procedure : public Object {
+ private:
+  const std::shared_ptr<Lambda> lambda;
+  const std::shared_ptr<Frame> frame;
+
+ public:
+  Procedure(const std::shared_ptr<Lambda>& lambda_,
+            const std::shared_ptr<Frame>& frame_)
+      : Object(Type::procedure),
+        lambda(lambda_),
+        frame(frame_) {
+    return;
+  }
+
+  ~Procedure() override {
+    return;
+  }
+
+  Lambda& get_lambda() const {
+    return *lambda;
+  }
+
+  const std::shared_ptr<Frame>& get_frame() const {
+    return frame;
+  }
+};
+
+// the lambdas which a call defines inside are closures of its frame, kept
+// in the registers of that very frame, so the frame and they keep each
+// other alive after the call. if nothing else has the frame or them when
+// the call returns, they are all garbage; the registers are cleared, so
+// that they go with the frame.
+void drop_frame(std::shared_ptr<Frame>* frame) {
+  int64_t selves = 0;
+  for (auto&& x : (*frame)->registers) {
+    if (x != nullptr && x->type() == Type::procedure && x.use_count() == 1 &&
+        static_cast<Procedure*>(x.get())->get_frame() == *frame) {
+      ++selves;
+    }
+  }
+  if (selves > 0 && frame->use_count() == 1 + selves) {
+    for (auto&& x : (*frame)->registers) {
+      x.reset();
+    }
+  }
+  frame->reset();
+  return;
+}
+
+// expands the define-syntax macros and the quasiquotes, between read() and
+// compile(). the expansion of a macro use or a quasiquote is remembered by
+// its source form while the top-level form expands, so the form is expanded
+// once even when a template puts it in many places. the constant parts of a
+// quasiquote become one quoted datum instead of a chain of conses.
+class Expander {
+ private:
+  struct Rule {
+    std::shared_ptr<Object> pattern, body;
+  };
+
+  struct Macro {
+    std::set<TokenID> literals;
+    std::vector<Rule> rules;
+  };
+
+  // a pattern variable binds a form, or a sequence of them under `...`.
+  struct Match {
+    bool sequence;
+    std::shared_ptr<Object> form;
+    std::vector<Match> items;
+  };
+
+  using Bindings = std::map<TokenID, Match>;
+
+  // the quasiquoted part is either a constant datum or an expression.
+  struct Quasi {
+    bool constant;
+    std::shared_ptr<Object> form;
+  };
+
+  const File& file;
+  std::map<TokenID, Macro> macros;
+  std::unordered_map<const Object*,
+                     std::pair<std::shared_ptr<Object>,
+                               std::shared_ptr<Object>>> cache;
+
+ public:
+  explicit Expander(const File& file_)
+      : file(file_),
+        macros{},
+        cache{} {
+    return;
+  }
+
+  // the cache is for the forms which a template puts in many places, so it
+  // lives as long as the expansion of one top-level form.
+  std::shared_ptr<Object> expand(const std::shared_ptr<Object>& x) {
+    auto ret = expand_form(x);
+    cache.clear();
+    return ret;
+  }
+
+ private:
+  static constexpr TokenID not_a_token = ~static_cast<TokenID>(0);
+
+  std::shared_ptr<Object> expand_form(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::cell) {
+      return x;
+    }
+    auto x_ = std::dynamic_pointer_cast<Cell>(x);
+    auto op = id_of(x_->car());
+    if (op == static_cast<TokenID>(SpecialTokenID::quote) ||
+        op == static_cast<TokenID>(SpecialTokenID::quote2)) {
+      return x;
+    } else if (op == static_cast<TokenID>(SpecialTokenID::define_syntax)) {
+      return define(x_);
+    } else if (op != static_cast<TokenID>(SpecialTokenID::quasiquote) &&
+               macros.find(op) == macros.end()) {
+      return expand_list(x);
+    }
+    auto it = cache.find(x.get());
+    if (it != cache.end()) {
+      return it->second.second;
+    }
+    std::shared_ptr<Object> ret;
+    if (op == static_cast<TokenID>(SpecialTokenID::quasiquote)) {
+      ret = expression(quasi(second(x), 1));
+    } else {
+      ret = expand_form(apply(macros.at(op), x));
+    }
+    cache.emplace(x.get(), std::make_pair(x, ret));
+    return ret;
+  }
+
+  static TokenID id_of(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::token) {
+      return not_a_token;
+    }
+    return std::dynamic_pointer_cast<Token>(x)->get_id();
+  }
+
+  static bool is_cell(const std::shared_ptr<Object>& x) {
+    return x != nullptr && x->type() == Type::cell;
+  }
+
+  static const std::shared_ptr<Object>& car(const std::shared_ptr<Object>& x) {
+    return static_cast<Cell*>(x.get())->car();
+  }
+
+  static const std::shared_ptr<Object>& cdr(const std::shared_ptr<Object>& x) {
+    return static_cast<Cell*>(x.get())->cdr();
+  }
+
+  static std::shared_ptr<Object> cons(std::shared_ptr<Object> a,
+                                      std::shared_ptr<Object> d) {
+    return std::make_shared<Cell>(std::move(a), std::move(d));
+  }
+
+  static std::shared_ptr<Object> list(SpecialTokenID op,
+                                      std::shared_ptr<Object> a) {
+    return cons(Token::make(static_cast<TokenID>(op)),
+                cons(std::move(a), nullptr));
+  }
+
+  static std::shared_ptr<Object> list(SpecialTokenID op,
+                                      std::shared_ptr<Object> a,
+                                      std::shared_ptr<Object> b) {
+    return cons(Token::make(static_cast<TokenID>(op)),
+                cons(std::move(a), cons(std::move(b), nullptr)));
+  }
+
+  // the item of (prefix item), or nullptr if x isn't such a form.
+  static std::shared_ptr<Object> second(const std::shared_ptr<Object>& x) {
+    if (!is_cell(x) || !is_cell(cdr(x)) || cdr(cdr(x)) != nullptr) {
+      return nullptr;
+    }
+    return car(cdr(x));
+  }
+
+  static bool is_prefixed(const std::shared_ptr<Object>& x,
+                          SpecialTokenID prefix) {
+    return is_cell(x) &&
+           id_of(car(x)) == static_cast<TokenID>(prefix) &&
+           is_cell(cdr(x)) &&
+           cdr(cdr(x)) == nullptr;
+  }
+
+  static bool is_dots(const std::shared_ptr<Object>& x) {
+    return id_of(x) == static_cast<TokenID>(SpecialTokenID::dots);
+  }
+
+  // expands the items of a list, and shares it if nothing has changed.
+  std::shared_ptr<Object> expand_list(const std::shared_ptr<Object>& x) {
+    std::vector<std::shared_ptr<Object>> items{};
+    bool changed = false;
+    auto rest = x;
+    for (; is_cell(rest); rest = cdr(rest)) {
+      auto item = expand_form(car(rest));
+      changed = changed || item != car(rest);
+      items.push_back(std::move(item));
+    }
+    if (!changed) {
+      return x;
+    }
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      rest = cons(std::move(*it), std::move(rest));
+    }
+    return rest;
+  }
+
+  // (define-syntax name (syntax-rules (literal ...) (pattern body) ...))
+  std::shared_ptr<Object> define(const std::shared_ptr<Cell>& x) {
+    auto name = is_cell(x->cdr()) ? car(x->cdr()) : nullptr;
+    auto rules = second(x->cdr());
+    if (id_of(name) == not_a_token ||
+        !is_cell(rules) ||
+        id_of(car(rules)) !=
+            static_cast<TokenID>(SpecialTokenID::syntax_rules) ||
+        !is_cell(cdr(rules))) {
+      report("error.\n");
+      return list(SpecialTokenID::quote2, name);
+    }
+    Macro macro{};
+    for (auto rest = car(cdr(rules)); is_cell(rest); rest = cdr(rest)) {
+      macro.literals.insert(id_of(car(rest)));
+    }
+    for (auto rest = cdr(cdr(rules)); is_cell(rest); rest = cdr(rest)) {
+      auto rule = car(rest);
+      if (!is_cell(rule) || !is_cell(car(rule)) || second(rule) == nullptr) {
+        report("error.\n");
+        return list(SpecialTokenID::quote2, name);
+      }
+      macro.rules.push_back({car(rule), second(rule)});
+    }
+    macros[id_of(name)] = std::move(macro);
+    // the uses expanded so far may have meant the old definition.
+    cache.clear();
+    return list(SpecialTokenID::quote2, name);
+  }
+
+  std::shared_ptr<Object> apply(const Macro& macro,
+                                const std::shared_ptr<Object>& x) {
+    for (auto&& rule : macro.rules) {
+      Bindings bindings{};
+      // the keyword itself is not matched.
+      if (match(macro, cdr(rule.pattern), cdr(x), &bindings)) {
+        return instantiate(rule.body, bindings);
+      }
+    }
+    report("error: no syntax rule matches.\n");
+    return list(SpecialTokenID::quote2, nullptr);
+  }
+
+  bool is_variable(const Macro& macro, TokenID id) const {
+    return id != not_a_token &&
+           id != static_cast<TokenID>(SpecialTokenID::underscore) &&
+           id != static_cast<TokenID>(SpecialTokenID::dots) &&
+           macro.literals.find(id) == macro.literals.end() &&
+           file.token_type_from_id(id) == TokenType::id;
+  }
+
+  void variables(const Macro& macro,
+                 const std::shared_ptr<Object>& pattern,
+                 std::vector<TokenID>* ids) const {
+    auto rest = pattern;
+    for (; is_cell(rest); rest = cdr(rest)) {
+      variables(macro, car(rest), ids);
+    }
+    if (is_variable(macro, id_of(rest))) {
+      ids->push_back(id_of(rest));
+    }
+    return;
+  }
+
+  static std::size_t length(const std::shared_ptr<Object>& x) {
+    std::size_t n = 0;
+    for (auto rest = x; is_cell(rest); rest = cdr(rest)) {
+      ++n;
+    }
+    return n;
+  }
+
+  bool match(const Macro& macro,
+             const std::shared_ptr<Object>& pattern,
+             const std::shared_ptr<Object>& x,
+             Bindings* bindings) const {
+    if (pattern == nullptr) {
+      return x == nullptr;
+    } else if (!is_cell(pattern)) {
+      auto id = id_of(pattern);
+      if (id == static_cast<TokenID>(SpecialTokenID::underscore)) {
+        return true;
+      } else if (is_variable(macro, id)) {
+        (*bindings)[id] = {false, x, {}};
+        return true;
+      }
+      // the literals, and the constants, which are interned tokens.
+      return id_of(x) == id;
+    }
+    auto p = pattern;
+    auto rest = x;
+    while (is_cell(p)) {
+      if (is_cell(cdr(p)) && is_dots(car(cdr(p)))) {
+        // p ... takes all but the items which the patterns after it need.
+        auto after = cdr(cdr(p));
+        auto need = length(after);
+        auto have = length(rest);
+        if (have < need) {
+          return false;
+        }
+        std::vector<TokenID> ids{};
+        variables(macro, car(p), &ids);
+        for (auto&& id : ids) {
+          (*bindings)[id] = {true, nullptr, {}};
+        }
+        for (auto n = have - need; n > 0; --n) {
+          Bindings item{};
+          if (!match(macro, car(p), car(rest), &item)) {
+            return false;
+          }
+          for (auto&& id : ids) {
+            (*bindings)[id].items.push_back(std::move(item[id]));
+          }
+          rest = cdr(rest);
+        }
+        p = after;
+        continue;
+      }
+      if (!is_cell(rest) || !match(macro, car(p), car(rest), bindings)) {
+        return false;
+      }
+      p = cdr(p);
+      rest = cdr(rest);
+    }
+    return match(macro, p, rest, bindings);
+  }
+
+  std::shared_ptr<Object> instantiate(const std::shared_ptr<Object>& body,
+                                      const Bindings& bindings) const {
+    if (!is_cell(body)) {
+      auto it = bindings.find(id_of(body));
+      if (it != bindings.end() && !it->second.sequence) {
+        return it->second.form;
+      }
+      return body;
+    }
+    std::vector<std::shared_ptr<Object>> items{};
+    auto rest = body;
+    while (is_cell(rest)) {
+      if (!is_cell(cdr(rest)) || !is_dots(car(cdr(rest)))) {
+        items.push_back(instantiate(car(rest), bindings));
+        rest = cdr(rest);
+        continue;
+      }
+      // item ... repeats the item once for each match of its sequences.
+      std::vector<TokenID> ids{};
+      std::vector<TokenID> sequences{};
+      std::size_t n = 0;
+      collect(car(rest), &ids);
+      for (auto&& id : ids) {
+        auto it = bindings.find(id);
+        if (it != bindings.end() && it->second.sequence) {
+          n = sequences.empty() ? it->second.items.size()
+                                : std::min(n, it->second.items.size());
+          sequences.push_back(id);
+        }
+      }
+      if (sequences.empty()) {
+        report("error: no sequence before `...`.\n");
+        return nullptr;
+      }
+      for (std::size_t i = 0; i < n; ++i) {
+        auto item = bindings;
+        for (auto&& id : sequences) {
+          item[id] = bindings.at(id).items[i];
+        }
+        items.push_back(instantiate(car(rest), item));
+      }
+      rest = cdr(cdr(rest));
+    }
+    rest = instantiate(rest, bindings);
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+      rest = cons(std::move(*it), std::move(rest));
+    }
+    return rest;
+  }
+
+  static void collect(const std::shared_ptr<Object>& body,
+                      std::vector<TokenID>* ids) {
+    auto rest = body;
+    for (; is_cell(rest); rest = cdr(rest)) {
+      collect(car(rest), ids);
+    }
+    if (id_of(rest) != not_a_token) {
+      ids->push_back(id_of(rest));
+    }
+    return;
+  }
+
+  static std::shared_ptr<Object> expression(const Quasi& q) {
+    if (q.constant) {
+      return list(SpecialTokenID::quote2, q.form);
+    }
+    return q.form;
+  }
+
+  // `x at the nesting depth; ,x and ,@x belong to the depth 1.
+  Quasi quasi(const std::shared_ptr<Object>& x, int depth) {
+    if (!is_cell(x)) {
+      return {true, x};
+    }
+    if (is_prefixed(x, SpecialTokenID::comma) ||
+        is_prefixed(x, SpecialTokenID::comma_at) ||
+        is_prefixed(x, SpecialTokenID::quasiquote)) {
+      auto prefix = static_cast<SpecialTokenID>(id_of(car(x)));
+      if (prefix == SpecialTokenID::comma && depth == 1) {
+        return {false, expand_form(second(x))};
+      }
+      auto inner = quasi(second(x),
+                         prefix == SpecialTokenID::quasiquote ? depth + 1
+                                                              : depth - 1);
+      if (inner.constant) {
+        return {true, x};
+      }
+      return {false, list(SpecialTokenID::cons,
+                          list(SpecialTokenID::quote2, car(x)),
+                          list(SpecialTokenID::cons,
+                               inner.form,
+                               list(SpecialTokenID::quote2, nullptr)))};
+    }
+    std::vector<std::shared_ptr<Object>> items{};
+    auto rest = x;
+    // (a . ,b) is read as (a unquote b).
+    for (; is_cell(rest) && !is_prefixed(rest, SpecialTokenID::comma);
+         rest = cdr(rest)) {
+      items.push_back(car(rest));
+    }
+    auto tail = quasi(rest, depth);
+    std::vector<Quasi> parts{};
+    std::vector<bool> splices{};
+    bool constant = tail.constant;
+    for (auto&& item : items) {
+      splices.push_back(depth == 1 &&
+                        is_prefixed(item, SpecialTokenID::comma_at));
+      if (splices.back()) {
+        parts.push_back({false, expand_form(second(item))});
+      } else {
+        parts.push_back(quasi(item, depth));
+      }
+      constant = constant && parts.back().constant;
+    }
+    if (constant) {
+      return {true, x};
+    }
+    // builds it from the end, and keeps the constant tails as one datum.
+    auto ret = tail;
+    for (std::size_t i = items.size(); i > 0; --i) {
+      auto& part = parts[i - 1];
+      if (splices[i - 1]) {
+        ret = {false, list(SpecialTokenID::append,
+                           part.form,
+                           expression(ret))};
+      } else if (part.constant && ret.constant) {
+        ret = {true, cons(part.form, ret.form)};
+      } else {
+        ret = {false, list(SpecialTokenID::cons,
+                           expression(part),
+                           expression(ret))};
+      }
+    }
+    return ret;
+  }
+};
+
+Snippet compile(std::shared_ptr<Object> x,
+             const File& file,
+             uint64_t shift_width,
+             struct Snippet&& snippet,
+             std::shared_ptr<Scope> scope,
+             uint64_t* max_label_id);
+
+struct Primitive {
+  ISA instruction;
+  int arity;
+};
+
+// the primitives which are compiled to one instruction on their arguments.
+const std::map<TokenID, Primitive>& primitives() {
+  using S = SpecialTokenID;
+  static const auto table = new std::map<TokenID, Primitive>{
+    {static_cast<TokenID>(S::touch),           {ISA::touch, 1}},
+    {static_cast<TokenID>(S::pmap),            {ISA::pmap, 2}},
+    {static_cast<TokenID>(S::yield),           {ISA::yield, 0}},
+    {static_cast<TokenID>(S::socketpair),      {ISA::socketpair, 0}},
+    {static_cast<TokenID>(S::read_byte),       {ISA::read_byte, 1}},
+    {static_cast<TokenID>(S::write_byte),      {ISA::write_byte, 2}},
+    {static_cast<TokenID>(S::close),           {ISA::close, 1}},
+    {static_cast<TokenID>(S::string_length),   {ISA::string_length, 1}},
+    {static_cast<TokenID>(S::string_ref),      {ISA::string_ref, 2}},
+    {static_cast<TokenID>(S::substring),       {ISA::substring, 3}},
+    {static_cast<TokenID>(S::string_append),   {ISA::string_append, 2}},
+    {static_cast<TokenID>(S::string_eq),       {ISA::string_eq, 2}},
+    {static_cast<TokenID>(S::string_contains), {ISA::string_contains, 2}},
+    {static_cast<TokenID>(S::string_split),    {ISA::string_split, 2}},
+    {static_cast<TokenID>(S::string_hash),     {ISA::string_hash, 1}},
+    {static_cast<TokenID>(S::make_vector),     {ISA::make_vector, 2}},
+    {static_cast<TokenID>(S::vector_ref),      {ISA::vector_ref, 2}},
+    {static_cast<TokenID>(S::vector_set),      {ISA::vector_set, 3}},
+    {static_cast<TokenID>(S::vector_length),   {ISA::vector_length, 1}},
+    {static_cast<TokenID>(S::hashtable_ref),   {ISA::hashtable_ref, 3}},
+    {static_cast<TokenID>(S::hashtable_set),   {ISA::hashtable_set, 3}},
+    {static_cast<TokenID>(S::hashtable_contains),
+     {ISA::hashtable_contains, 2}},
+    {static_cast<TokenID>(S::hashtable_delete), {ISA::hashtable_delete, 2}},
+    {static_cast<TokenID>(S::hashtable_size),  {ISA::hashtable_size, 1}},
+    {static_cast<TokenID>(S::append),          {ISA::append, 2}},
+    {static_cast<TokenID>(S::add),             {ISA::add, 2}},
+    {static_cast<TokenID>(S::sub),             {ISA::sub, 2}},
+    {static_cast<TokenID>(S::mul),             {ISA::mul, 2}},
+    {static_cast<TokenID>(S::div),             {ISA::div, 2}},
+    {static_cast<TokenID>(S::mod),             {ISA::mod, 2}},
+    {static_cast<TokenID>(S::num_eq),          {ISA::num_eq, 2}},
+    {static_cast<TokenID>(S::lt),              {ISA::lt, 2}},
+    {static_cast<TokenID>(S::le),              {ISA::le, 2}},
+    {static_cast<TokenID>(S::gt),              {ISA::gt, 2}},
+    {static_cast<TokenID>(S::ge),              {ISA::ge, 2}},
+    {static_cast<TokenID>(S::make_f64vector),  {ISA::make_f64vector, 2}},
+    {static_cast<TokenID>(S::f64vector_ref),   {ISA::f64vector_ref, 2}},
+    {static_cast<TokenID>(S::f64vector_set),   {ISA::f64vector_set, 3}},
+    {static_cast<TokenID>(S::f64vector_length),
+     {ISA::f64vector_length, 1}},
+    {static_cast<TokenID>(S::list_to_f64vector),
+     {ISA::list_to_f64vector, 1}},
+    {static_cast<TokenID>(S::f64vector_add),   {ISA::f64vector_add, 2}},
+    {static_cast<TokenID>(S::f64vector_sub),   {ISA::f64vector_sub, 2}},
+    {static_cast<TokenID>(S::f64vector_mul),   {ISA::f64vector_mul, 2}},
+    {static_cast<TokenID>(S::f64vector_div),   {ISA::f64vector_div, 2}},
+    {static_cast<TokenID>(S::f64vector_dot),   {ISA::f64vector_dot, 2}},
+    {static_cast<TokenID>(S::f64vector_sum),   {ISA::f64vector_sum, 1}},
+    {static_cast<TokenID>(S::f64vector_min),   {ISA::f64vector_min, 1}},
+    {static_cast<TokenID>(S::f64vector_max),   {ISA::f64vector_max, 1}},
+  };
+  return *table;
+}
+
+// (op) -> inst r
+Snippet compile_nullary(ISA inst,
+                        const std::shared_ptr<Object>& dx,
+                        uint64_t shift_width,
+                        struct Snippet&& snippet) {
+  if (dx != nullptr) {
+    report("error.\n");
+    return {};
+  }
+  snippet.push_back(Instruction(inst, shift_width));
+  return std::move(snippet);
+}
+
+// (op x) -> inst r, r
+Snippet compile_unary(ISA inst,
+                      const std::shared_ptr<Object>& dx,
+                      const File& file,
+                      uint64_t shift_width,
+                      struct Snippet&& snippet,
+                      std::shared_ptr<Scope> scope,
+                      uint64_t* max_label_id) {
+  if (dx == nullptr || dx->type() != Type::cell) {
+    report("error.\n");
+    return {};
+  }
+  auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+  if (dx_->cdr() != nullptr) {
+    report("error.\n");
+    return {};
+  }
+  snippet = compile(dx_->car(),
+                    file,
+                    shift_width,
+                    std::move(snippet),
+                    scope,
+                    max_label_id);
+  snippet.push_back(Instruction(inst, shift_width, shift_width));
+  return std::move(snippet);
+}
+
+// (op x y) -> inst r, r, r+1
+Snippet compile_binary(ISA inst,
+                       const std::shared_ptr<Object>& dx,
+                       const File& file,
+                       uint64_t shift_width,
+                       struct Snippet&& snippet,
+                       std::shared_ptr<Scope> scope,
+                       uint64_t* max_label_id) {
+  if (dx == nullptr || dx->type() != Type::cell) {
+    report("error.\n");
+    return {};
+  }
+  auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+  auto ddx = dx_->cdr();
+  if (ddx == nullptr || ddx->type() != Type::cell) {
+    report("error.\n");
+    return {};
+  }
+  auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
+  if (ddx_->cdr() != nullptr) {
+    report("error.\n");
+    return {};
+  }
+  snippet = compile(dx_->car(),
+                    file,
+                    shift_width,
+                    std::move(snippet),
+                    scope,
+                    max_label_id);
+  snippet = compile(ddx_->car(),
+                    file,
+                    shift_width + 1,
+                    std::move(snippet),
+                    scope,
+                    max_label_id);
+  snippet.push_back(Instruction(inst,
+                                shift_width,
+                                shift_width,
+                                shift_width + 1));
+  return std::move(snippet);
+}
+
+// (op x y z) -> inst r, r+1, r+2; r is both the first source and the result.
+Snippet compile_ternary(ISA inst,
+                        const std::shared_ptr<Object>& dx,
+                        const File& file,
+                        uint64_t shift_width,
+                        struct Snippet&& snippet,
+                        std::shared_ptr<Scope> scope,
+                        uint64_t* max_label_id) {
+  auto rest = dx;
+  for (uint64_t i = 0; i < 3; ++i) {
+    if (rest == nullptr || rest->type() != Type::cell) {
+      report("error.\n");
+      return {};
+    }
+    auto rest_ = std::dynamic_pointer_cast<Cell>(rest);
+    snippet = compile(rest_->car(),
+                      file,
+                      shift_width + i,
+                      std::move(snippet),
+                      scope,
+                      max_label_id);
+    rest = rest_->cdr();
+  }
+  if (rest != nullptr) {
+    report("error.\n");
+    return {};
+  }
+  snippet.push_back(Instruction(inst,
+                                shift_width,
+                                shift_width + 1,
+                                shift_width + 2));
+  return std::move(snippet);
+}
+
+// (f x ...) -> call r, n; f is in r, and the n arguments follow it.
+Snippet compile_call(const std::shared_ptr<Object>& x,
+                     const File& file,
+                     uint64_t shift_width,
+                     struct Snippet&& snippet,
+                     std::shared_ptr<Scope> scope,
+                     uint64_t* max_label_id) {
+  uint64_t n = 0;
+  auto rest = x;
+  for (; rest != nullptr && rest->type() == Type::cell; ++n) {
+    auto rest_ = std::dynamic_pointer_cast<Cell>(rest);
+    snippet = compile(rest_->car(),
+                      file,
+                      shift_width + n,
+                      std::move(snippet),
+                      scope,
+                      max_label_id);
+    rest = rest_->cdr();
+  }
+  if (rest != nullptr) {
+    report("error.\n");
+    return {};
+  }
+  snippet.push_back(Instruction(ISA::call, shift_width, n - 1));
+  return std::move(snippet);
+}
+
+Snippet compile(std::shared_ptr<Object> x,
+             const File& file,
+             uint64_t shift_width,
+             struct Snippet&& snippet,
+             std::shared_ptr<Scope> scope,
+             uint64_t* max_label_id) {
+  if (x == nullptr) {
+    // () is the empty list.
+    snippet.push_back(Instruction(ISA::load_const,
+                                  shift_width,
+                                  constants().add(nullptr, file)));
+  } else if (x->type() == Type::token) {
+    auto id = std::dynamic_pointer_cast<Token>(x)->get_id();
+    auto type = file.token_type_from_id(id);
+    if (type == TokenType::boolean) {
+      if (file.token_from_id(id)[1] == 't') {
+        snippet.push_back(Instruction(ISA::load_true, shift_width));
+      } else {
+        snippet.push_back(Instruction(ISA::load_false, shift_width));
+      }
+    } else if (type == TokenType::number &&
+               is_flonum_token(file.token_from_id(id))) {
+      // the flonums are boxed, so they are shared from the constant pool.
+      snippet.push_back(Instruction(ISA::load_const,
+                                    shift_width,
+                                    constants().add(x, file)));
+    } else if (type == TokenType::number) {
+      auto value = static_cast<uint64_t>(itoa(file.token_from_id(id)));
+      snippet.push_back(Instruction(ISA::load_number, shift_width, value));
+    } else if (type == TokenType::character) {
+      auto value = file.token_from_id(id)[2];
+      snippet.push_back(Instruction(ISA::load_character, shift_width, value));
+    } else if (type == TokenType::string) {
+      // the literals are shared from the constant pool too, so that the
+      // bodies of the lambdas find theirs however they are compiled.
+      snippet.push_back(Instruction(ISA::load_const,
+                                    shift_width,
+                                    constants().add(x, file)));
+    } else {
+      uint64_t depth = 0;
+      uint64_t reg_num = 0;
+      bool global = false;
+      if (!scope->lookup(id, &depth, &reg_num, &global)) {
+        snippet.push_back(Instruction(ISA::load_dynamic, shift_width, id));
+      } else if (depth == 0) {
+        snippet.push_back(Instruction(ISA::mov, shift_width, reg_num));
+      } else if (global) {
+        snippet.push_back(Instruction(ISA::load_global, shift_width, reg_num));
+      } else {
+        snippet.push_back(Instruction(ISA::load_up,
+                                      shift_width,
+                                      depth,
+                                      reg_num));
+      }
+    }
+  } else {
+    auto x_ = std::dynamic_pointer_cast<Cell>(x);
     auto ax = x_->car();
     auto dx = x_->cdr();
-    if (ax->type() == Type::token) {
+    if (ax != nullptr && ax->type() == Type::token) {
       auto op = std::dynamic_pointer_cast<Token>(ax)->get_id();
       if (op == static_cast<TokenID>(SpecialTokenID::cons)) {
         if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        snippet = compile(adx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (ddx == nullptr || ddx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
+        auto addx = ddx_->car();
+        auto dddx = ddx_->cdr();
+        snippet = compile(addx,
+                          file,
+                          shift_width + 1,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (dddx != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        snippet.push_back(Instruction(ISA::cons,
+                                      shift_width,
+                                      shift_width,
+                                      shift_width + 1));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::car)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        snippet = compile(adx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (ddx != nullptr) {
+          report("error.\n");
+        }
+        snippet.push_back(Instruction(ISA::car, shift_width, shift_width));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::cdr)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        snippet = compile(adx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (ddx != nullptr) {
+          report("error.\n");
+        }
+        snippet.push_back(Instruction(ISA::cdr, shift_width, shift_width));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::atom)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        snippet = compile(adx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (ddx != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        snippet.push_back(Instruction(ISA::atom, shift_width, shift_width));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::eq)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        snippet = compile(adx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (ddx == nullptr || ddx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
+        auto addx = ddx_->car();
+        auto dddx = ddx_->cdr();
+        snippet = compile(addx,
+                          file,
+                          shift_width + 1,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        if (dddx != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        snippet.push_back(Instruction(ISA::eq,
+                                      shift_width,
+                                      shift_width,
+                                      shift_width + 1));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::quote) ||
+                 op == static_cast<TokenID>(SpecialTokenID::quote2)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        if (dx_->cdr() != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        snippet.push_back(Instruction(ISA::load_const,
+                                      shift_width,
+                                      constants().add(dx_->car(), file)));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::define)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        auto adx = dx_->car();
+        auto ddx = dx_->cdr();
+        if (adx != nullptr && adx->type() == Type::cell) {
+          // (define (f x ...) body ...) -> (define f (lambda (x ...) body ...))
+          auto adx_ = std::dynamic_pointer_cast<Cell>(adx);
+          auto lambda = std::make_shared<Cell>(
+              Token::make(static_cast<TokenID>(SpecialTokenID::lambda)),
+              std::make_shared<Cell>(adx_->cdr(), ddx));
+          adx = adx_->car();
+          ddx = std::make_shared<Cell>(std::move(lambda), nullptr);
+        }
+        if (adx == nullptr || adx->type() != Type::token) {
+          report("error.\n");
+          return {};
+        }
+        if (ddx == nullptr || ddx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto adx_ = std::dynamic_pointer_cast<Token>(adx);
+        if (scope->define(adx_->get_id()) == false) {
+          // the code compiled so far may have inlined the lambda of a
+          // global, so it stays as it is.
+          std::vector<uint8_t> name{};
+          for (auto&& ch : file.token_from_id(adx_->get_id())) {
+            String::encode(ch, &name);
+          }
+          name.push_back(0);
+          report("error: '%s' is defined already; it can't be redefined.\n",
+                 reinterpret_cast<const char*>(name.data()));
+          return {};
+        }
+        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
+        auto addx = ddx_->car();
+        auto dddx = ddx_->car();
+        snippet = compile(addx,
+                          file,
+                          shift_width,
+                          std::move(snippet),
+                          scope,
+                          max_label_id);
+        auto reg_num = scope->find(adx_->get_id());
+        if (reg_num != shift_width) {
+          snippet.push_back(Instruction(ISA::mov, reg_num, shift_width));
+        }
+        if (scope->is_global()) {
+          auto& code = *snippet.instructions;
+          if (!code.empty() &&
+              code.back().instruction == ISA::closure &&
+              code.back().operand[0] == shift_width) {
+            scope->know(reg_num, lambdas().get(code.back().operand[1]));
+          }
+          // the bodies of the lambdas read it from there.
+          snippet.push_back(Instruction(ISA::store_global,
+                                        reg_num,
+                                        reg_num,
+                                        adx_->get_id()));
+        }
+      } else if (op == static_cast<TokenID>(SpecialTokenID::cond)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        uint64_t endif_label_id = *max_label_id + 1;
+        *max_label_id += 2;
+        uint64_t clause_label_id = *max_label_id;
+        while (dx != nullptr) {
+          if (dx->type() != Type::cell) {
+            report("error.\n");
+            return {};
+          }
+          auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+          auto adx = dx_->car();
+          dx = dx_->cdr();
+          if (adx == nullptr || adx->type() != Type::cell) {
+            report("error.\n");
+            return {};
+          }
+          auto adx_ = std::dynamic_pointer_cast<Cell>(adx);
+          auto aadx = adx_->car();
+          auto dadx = adx_->cdr();
+          if (dadx == nullptr || dadx->type() != Type::cell) {
+            report("error.\n");
+            return {};
+          }
+          auto dadx_ = std::dynamic_pointer_cast<Cell>(dadx);
+          auto adadx = dadx_->car();
+          auto ddadx = dadx_->cdr();
+          if (ddadx != nullptr) {
+            report("error.\n");
+            return {};
+          }
+          // (cond (...) (aadx adadx) ...)
+          snippet.push_back(Instruction(ISA::label, clause_label_id));
+          auto false_label_id = *max_label_id + 1;
+          *max_label_id += 1;
+          snippet = compile(aadx,
+                            file,
+                            shift_width,
+                            std::move(snippet),
+                            scope,
+                            max_label_id);
+          snippet.push_back(Instruction(ISA::bfalse,
+                                        shift_width,
+                                        false_label_id));
+          snippet = compile(adadx,
+                            file,
+                            shift_width,
+                            std::move(snippet),
+                            scope,
+                            max_label_id);
+          snippet.push_back(Instruction(ISA::br, endif_label_id));
+          // the clause may have used labels of its own.
+          clause_label_id = false_label_id;
+        }
+        snippet.push_back(Instruction(ISA::label, endif_label_id));
+        snippet.push_back(Instruction(ISA::label, clause_label_id));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::lambda)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
           return {};
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        snippet = compile(adx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (ddx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        std::vector<TokenID> params{};
+        for (auto rest = dx_->car(); rest != nullptr;) {
+          if (rest->type() != Type::cell) {
+            report("error.\n");
+            return {};
+          }
+          auto rest_ = std::dynamic_pointer_cast<Cell>(rest);
+          if (rest_->car() == nullptr ||
+              rest_->car()->type() != Type::token) {
+            report("error.\n");
+            return {};
+          }
+          params.push_back(
+              std::dynamic_pointer_cast<Token>(rest_->car())->get_id());
+          rest = rest_->cdr();
+        }
+        // the body is compiled on the first call; a lambda in a lambda
+        // captures the frame of the outer one.
+        auto lambda = lambdas().make(std::move(params),
+                                     dx_->cdr(),
+                                     Scope::enclosing(scope));
+        if (lambda == nullptr) {
+          return {};
+        }
+        snippet.push_back(Instruction(ISA::closure,
+                                      shift_width,
+                                      lambda->get_id(),
+                                      scope->is_global() ? 0 : 1));
+        snippet.closures->push_back(std::move(lambda));
+      } else if (op == static_cast<TokenID>(SpecialTokenID::future) ||
+                 op == static_cast<TokenID>(SpecialTokenID::spawn)) {
+        if (dx == nullptr || dx->type() != Type::cell) {
+          report("error.\n");
+          return {};
+        }
+        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
+        if (dx_->cdr() != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        // (future adx) runs adx as a task, the body of a lambda without
+        // parameters on a frame of its own, which reads the variables of
+        // the spawner as a closure does. (spawn adx) is the same, but runs
+        // adx as a coroutine.
+        auto lambda = lambdas().make({}, dx, Scope::enclosing(scope));
+        if (lambda == nullptr) {
+          return {};
+        }
+        auto inst = op == static_cast<TokenID>(SpecialTokenID::future)
+                        ? ISA::future
+                        : ISA::spawn;
+        snippet.push_back(Instruction(inst,
+                                      shift_width,
+                                      lambda->get_id(),
+                                      scope->is_global() ? 0 : 1));
+        snippet.closures->push_back(std::move(lambda));
+      } else if (op ==
+                     static_cast<TokenID>(SpecialTokenID::make_eq_hashtable) ||
+                 op ==
+                     static_cast<TokenID>(SpecialTokenID::make_eqv_hashtable) ||
+                 op ==
+                     static_cast<TokenID>(
+                         SpecialTokenID::make_equal_hashtable)) {
+        if (dx != nullptr) {
+          report("error.\n");
+          return {};
+        }
+        auto equivalence = Equivalence::equal;
+        if (op == static_cast<TokenID>(SpecialTokenID::make_eq_hashtable)) {
+          equivalence = Equivalence::eq;
+        } else if (op == static_cast<TokenID>(
+                             SpecialTokenID::make_eqv_hashtable)) {
+          equivalence = Equivalence::eqv;
+        }
+        snippet.push_back(Instruction(ISA::make_hashtable,
+                                      shift_width,
+                                      static_cast<uint64_t>(equivalence)));
+      } else if (primitives().find(op) != primitives().end()) {
+        auto& primitive = primitives().at(op);
+        switch (primitive.arity) {
+          case 0:
+            snippet = compile_nullary(primitive.instruction,
+                                      dx,
+                                      shift_width,
+                                      std::move(snippet));
+            break;
+          case 1:
+            snippet = compile_unary(primitive.instruction,
+                                    dx,
+                                    file,
+                                    shift_width,
+                                    std::move(snippet),
+                                    scope,
+                                    max_label_id);
+            break;
+          case 2:
+            snippet = compile_binary(primitive.instruction,
+                                     dx,
+                                     file,
+                                     shift_width,
+                                     std::move(snippet),
+                                     scope,
+                                     max_label_id);
+            break;
+          default:
+            snippet = compile_ternary(primitive.instruction,
+                                      dx,
+                                      file,
+                                      shift_width,
+                                      std::move(snippet),
+                                      scope,
+                                      max_label_id);
+            break;
+        }
+      } else {
+        snippet = compile_call(x,
+                               file,
+                               shift_width,
+                               std::move(snippet),
+                               scope,
+                               max_label_id);
+      }
+    } else {
+      snippet = compile_call(x,
+                             file,
+                             shift_width,
+                             std::move(snippet),
+                             scope,
+                             max_label_id);
+    }
+  }
+  return std::move(snippet);
+}
+
+// what an instruction does with its operands.
+struct Operands {
+  // operand[0] is a register which it writes.
+  bool writes;
+  // the bit k is set if operand[k] is a register which it reads. a call
+  // reads the registers after operand[0] too, as many as operand[1].
+  uint8_t reads;
+  // the bit k is set if operand[k] is a label.
+  uint8_t labels;
+};
+
+Operands operands_of(const Instruction& inst) {
+  switch (inst.instruction) {
+    case ISA::load_true:
+    case ISA::load_false:
+    case ISA::load_number:
+    case ISA::load_character:
+    case ISA::load_const:
+    case ISA::load_dynamic:
+    case ISA::load_up:
+    case ISA::load_global:
+    case ISA::yield:
+    case ISA::socketpair:
+    case ISA::make_hashtable:
+    case ISA::closure:
+    case ISA::future:
+    case ISA::spawn:
+      return {true, 0, 0};
+    case ISA::store_global:
+    case ISA::done:
+      return {false, 1, 0};
+    case ISA::mov:
+    case ISA::car:
+    case ISA::cdr:
+    case ISA::atom:
+    case ISA::touch:
+    case ISA::read_byte:
+    case ISA::close:
+    case ISA::string_length:
+    case ISA::string_hash:
+    case ISA::vector_length:
+    case ISA::hashtable_size:
+    case ISA::f64vector_length:
+    case ISA::list_to_f64vector:
+    case ISA::f64vector_sum:
+    case ISA::f64vector_min:
+    case ISA::f64vector_max:
+      return {true, 2, 0};
+    case ISA::cons:
+    case ISA::eq:
+    case ISA::eq_token:
+    case ISA::eq_number:
+    case ISA::write_byte:
+    case ISA::string_ref:
+    case ISA::string_ref_number:
+    case ISA::string_append:
+    case ISA::string_eq:
+    case ISA::string_contains:
+    case ISA::string_split:
+    case ISA::make_vector:
+    case ISA::vector_ref:
+    case ISA::vector_ref_number:
+    case ISA::hashtable_contains:
+    case ISA::hashtable_delete:
+    case ISA::append:
+    case ISA::pmap:
+    case ISA::add:
+    case ISA::sub:
+    case ISA::mul:
+    case ISA::div:
+    case ISA::mod:
+    case ISA::num_eq:
+    case ISA::lt:
+    case ISA::le:
+    case ISA::gt:
+    case ISA::ge:
+    case ISA::add_fixnum:
+    case ISA::sub_fixnum:
+    case ISA::mul_fixnum:
+    case ISA::num_eq_fixnum:
+    case ISA::lt_fixnum:
+    case ISA::add_flonum:
+    case ISA::sub_flonum:
+    case ISA::mul_flonum:
+    case ISA::num_eq_flonum:
+    case ISA::lt_flonum:
+    case ISA::make_f64vector:
+    case ISA::f64vector_ref:
+    case ISA::f64vector_add:
+    case ISA::f64vector_sub:
+    case ISA::f64vector_mul:
+    case ISA::f64vector_div:
+    case ISA::f64vector_dot:
+      return {true, 6, 0};
+    case ISA::substring:
+    case ISA::hashtable_ref:
+      return {true, 7, 0};
+    case ISA::vector_set:
+    case ISA::hashtable_set:
+    case ISA::f64vector_set:
+      return {false, 7, 0};
+    case ISA::br:
+    case ISA::label:
+      return {false, 0, 1};
+    case ISA::bfalse:
+      return {false, 1, 2};
+    case ISA::call:
+      return {true, 1, 0};
+  }
+  return {false, 0, 0};
+}
+
+// the instructions which give equal values for equal operands, and do
+// nothing else; cse merges them.
+bool is_pure(ISA inst) {
+  switch (inst) {
+    case ISA::load_true:
+    case ISA::load_false:
+    case ISA::load_number:
+    case ISA::load_character:
+    case ISA::load_const:
+    case ISA::car:
+    case ISA::cdr:
+    case ISA::atom:
+    case ISA::eq:
+    case ISA::eq_token:
+    case ISA::eq_number:
+    case ISA::add:
+    case ISA::sub:
+    case ISA::mul:
+    case ISA::div:
+    case ISA::mod:
+    case ISA::num_eq:
+    case ISA::lt:
+    case ISA::le:
+    case ISA::gt:
+    case ISA::ge:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// the instructions which may be dropped when nobody reads their values:
+// those which cannot fail, so that the optimized code reports the same
+// errors as the code without the passes.
+bool is_removable(ISA inst) {
+  switch (inst) {
+    case ISA::load_true:
+    case ISA::load_false:
+    case ISA::load_number:
+    case ISA::load_character:
+    case ISA::load_const:
+    case ISA::mov:
+    case ISA::cons:
+    case ISA::atom:
+    case ISA::eq:
+    case ISA::eq_token:
+    case ISA::eq_number:
+    case ISA::closure:
+      return true;
+    default:
+      return false;
+  }
+}
+
+const char* name_of(ISA inst) {
+  switch (inst) {
+    case ISA::load_true: return "true";
+    case ISA::load_false: return "false";
+    case ISA::load_number: return "number";
+    case ISA::load_character: return "character";
+    case ISA::load_const: return "const";
+    case ISA::load_dynamic: return "dynamic";
+    case ISA::load_up: return "up";
+    case ISA::load_global: return "global";
+    case ISA::store_global: return "store-global";
+    case ISA::mov: return "mov";
+    case ISA::cons: return "cons";
+    case ISA::car: return "car";
+    case ISA::cdr: return "cdr";
+    case ISA::atom: return "atom";
+    case ISA::eq: return "eq";
+    case ISA::br: return "br";
+    case ISA::bfalse: return "bfalse";
+    case ISA::label: return "label";
+    case ISA::future: return "future";
+    case ISA::touch: return "touch";
+    case ISA::pmap: return "pmap";
+    case ISA::done: return "done";
+    case ISA::spawn: return "spawn";
+    case ISA::yield: return "yield";
+    case ISA::socketpair: return "socketpair";
+    case ISA::read_byte: return "read-byte";
+    case ISA::write_byte: return "write-byte";
+    case ISA::close: return "close";
+    case ISA::string_length: return "string-length";
+    case ISA::string_ref: return "string-ref";
+    case ISA::substring: return "substring";
+    case ISA::string_append: return "string-append";
+    case ISA::string_eq: return "string=?";
+    case ISA::string_contains: return "string-contains";
+    case ISA::string_split: return "string-split";
+    case ISA::string_hash: return "string-hash";
+    case ISA::make_vector: return "make-vector";
+    case ISA::vector_ref: return "vector-ref";
+    case ISA::vector_set: return "vector-set!";
+    case ISA::vector_length: return "vector-length";
+    case ISA::make_hashtable: return "make-hashtable";
+    case ISA::hashtable_ref: return "hashtable-ref";
+    case ISA::hashtable_set: return "hashtable-set!";
+    case ISA::hashtable_contains: return "hashtable-contains?";
+    case ISA::hashtable_delete: return "hashtable-delete!";
+    case ISA::hashtable_size: return "hashtable-size";
+    case ISA::append: return "append";
+    case ISA::closure: return "closure";
+    case ISA::call: return "call";
+    case ISA::eq_token: return "eq/token";
+    case ISA::eq_number: return "eq/number";
+    case ISA::string_ref_number: return "string-ref/number";
+    case ISA::add: return "+";
+    case ISA::sub: return "-";
+    case ISA::mul: return "*";
+    case ISA::div: return "/";
+    case ISA::mod: return "%";
+    case ISA::num_eq: return "=";
+    case ISA::lt: return "<";
+    case ISA::le: return "<=";
+    case ISA::gt: return ">";
+    case ISA::ge: return ">=";
+    case ISA::make_f64vector: return "make-f64vector";
+    case ISA::f64vector_ref: return "f64vector-ref";
+    case ISA::f64vector_set: return "f64vector-set!";
+    case ISA::f64vector_length: return "f64vector-length";
+    case ISA::list_to_f64vector: return "list->f64vector";
+    case ISA::f64vector_add: return "f64vector-add";
+    case ISA::f64vector_sub: return "f64vector-sub";
+    case ISA::f64vector_mul: return "f64vector-mul";
+    case ISA::f64vector_div: return "f64vector-div";
+    case ISA::f64vector_dot: return "f64vector-dot";
+    case ISA::f64vector_sum: return "f64vector-sum";
+    case ISA::f64vector_min: return "f64vector-min";
+    case ISA::f64vector_max: return "f64vector-max";
+    case ISA::vector_ref_number: return "vector-ref/number";
+    case ISA::add_fixnum: return "+/fixnum";
+    case ISA::sub_fixnum: return "-/fixnum";
+    case ISA::mul_fixnum: return "*/fixnum";
+    case ISA::num_eq_fixnum: return "=/fixnum";
+    case ISA::lt_fixnum: return "</fixnum";
+    case ISA::add_flonum: return "+/flonum";
+    case ISA::sub_flonum: return "-/flonum";
+    case ISA::mul_flonum: return "*/flonum";
+    case ISA::num_eq_flonum: return "=/flonum";
+    case ISA::lt_flonum: return "</flonum";
+  }
+  return "?";
+}
+
+// the passes of the optimizer, which the command line may pick; all are on
+// by default. any pass but inline puts the code through the IR, which leaves
+// the moves of its phis in unless regalloc runs too; so cse pays off with
+// regalloc only. escape drops the conses it replaces with or without dce.
+struct Passes {
+  bool inlining;
+  bool cse;
+  // scalar replacement of the conses which do not escape.
+  bool escape;
+  bool dce;
+  bool allocation;
+  // without it, the snippets are left as compile() makes them.
+  bool ir;
+  bool dump;
+  // the machine rewrites the generic instructions by their type feedback.
+  bool quickening;
+  // prints the type feedback of the lambdas at the end.
+  bool feedback;
+};
+
+Passes& passes() {
+  static auto p =
+      new Passes{true, true, true, true, true, true, false, true, false};
+  return *p;
+}
+
+// one more than the highest register or label which the code uses.
+uint64_t register_limit(const std::vector<Instruction>& code) {
+  uint64_t limit = 0;
+  for (auto&& inst : code) {
+    auto ops = operands_of(inst);
+    for (int k = 0; k < 3; ++k) {
+      if ((ops.reads & (1 << k)) != 0 || (k == 0 && ops.writes)) {
+        limit = std::max(limit, inst.operand[k] + 1);
+      }
+    }
+    if (inst.instruction == ISA::call) {
+      limit = std::max(limit, inst.operand[0] + inst.operand[1] + 1);
+    }
+  }
+  return limit;
+}
+
+uint64_t label_limit(const std::vector<Instruction>& code) {
+  uint64_t limit = 0;
+  for (auto&& inst : code) {
+    auto ops = operands_of(inst);
+    for (int k = 0; k < 3; ++k) {
+      if ((ops.labels & (1 << k)) != 0) {
+        limit = std::max(limit, inst.operand[k] + 1);
+      }
+    }
+  }
+  return limit;
+}
+
+// a callee is inlined if it is small, and if it has nothing which depends
+// on its own frame or on the positions of its instructions.
+bool is_inlinable(const Snippet& body) {
+  static constexpr std::size_t inline_limit = 32;
+  auto& code = *body.instructions;
+  if (code.empty() ||
+      code.size() > inline_limit ||
+      code.back().instruction != ISA::done) {
+    return false;
+  }
+  for (std::size_t i = 0; i + 1 < code.size(); ++i) {
+    switch (code[i].instruction) {
+      case ISA::done:
+      case ISA::load_up:
+        return false;
+      case ISA::closure:
+      case ISA::future:
+      case ISA::spawn:
+        if (code[i].operand[2] != 0) {
+          return false;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+// replaces the calls of the small known lambdas by their bodies, on fresh
+// registers and labels: the arguments are moved to where the body reads its
+// parameters, and the value of its done is moved to where the call put it.
+std::vector<Instruction> inline_calls(const std::vector<Instruction>& code,
+                                      const Scope& scope,
+                                      bool top_level,
+                                      uint64_t pinned,
+                                      const Lambda* self,
+                                      const File& file) {
+  std::vector<Instruction> out{};
+  auto next_register = std::max(register_limit(code), pinned);
+  auto next_label = label_limit(code);
+  // the last instruction which wrote each register in this block.
+  std::map<uint64_t, Instruction> defs{};
+  for (auto&& inst : code) {
+    auto ops = operands_of(inst);
+    if (ops.labels != 0) {
+      defs.clear();
+    }
+    if (inst.instruction == ISA::call) {
+      Lambda* lambda = nullptr;
+      auto it = defs.find(inst.operand[0]);
+      if (it != defs.end() && it->second.instruction == ISA::load_global) {
+        lambda = scope.known(it->second.operand[1]);
+      } else if (it != defs.end() &&
+                 it->second.instruction == ISA::mov &&
+                 top_level &&
+                 it->second.operand[1] < pinned) {
+        lambda = scope.known(it->second.operand[1]);
+      }
+      if (lambda != nullptr &&
+          lambda != self &&
+          !lambda->is_compiling() &&
+          lambda->arity() == inst.operand[1]) {
+        auto& body = lambda->compiled(file);
+        if (!lambda->is_broken() && is_inlinable(body)) {
+          auto& callee = *body.instructions;
+          auto n = inst.operand[1];
+          auto base = next_register;
+          for (uint64_t i = 0; i < n; ++i) {
+            out.push_back(Instruction(ISA::mov,
+                                      base + i,
+                                      inst.operand[0] + 1 + i));
+          }
+          for (std::size_t i = 0; i + 1 < callee.size(); ++i) {
+            auto copy = callee[i];
+            // the callee may have run, and quickened its instructions.
+            copy.instruction = generic_of(copy.instruction);
+            auto copy_ops = operands_of(copy);
+            for (int k = 0; k < 3; ++k) {
+              if ((copy_ops.reads & (1 << k)) != 0 ||
+                  (k == 0 && copy_ops.writes)) {
+                copy.operand[k] += base;
+              } else if ((copy_ops.labels & (1 << k)) != 0) {
+                copy.operand[k] += next_label;
+              }
+            }
+            out.push_back(copy);
+          }
+          out.push_back(Instruction(ISA::mov,
+                                    inst.operand[0],
+                                    base + callee.back().operand[0]));
+          next_register = base + std::max(register_limit(callee), n);
+          next_label += label_limit(callee);
+          // the body writes its fresh registers and the result only, so
+          // a call around this one may still be inlined.
+          defs.erase(defs.lower_bound(base), defs.end());
+          defs.erase(inst.operand[0]);
+          continue;
+        }
+      }
+      for (uint64_t i = 1; i <= inst.operand[1]; ++i) {
+        defs.erase(inst.operand[0] + i);
+      }
+    }
+    out.push_back(inst);
+    if (ops.writes) {
+      defs.erase(inst.operand[0]);
+      defs.emplace(inst.operand[0], inst);
+    }
+  }
+  return out;
+}
+
+// the mid-level form of a snippet: its values in SSA form, in the basic
+// blocks which compile() makes, which only branch forward. it is built from
+// the instructions, optimized, and lowered back to them with the registers
+// allocated by a linear scan.
+class IR {
+ private:
+  static constexpr uint32_t none = 0xffffffff;
+
+  enum class Kind { instruction, entry, phi };
+
+  struct Value {
+    Kind kind;
+    Instruction inst;
+    // the values which it reads, in the order of the operands; a phi reads
+    // one for each predecessor of its block.
+    std::vector<uint32_t> args;
+    uint32_t block;
+    // set by cse, when it is the same as an earlier value.
+    uint32_t same;
+    bool live;
+    uint64_t reg;
+    uint64_t start;
+    uint64_t end;
+  };
+
+  enum class Exit { fall, br, bfalse, done };
+
+  struct Block {
+    std::size_t first;
+    std::size_t last;
+    std::vector<uint32_t> preds;
+    std::vector<uint32_t> phis;
+    std::vector<uint32_t> values;
+    // the values of the registers at its end and at its beginning.
+    std::map<uint64_t, uint32_t> defs;
+    std::map<uint64_t, uint32_t> ins;
+    Exit exit;
+    uint32_t target;
+    uint32_t cond;
+    uint32_t idom;
+    bool reachable;
+    uint64_t position;
+    uint64_t exit_position;
+  };
+
+  std::vector<Value> values;
+  std::vector<Block> blocks;
+  std::map<uint64_t, uint32_t> entries;
+  // the registers below pinned hold their values at the end of a top-level
+  // snippet, for the forms after it.
+  uint64_t pinned;
+  std::map<uint64_t, uint32_t> exits;
+  // the pinned registers and those of the entries; without linear scan, the
+  // values get the registers above them.
+  uint64_t reserved;
+  // the first register above all the values: the window of the calls.
+  uint64_t top;
+
+ public:
+  IR()
+      : values{},
+        blocks{},
+        entries{},
+        pinned(0),
+        exits{},
+        reserved(0),
+        top(0) {
+    return;
+  }
+
+  // returns false if the code has what the IR doesn't model; the code is
+  // left as it is then.
+  bool build(const std::vector<Instruction>& code, uint64_t pinned_) {
+    pinned = pinned_;
+    std::map<uint64_t, std::size_t> labels{};
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      if (code[i].instruction == ISA::label) {
+        labels[code[i].operand[0]] = i;
+      }
+    }
+    std::set<std::size_t> leaders{0};
+    for (std::size_t i = 0; i < code.size(); ++i) {
+      auto& inst = code[i];
+      switch (inst.instruction) {
+        case ISA::closure:
+        case ISA::future:
+        case ISA::spawn:
+          // the closures of the inner lambdas read this frame by registers.
+          if (inst.operand[2] != 0) {
+            return false;
+          }
+          break;
+        case ISA::label:
+          leaders.insert(i);
+          break;
+        case ISA::br:
+        case ISA::bfalse: {
+          auto it = labels.find(
+              inst.operand[inst.instruction == ISA::br ? 0 : 1]);
+          if (it == labels.end() || it->second <= i) {
+            return false;
+          }
+          leaders.insert(i + 1);
+          break;
+        }
+        case ISA::done:
+          if (i + 1 != code.size()) {
+            return false;
+          }
+          break;
+        default:
+          break;
+      }
+    }
+    std::map<std::size_t, uint32_t> block_at{};
+    for (auto it = leaders.begin(); it != leaders.end(); ++it) {
+      auto next = std::next(it);
+      Block block{};
+      block.first = *it;
+      block.last = next == leaders.end() ? code.size() : *next;
+      block.exit = Exit::fall;
+      block.target = none;
+      block.cond = none;
+      block.idom = 0;
+      block.reachable = false;
+      block_at[*it] = static_cast<uint32_t>(blocks.size());
+      blocks.push_back(std::move(block));
+    }
+    for (auto&& block : blocks) {
+      if (block.first == block.last) {
+        continue;
+      }
+      auto& inst = code[block.last - 1];
+      if (inst.instruction == ISA::br) {
+        block.exit = Exit::br;
+        block.target = block_at.at(labels.at(inst.operand[0]));
+      } else if (inst.instruction == ISA::bfalse) {
+        block.exit = Exit::bfalse;
+        block.target = block_at.at(labels.at(inst.operand[1]));
+      } else if (inst.instruction == ISA::done) {
+        block.exit = Exit::done;
+      }
+    }
+    blocks[0].reachable = true;
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      if (!blocks[b].reachable) {
+        continue;
+      }
+      for (auto&& succ : successors(b)) {
+        blocks[succ].reachable = true;
+        blocks[succ].preds.push_back(b);
+      }
+    }
+    for (uint32_t b = 1; b < blocks.size(); ++b) {
+      auto& block = blocks[b];
+      if (!block.reachable) {
+        continue;
+      }
+      block.idom = block.preds[0];
+      for (auto&& pred : block.preds) {
+        block.idom = intersect(block.idom, pred);
+      }
+    }
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      if (blocks[b].reachable) {
+        build_block(code, b);
+      }
+    }
+    // the pinned registers which the code doesn't write keep their values
+    // as they are, so only the written ones need exits.
+    auto& last = blocks.back();
+    if (last.reachable && last.exit == Exit::fall) {
+      std::set<uint64_t> written{};
+      for (auto&& block : blocks) {
+        for (auto it = block.defs.begin();
+             it != block.defs.end() && it->first < pinned;
+             ++it) {
+          written.insert(it->first);
+        }
+      }
+      for (auto&& reg : written) {
+        exits[reg] = read_out(static_cast<uint32_t>(blocks.size() - 1), reg);
+      }
+    }
+    return true;
+  }
+
+  // merges the pure values with the same operands, when the first one
+  // dominates the others, and the phis which merge one value only.
+  void cse() {
+    std::map<std::vector<uint64_t>, std::vector<uint32_t>> table{};
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      if (!blocks[b].reachable) {
+        continue;
+      }
+      for (auto&& v : blocks[b].values) {
+        auto& value = values[v];
+        for (auto&& arg : value.args) {
+          arg = find(arg);
+        }
+        if (!is_pure(value.inst.instruction)) {
+          continue;
+        }
+        std::vector<uint64_t> key{
+            static_cast<uint64_t>(value.inst.instruction.load())};
+        if (value.args.empty()) {
+          key.push_back(value.inst.operand[1]);
+        }
+        key.insert(key.end(), value.args.begin(), value.args.end());
+        auto& candidates = table[key];
+        for (auto&& c : candidates) {
+          if (dominates(values[c].block, b)) {
+            value.same = c;
+            break;
+          }
+        }
+        if (value.same == none) {
+          candidates.push_back(v);
+        }
+      }
+    }
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (auto&& block : blocks) {
+        for (auto&& phi : block.phis) {
+          if (values[phi].same != none) {
+            continue;
+          }
+          uint32_t unique = none;
+          bool merges = false;
+          for (auto&& arg : values[phi].args) {
+            arg = find(arg);
+            if (arg == phi || arg == unique) {
+              continue;
+            } else if (unique == none) {
+              unique = arg;
+            } else {
+              merges = true;
+            }
+          }
+          if (!merges && unique != none) {
+            values[phi].same = unique;
+            changed = true;
+          }
+        }
+      }
+    }
+    return;
+  }
+
+  // the scalar replacement of the conses which do not escape: when car,
+  // cdr, atom and eq are all that read a cons, car and cdr become the
+  // operands of the cons, atom and eq become constants, and dce drops the
+  // cons, even when it is off. a cons read by another cons which goes away
+  // is looked at again. returns the conses which were replaced.
+  std::set<uint32_t> replace_conses() {
+    std::set<uint32_t> replaced{};
+    for (bool changed = true; changed;) {
+      changed = false;
+      // the values which read each cons; none if it escapes.
+      std::map<uint32_t, std::vector<uint32_t>> readers{};
+      for (auto&& block : blocks) {
+        if (!block.reachable) {
+          continue;
+        }
+        for (auto&& v : block.values) {
+          if (values[v].same == none &&
+              values[v].inst.instruction == ISA::cons &&
+              replaced.count(v) == 0) {
+            readers[v];
+          }
+        }
+      }
+      auto read = [this, &readers](uint32_t arg, uint32_t reader) {
+        auto it = readers.find(find(arg));
+        if (it != readers.end()) {
+          it->second.push_back(reader);
+        }
+        return;
+      };
+      for (auto&& block : blocks) {
+        if (!block.reachable) {
+          continue;
+        }
+        for (auto&& phi : block.phis) {
+          for (auto&& arg : values[phi].args) {
+            if (values[phi].same == none) {
+              read(arg, none);
+            }
+          }
+        }
+        for (auto&& v : block.values) {
+          auto& value = values[v];
+          if (value.same != none || replaced.count(v) != 0) {
+            continue;
+          }
+          auto inst = value.inst.instruction.load();
+          auto local = inst == ISA::car || inst == ISA::cdr ||
+                       inst == ISA::atom || inst == ISA::eq;
+          for (auto&& arg : value.args) {
+            read(arg, local ? v : uint32_t{none});
+          }
+        }
+        if (block.cond != none) {
+          read(block.cond, none);
+        }
+      }
+      for (auto&& exit : exits) {
+        read(exit.second, none);
+      }
+      for (auto&& entry : readers) {
+        auto escapes = false;
+        for (auto&& v : entry.second) {
+          escapes = escapes || v == none;
+        }
+        if (escapes) {
+          continue;
+        }
+        for (auto&& v : entry.second) {
+          auto& value = values[v];
+          auto reg_num = value.inst.operand[0];
+          switch (value.inst.instruction.load()) {
+            case ISA::car:
+              value.same = values[entry.first].args[0];
+              break;
+            case ISA::cdr:
+              value.same = values[entry.first].args[1];
+              break;
+            case ISA::atom:
+              value.inst = Instruction(ISA::load_false, reg_num);
+              value.args.clear();
+              break;
+            case ISA::eq:
+              // a fresh cons is eq to itself only.
+              value.inst = Instruction(
+                  find(value.args[0]) == find(value.args[1])
+                      ? ISA::load_true
+                      : ISA::load_false,
+                  reg_num);
+              value.args.clear();
+              break;
+            default:
+              break;
+          }
+        }
+        replaced.insert(entry.first);
+        changed = true;
+      }
+    }
+    return replaced;
+  }
+
+  // marks the values which something needs; with dce off, all of them but
+  // the dropped ones, which nothing reads.
+  void dce(bool enabled, const std::set<uint32_t>& dropped) {
+    std::vector<uint32_t> work{};
+    for (uint32_t v = 0; v < values.size(); ++v) {
+      auto& value = values[v];
+      if (value.same != none || value.kind == Kind::entry ||
+          dropped.count(v) != 0) {
+        continue;
+      }
+      if (!enabled ||
+          (value.kind == Kind::instruction &&
+           !is_removable(value.inst.instruction))) {
+        work.push_back(v);
+      }
+    }
+    for (auto&& block : blocks) {
+      if (block.reachable && block.cond != none) {
+        work.push_back(find(block.cond));
+      }
+    }
+    for (auto&& exit : exits) {
+      work.push_back(find(exit.second));
+    }
+    while (!work.empty()) {
+      auto v = work.back();
+      work.pop_back();
+      if (values[v].live) {
+        continue;
+      }
+      values[v].live = true;
+      for (auto&& arg : values[v].args) {
+        work.push_back(find(arg));
+      }
+    }
+    return;
+  }
+
+  // gives the live values registers by a linear scan over their intervals,
+  // or one register each if linear_scan is off. a value takes the register
+  // which compile() gave it if it is free and below hinted, so that the code
+  // keeps its shape where there is nothing to gain.
+  void allocate(bool linear_scan, uint64_t hinted) {
+    reserved = pinned;
+    for (auto&& entry : entries) {
+      values[entry.second].reg = entry.first;
+      reserved = std::max(reserved, entry.first + 1);
+    }
+    uint64_t position = 1;
+    std::vector<uint32_t> order{};
+    for (auto&& block : blocks) {
+      if (!block.reachable) {
+        continue;
+      }
+      block.position = position++;
+      for (auto&& phi : block.phis) {
+        if (values[phi].live) {
+          values[phi].start = values[phi].end = block.position;
+          order.push_back(phi);
+        }
+      }
+      for (auto&& v : block.values) {
+        if (values[v].live) {
+          values[v].start = values[v].end = position++;
+          if (operands_of(values[v].inst).writes) {
+            order.push_back(v);
+          }
+        }
+      }
+      block.exit_position = position++;
+    }
+    auto use = [this](uint32_t v, uint64_t at) {
+      auto& value = values[find(v)];
+      value.end = std::max(value.end, at);
+    };
+    for (auto&& block : blocks) {
+      if (!block.reachable) {
+        continue;
+      }
+      for (auto&& v : block.values) {
+        if (values[v].live) {
+          for (auto&& arg : values[v].args) {
+            use(arg, values[v].start);
+          }
+        }
+      }
+      for (auto&& phi : block.phis) {
+        if (values[phi].live) {
+          for (auto&& arg : values[phi].args) {
+            use(arg, block.position);
+          }
+        }
+      }
+      if (block.cond != none) {
+        use(block.cond, block.exit_position);
+      }
+    }
+    for (auto&& exit : exits) {
+      use(exit.second, position);
+    }
+    top = reserved;
+    if (!linear_scan) {
+      for (auto&& v : order) {
+        values[v].reg = top;
+        top += values[v].inst.instruction == ISA::call
+                   ? values[v].inst.operand[1] + 1
+                   : 1;
+      }
+      return;
+    }
+    // the values come in the order of their starts. a register is free
+    // again after the last use of its value; at that very position too for
+    // the instructions which read their operands before they write. the
+    // entries hold theirs from the beginning, and the other registers below
+    // reserved are free; the pinned ones without exits keep theirs to the
+    // end. a value which ends up in a pinned register takes that one if it
+    // can, to save the move at the exit.
+    std::map<uint32_t, uint64_t> hints{};
+    for (auto&& v : order) {
+      auto original = values[v].inst.operand[0];
+      if (original < hinted) {
+        hints[v] = original;
+      }
+    }
+    for (auto&& exit : exits) {
+      hints[find(exit.second)] = exit.first;
+    }
+    std::set<uint64_t> free{};
+    std::multimap<uint64_t, uint64_t> active{};
+    for (auto&& exit : exits) {
+      free.insert(exit.first);
+    }
+    for (auto reg_num = pinned; reg_num < reserved; ++reg_num) {
+      free.insert(reg_num);
+    }
+    for (auto&& entry : entries) {
+      free.erase(entry.first);
+      if (entry.first >= pinned || exits.count(entry.first) != 0) {
+        active.emplace(values[entry.second].end, entry.first);
+      }
+    }
+    top = reserved;
+    auto is_free = [this, &free](uint64_t reg_num) {
+      return reg_num >= top || free.count(reg_num) != 0;
+    };
+    for (auto&& v : order) {
+      auto& value = values[v];
+      auto reuses = reuses_operands(value);
+      while (!active.empty() &&
+             (active.begin()->first < value.start ||
+              (reuses && active.begin()->first == value.start))) {
+        free.insert(active.begin()->second);
+        active.erase(active.begin());
+      }
+      // a call needs a window for the procedure and the arguments, and
+      // leaves its value in the first register of it.
+      uint64_t width = value.inst.instruction == ISA::call
+                           ? value.inst.operand[1] + 1
+                           : 1;
+      auto fits = [&is_free, width](uint64_t base) {
+        for (uint64_t k = 0; k < width; ++k) {
+          if (!is_free(base + k)) {
+            return false;
+          }
+        }
+        return true;
+      };
+      auto hint = hints.find(v);
+      // an arithmetic takes the register of an operand which ends there,
+      // so that the machine may put a flonum in the box of the operand.
+      auto dying = top;
+      if (reuses && value.inst.instruction != ISA::call) {
+        for (auto&& arg : value.args) {
+          auto& operand = values[find(arg)];
+          if (operand.end == value.start && is_free(operand.reg) &&
+              !is_constant(operand)) {
+            dying = operand.reg;
+            break;
+          }
+        }
+      }
+      if (dying != top) {
+        value.reg = dying;
+      } else if (hint != hints.end() && fits(hint->second)) {
+        value.reg = hint->second;
+      } else {
+        value.reg = top;
+        for (auto&& reg_num : free) {
+          if (fits(reg_num)) {
+            value.reg = reg_num;
+            break;
+          }
+        }
+      }
+      for (uint64_t k = 0; k < width; ++k) {
+        free.erase(value.reg + k);
+      }
+      for (auto reg_num = top; reg_num < value.reg; ++reg_num) {
+        free.insert(reg_num);
+      }
+      top = std::max(top, value.reg + width);
+      // the registers of the arguments are empty after the call.
+      for (uint64_t k = 1; k < width; ++k) {
+        free.insert(value.reg + k);
+      }
+      active.emplace(value.end, value.reg);
+    }
+    return;
+  }
+
+  std::vector<Instruction> emit() {
+    std::vector<Instruction> out{};
+    auto label_of = [](uint32_t b) { return static_cast<uint64_t>(b) + 1; };
+    auto edge_label_of = [this](uint32_t b) {
+      return static_cast<uint64_t>(blocks.size() + b) + 1;
+    };
+    // the taken edges of bfalse which need their own blocks for the moves.
+    std::vector<bool> edges(blocks.size(), false);
+    std::vector<bool> targeted(blocks.size(), false);
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      auto& block = blocks[b];
+      if (!block.reachable) {
+        continue;
+      }
+      if (block.exit == Exit::bfalse && !phi_moves(b, block.target).empty()) {
+        edges[b] = true;
+      } else if (block.exit == Exit::br || block.exit == Exit::bfalse) {
+        targeted[block.target] = true;
+      }
+    }
+    uint32_t previous = none;
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      auto& block = blocks[b];
+      if (!block.reachable) {
+        continue;
+      }
+      bool entered = false;
+      for (auto&& pred : block.preds) {
+        if (!edges[pred] || blocks[pred].target != b || pred == previous) {
+          continue;
+        }
+        if (!entered && previous != none && falls_into(previous, b)) {
+          out.push_back(Instruction(ISA::br, label_of(b)));
+        }
+        entered = true;
+        out.push_back(Instruction(ISA::label, edge_label_of(pred)));
+        move(phi_moves(pred, b), &out);
+        out.push_back(Instruction(ISA::br, label_of(b)));
+        targeted[b] = true;
+      }
+      if (targeted[b]) {
+        out.push_back(Instruction(ISA::label, label_of(b)));
+      }
+      for (auto&& v : block.values) {
+        if (values[v].live) {
+          emit_value(v, &out);
+        }
+      }
+      switch (block.exit) {
+        case Exit::fall:
+          if (b + 1 < blocks.size()) {
+            move(phi_moves(b, b + 1), &out);
+          } else {
+            std::vector<std::pair<uint64_t, uint64_t>> moves{};
+            for (auto&& exit : exits) {
+              moves.emplace_back(exit.first, reg(exit.second));
+            }
+            move(moves, &out);
+          }
+          break;
+        case Exit::br:
+          move(phi_moves(b, block.target), &out);
+          out.push_back(Instruction(ISA::br, label_of(block.target)));
+          break;
+        case Exit::bfalse:
+          out.push_back(Instruction(ISA::bfalse,
+                                    reg(block.cond),
+                                    edges[b] ? edge_label_of(b)
+                                             : label_of(block.target)));
+          move(phi_moves(b, b + 1), &out);
+          break;
+        case Exit::done:
+          out.push_back(Instruction(ISA::done, reg(block.cond)));
+          break;
+      }
+      previous = b;
+    }
+    return out;
+  }
+
+  void print(FILE* fp, const char* name) const {
+    fprintf(fp, "ir %s\n", name);
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+      auto& block = blocks[b];
+      if (!block.reachable) {
+        continue;
+      }
+      fprintf(fp, "b%u:", b);
+      for (auto&& pred : block.preds) {
+        fprintf(fp, " <- b%u", pred);
+      }
+      fprintf(fp, "\n");
+      if (b == 0) {
+        for (auto&& entry : entries) {
+          fprintf(fp, "  v%u = entry r%zu\n", entry.second, entry.first);
+        }
+      }
+      for (auto&& phi : block.phis) {
+        print_value(fp, phi);
+      }
+      for (auto&& v : block.values) {
+        print_value(fp, v);
+      }
+      switch (block.exit) {
+        case Exit::fall:
+          break;
+        case Exit::br:
+          fprintf(fp, "  br b%u\n", block.target);
+          break;
+        case Exit::bfalse:
+          fprintf(fp, "  bfalse v%u, b%u\n", find(block.cond), block.target);
+          break;
+        case Exit::done:
+          fprintf(fp, "  done v%u\n", find(block.cond));
+          break;
+      }
+    }
+    for (auto&& exit : exits) {
+      fprintf(fp, "  exit r%zu = v%u\n", exit.first, find(exit.second));
+    }
+    return;
+  }
+
+ private:
+  uint32_t find(uint32_t v) const {
+    while (values[v].same != none) {
+      v = values[v].same;
+    }
+    return v;
+  }
+
+  uint64_t reg(uint32_t v) const {
+    return values[find(v)].reg;
+  }
+
+  std::vector<uint32_t> successors(uint32_t b) const {
+    auto& block = blocks[b];
+    std::vector<uint32_t> succs{};
+    if (block.exit == Exit::br || block.exit == Exit::bfalse) {
+      succs.push_back(block.target);
+    }
+    if ((block.exit == Exit::fall || block.exit == Exit::bfalse) &&
+        b + 1 < blocks.size()) {
+      succs.push_back(b + 1);
+    }
+    return succs;
+  }
+
+  // whether the instruction reads all its operands before it writes, so
+  // that it may write over one of them.
+  static bool reuses_operands(const Value& value) {
+    if (value.kind != Kind::instruction) {
+      return false;
+    }
+    switch (value.inst.instruction) {
+      case ISA::car:
+      case ISA::cdr:
+      case ISA::cons:
+      case ISA::atom:
+      case ISA::eq:
+      case ISA::call:
+      case ISA::add:
+      case ISA::sub:
+      case ISA::mul:
+      case ISA::div:
+      case ISA::mod:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // a constant is in a box which the constant pool holds too.
+  static bool is_constant(const Value& value) {
+    if (value.kind != Kind::instruction) {
+      return false;
+    }
+    switch (value.inst.instruction) {
+      case ISA::load_const:
+      case ISA::load_global:
+      case ISA::load_up:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  bool falls_into(uint32_t from, uint32_t to) const {
+    auto exit = blocks[from].exit;
+    return from + 1 == to && (exit == Exit::fall || exit == Exit::bfalse);
+  }
+
+  // the blocks are in a topological order, as every branch goes forward.
+  uint32_t intersect(uint32_t a, uint32_t b) const {
+    while (a != b) {
+      while (a > b) {
+        a = blocks[a].idom;
+      }
+      while (b > a) {
+        b = blocks[b].idom;
+      }
+    }
+    return a;
+  }
+
+  bool dominates(uint32_t a, uint32_t b) const {
+    while (b > a) {
+      b = blocks[b].idom;
+    }
+    return a == b;
+  }
+
+  uint32_t add(Kind kind, const Instruction& inst, uint32_t block) {
+    Value value{kind, inst, {}, block, none, false, 0, 0, 0};
+    values.push_back(std::move(value));
+    return static_cast<uint32_t>(values.size() - 1);
+  }
+
+  uint32_t entry(uint64_t reg_num) {
+    auto it = entries.find(reg_num);
+    if (it != entries.end()) {
+      return it->second;
+    }
+    auto v = add(Kind::entry, Instruction(ISA::mov, reg_num, reg_num), 0);
+    values[v].live = true;
+    entries[reg_num] = v;
+    return v;
+  }
+
+  // the value of a register at the beginning of a block: the one from the
+  // predecessors, or a phi if they differ.
+  uint32_t read_in(uint32_t b, uint64_t reg_num) {
+    auto it = blocks[b].ins.find(reg_num);
+    if (it != blocks[b].ins.end()) {
+      return it->second;
+    }
+    uint32_t v;
+    if (blocks[b].preds.empty()) {
+      v = entry(reg_num);
+    } else {
+      std::vector<uint32_t> args{};
+      for (auto&& pred : blocks[b].preds) {
+        args.push_back(read_out(pred, reg_num));
+      }
+      if (std::all_of(args.begin(), args.end(),
+                      [&args](uint32_t a) { return a == args[0]; })) {
+        v = args[0];
+      } else {
+        v = add(Kind::phi, Instruction(ISA::mov, reg_num), b);
+        values[v].args = std::move(args);
+        blocks[b].phis.push_back(v);
+      }
+    }
+    blocks[b].ins[reg_num] = v;
+    return v;
+  }
+
+  uint32_t read_out(uint32_t b, uint64_t reg_num) {
+    auto it = blocks[b].defs.find(reg_num);
+    if (it != blocks[b].defs.end()) {
+      return it->second;
+    }
+    return read_in(b, reg_num);
+  }
+
+  void build_block(const std::vector<Instruction>& code, uint32_t b) {
+    auto read = [this, b](uint64_t reg_num) {
+      auto it = blocks[b].defs.find(reg_num);
+      if (it != blocks[b].defs.end()) {
+        return it->second;
+      }
+      return read_in(b, reg_num);
+    };
+    for (auto i = blocks[b].first; i < blocks[b].last; ++i) {
+      auto& inst = code[i];
+      switch (inst.instruction) {
+        case ISA::label:
+        case ISA::br:
+          continue;
+        case ISA::bfalse:
+        case ISA::done:
+          blocks[b].cond = read(inst.operand[0]);
+          continue;
+        case ISA::mov:
+          blocks[b].defs[inst.operand[0]] = read(inst.operand[1]);
+          continue;
+        default:
+          break;
+      }
+      auto ops = operands_of(inst);
+      std::vector<uint32_t> args{};
+      for (int k = 0; k < 3; ++k) {
+        if ((ops.reads & (1 << k)) != 0) {
+          args.push_back(read(inst.operand[k]));
+        }
+      }
+      if (inst.instruction == ISA::call) {
+        for (uint64_t k = 1; k <= inst.operand[1]; ++k) {
+          args.push_back(read(inst.operand[0] + k));
+        }
+      }
+      auto v = add(Kind::instruction, inst, b);
+      values[v].args = std::move(args);
+      blocks[b].values.push_back(v);
+      if (ops.writes) {
+        blocks[b].defs[inst.operand[0]] = v;
+      }
+    }
+    return;
+  }
+
+  // the moves into the phis of to, on the edge from the block from.
+  std::vector<std::pair<uint64_t, uint64_t>> phi_moves(uint32_t from,
+                                                       uint32_t to) const {
+    std::vector<std::pair<uint64_t, uint64_t>> moves{};
+    auto& block = blocks[to];
+    auto k = static_cast<std::size_t>(
+        std::find(block.preds.begin(), block.preds.end(), from) -
+        block.preds.begin());
+    for (auto&& phi : block.phis) {
+      if (values[phi].live && values[phi].same == none) {
+        auto src = reg(values[phi].args[k]);
+        if (src != values[phi].reg) {
+          moves.emplace_back(values[phi].reg, src);
+        }
+      }
+    }
+    return moves;
+  }
+
+  // the moves happen at once: a register which is both a source and a
+  // destination is read before it is written, through top on a cycle.
+  void move(std::vector<std::pair<uint64_t, uint64_t>> moves,
+            std::vector<Instruction>* out) const {
+    moves.erase(std::remove_if(moves.begin(), moves.end(),
+                               [](const std::pair<uint64_t, uint64_t>& m) {
+                                 return m.first == m.second;
+                               }),
+                moves.end());
+    while (!moves.empty()) {
+      bool progress = false;
+      for (auto it = moves.begin(); it != moves.end(); ++it) {
+        auto dst = it->first;
+        auto read_later = std::any_of(
+            moves.begin(), moves.end(),
+            [dst](const std::pair<uint64_t, uint64_t>& m) {
+              return m.second == dst;
+            });
+        if (!read_later) {
+          out->push_back(Instruction(ISA::mov, it->first, it->second));
+          moves.erase(it);
+          progress = true;
+          break;
+        }
+      }
+      if (!progress) {
+        auto saved = moves.front().first;
+        out->push_back(Instruction(ISA::mov, top, saved));
+        for (auto&& m : moves) {
+          if (m.second == saved) {
+            m.second = top;
+          }
+        }
+      }
+    }
+    return;
+  }
+
+  void emit_value(uint32_t v, std::vector<Instruction>* out) const {
+    auto& value = values[v];
+    auto inst = value.inst;
+    if (inst.instruction == ISA::call) {
+      // the procedure and the arguments go to the window of the call.
+      std::vector<std::pair<uint64_t, uint64_t>> moves{};
+      for (std::size_t k = 0; k < value.args.size(); ++k) {
+        moves.emplace_back(value.reg + k, reg(value.args[k]));
+      }
+      move(std::move(moves), out);
+      out->push_back(Instruction(ISA::call, value.reg, inst.operand[1]));
+      return;
+    }
+    auto ops = operands_of(inst);
+    std::size_t j = 0;
+    for (int k = 0; k < 3; ++k) {
+      if ((ops.reads & (1 << k)) != 0) {
+        inst.operand[k] = reg(value.args[j++]);
+      }
+    }
+    if (ops.writes) {
+      if ((ops.reads & 1) != 0 && inst.operand[0] != value.reg) {
+        // it reads its first operand from the register which it writes.
+        out->push_back(Instruction(ISA::mov, value.reg, inst.operand[0]));
+      }
+      inst.operand[0] = value.reg;
+    }
+    out->push_back(inst);
+    return;
+  }
+
+  void print_value(FILE* fp, uint32_t v) const {
+    auto& value = values[v];
+    if (value.same != none) {
+      fprintf(fp, "  v%u = v%u\n", v, find(v));
+      return;
+    } else if (!value.live) {
+      return;
+    }
+    if (value.kind == Kind::phi || operands_of(value.inst).writes) {
+      fprintf(fp, "  v%u:r%zu = ", v, value.reg);
+    } else {
+      fprintf(fp, "  ");
+    }
+    fprintf(fp, "%s",
+            value.kind == Kind::phi ? "phi" : name_of(value.inst.instruction));
+    if (value.kind == Kind::instruction && value.args.empty()) {
+      fprintf(fp, " #%zu", value.inst.operand[1]);
+    }
+    for (std::size_t k = 0; k < value.args.size(); ++k) {
+      fprintf(fp, "%s v%u", k == 0 ? "" : ",", find(value.args[k]));
+    }
+    fprintf(fp, "\n");
+    return;
+  }
+};
+
+// runs the passes on a snippet before it is linked. pinned is the number
+// of registers which keep their values after a top-level snippet.
+void optimize(Snippet* snippet,
+              const File& file,
+              const Scope& scope,
+              bool top_level,
+              uint64_t pinned,
+              const Lambda* self,
+              const char* name) {
+  auto& options = passes();
+  if (!options.ir || snippet->instructions->empty()) {
+    return;
+  }
+  auto code = *snippet->instructions;
+  auto registers = register_limit(code);
+  if (options.inlining) {
+    code = inline_calls(code, scope.global(), top_level, pinned, self, file);
+  }
+  IR ir{};
+  if (!ir.build(code, pinned)) {
+    snippet->instructions =
+        std::make_shared<std::vector<Instruction>>(std::move(code));
+    return;
+  }
+  if (options.cse) {
+    ir.cse();
+  }
+  std::set<uint32_t> replaced{};
+  if (options.escape) {
+    replaced = ir.replace_conses();
+  }
+  ir.dce(options.dce, replaced);
+  ir.allocate(options.allocation, registers);
+  if (options.dump) {
+    ir.print(stderr, name);
+  }
+  snippet->instructions =
+      std::make_shared<std::vector<Instruction>>(ir.emit());
+  if (options.dump && !top_level) {
+    // the code of a top-level snippet is printed as it runs.
+    Serializer err(file, STDERR_FILENO);
+    snippet->print(&err);
+  }
+  return;
+}
+
+const Snippet& Lambda::compiled(const File& file) {
+  if (ready.load(std::memory_order_acquire)) {
+    return snippet;
+  }
+  std::lock_guard<std::recursive_mutex> lock(compiler_mutex());
+  if (ready.load(std::memory_order_relaxed)) {
+    return snippet;
+  }
+  compiling = true;
+  std::array<char, 32> name{};
+  snprintf(name.data(), name.size(), "lambda[%zu]", id);
+  Span span("compile", Counter::compile_ns, name.data());
+  auto errors = error_log().count;
+  auto inner = std::make_shared<Scope>(scope);
+  for (auto&& param : params) {
+    if (!inner->define(param)) {
+      report("error.\n");
+    }
+  }
+  // the labels belong to the snippet, so they may start from 0 again.
+  uint64_t max_label_id = 0;
+  auto result = inner->base();
+  Snippet code{};
+  for (auto rest = body;
+       rest != nullptr && rest->type() == Type::cell;
+       rest = std::dynamic_pointer_cast<Cell>(rest)->cdr()) {
+    result = inner->base();
+    code = compile(std::dynamic_pointer_cast<Cell>(rest)->car(),
+                   file,
+                   result,
+                   std::move(code),
+                   inner,
+                   &max_label_id);
+  }
+  code.push_back(Instruction(ISA::done, result));
+  optimize(&code, file, *inner, false, 0, this, name.data());
+  code.link();
+  snippet = std::move(code);
+  compiling = false;
+  broken = error_log().count != errors;
+  ready.store(true, std::memory_order_release);
+  return snippet;
+}
+
+// the type feedback of the sites which the machine quickens.
+void Lambda::print_feedback(FILE* fp) const {
+  if (!ready.load(std::memory_order_acquire)) {
+    return;
+  }
+  auto& code = *snippet.instructions;
+  for (std::size_t pc = 0; pc < code.size(); ++pc) {
+    auto inst = code[pc].instruction.load(std::memory_order_relaxed);
+    switch (generic_of(inst)) {
+      case ISA::eq:
+      case ISA::string_ref:
+      case ISA::vector_ref:
+      case ISA::add:
+      case ISA::sub:
+      case ISA::mul:
+      case ISA::num_eq:
+      case ISA::lt:
+        break;
+      default:
+        continue;
+    }
+    fprintf(fp, "lambda[%zu] %zu: %s, streak %u, misses %u\n",
+            id,
+            pc,
+            name_of(inst),
+            code[pc].streak.load(std::memory_order_relaxed),
+            code[pc].misses.load(std::memory_order_relaxed));
+  }
+  return;
+}
+
+struct Task {
+  Snippet snippet;
+  std::size_t pc;
+  std::shared_ptr<Frame> frame;
+  std::shared_ptr<Future> future;
+
+  // set by a coroutine which gave up the control; it resumes at the pc of
+  // the code, which is of the call on the top of its stack, if any.
+  bool suspended;
+  const Snippet* code;
+  CallStack calls;
+  int blocked_fd;
+  uint32_t blocked_events;
+
+  Task(const Snippet& snippet_,
+       std::size_t pc_,
+       const std::shared_ptr<Frame>& frame_,
+       const std::shared_ptr<Future>& future_)
+      : snippet(snippet_),
+        pc(pc_),
+        frame(frame_),
+        future(future_),
+        suspended(false),
+        code(nullptr),
+        calls{},
+        blocked_fd(-1),
+        blocked_events(0) {
+    return;
+  }
+};
+
+// a work-stealing pool. every thread owns a deque; the owner pushes and
+// pops at the back, and the idle threads steal from the front of the others.
+// the deque #0 belongs to the main thread.
+class Scheduler {
+ private:
+  struct Deque {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Task>> tasks;
+  };
+
+  std::function<void(Task*)> runner;
+  std::vector<std::unique_ptr<Deque>> deques;
+  std::vector<std::thread> workers;
+  std::mutex idle_mutex;
+  std::condition_variable idle;
+  std::atomic<std::size_t> pending;
+  std::atomic<bool> started;
+  bool stopping;
+
+ public:
+  explicit Scheduler(std::function<void(Task*)>&& runner_)
+      : runner(std::move(runner_)),
+        deques{},
+        workers{},
+        idle_mutex{},
+        idle{},
+        pending(0),
+        started(false),
+        stopping(false) {
+    deques.push_back(std::make_unique<Deque>());
+    return;
+  }
+
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      stopping = true;
+    }
+    idle.notify_all();
+    for (auto&& worker : workers) {
+      worker.join();
+    }
+    return;
+  }
+
+  void spawn(std::shared_ptr<Task>&& task) {
+    if (!started) {
+      start();
+    }
+    auto& deque = *deques[current_index()];
+    {
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      deque.tasks.push_back(std::move(task));
+    }
+    pending++;
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+    }
+    idle.notify_one();
+    return;
+  }
+
+  bool run_one() {
+    auto task = pop();
+    if (task == nullptr) {
+      return false;
+    }
+    runner(task.get());
+    return true;
+  }
+
+ private:
+  static std::size_t& current_index() {
+    static thread_local std::size_t index = 0;
+    return index;
+  }
+
+  // the workers are started with the first future, so the programs
+  // without futures stay single-threaded.
+  void start() {
+    started = true;
+    std::size_t count = std::max(2u, std::thread::hardware_concurrency());
+    for (std::size_t i = 1; i < count; ++i) {
+      deques.push_back(std::make_unique<Deque>());
+    }
+    for (std::size_t i = 1; i < count; ++i) {
+      workers.emplace_back([this, i] { work(i); });
+    }
+    return;
+  }
+
+  std::shared_ptr<Task> pop() {
+    auto self = current_index();
+    {
+      auto& deque = *deques[self];
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      if (!deque.tasks.empty()) {
+        auto task = std::move(deque.tasks.back());
+        deque.tasks.pop_back();
+        pending--;
+        return task;
+      }
+    }
+    for (std::size_t i = 1; i < deques.size(); ++i) {
+      auto& victim = *deques[(self + i) % deques.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        auto task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        pending--;
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  void work(std::size_t index) {
+    current_index() = index;
+    for (;;) {
+      if (run_one()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      idle.wait(lock, [this] { return stopping || pending > 0; });
+      if (stopping) {
+        return;
+      }
+    }
+  }
+};
+
+class Machine {
+ private:
+  // the coroutines, and the main program as nullptr, waiting for an fd.
+  struct Waiters {
+    std::deque<std::shared_ptr<Task>> readers, writers;
+
+    uint32_t events() const {
+      return (readers.empty() ? 0u : static_cast<uint32_t>(EPOLLIN)) |
+             (writers.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+    }
+  };
+
+  const File& file;
+  const std::shared_ptr<Frame> main_frame;
+  // the top-level defines, for the bodies of the lambdas.
+  Region<std::shared_ptr<Object>> globals;
+  std::mutex dynamic_mutex;
+  std::map<TokenID, std::shared_ptr<Object>> dynamic_table;
+  const std::shared_ptr<Object> true_object, false_object;
+
+  // the coroutines run on the main thread only.
+  const std::thread::id main_thread;
+  std::deque<std::shared_ptr<Task>> coroutines;
+  std::map<int, Waiters> blocked;
+  std::size_t blocked_count;
+  bool main_woken;
+  int epoll_fd;
+
+  Scheduler scheduler;
+
+ public:
+  explicit Machine(const File& file_)
+      : file(file_),
+        main_frame(std::make_shared<Frame>()),
+        globals{},
+        dynamic_mutex{},
+        dynamic_table{},
+        true_object(Token::make(static_cast<TokenID>(SpecialTokenID::t))),
+        false_object(Token::make(static_cast<TokenID>(SpecialTokenID::f))),
+        main_thread(std::this_thread::get_id()),
+        coroutines{},
+        blocked{},
+        blocked_count(0),
+        main_woken(false),
+        epoll_fd(-1),
+        scheduler([this](Task* task) {
+          task->future->set_value(execute(task->snippet,
+                                          task->pc,
+                                          task->frame,
+                                          nullptr));
+        }) {
+    return;
+  }
+
+  ~Machine() {
+    if (epoll_fd != -1) {
+      ::close(epoll_fd);
+    }
+    return;
+  }
+
+  // the registers are kept between the runs for the top-level defines.
+  // false if the snippet fails; the error is reported then.
+  bool run(const Snippet& snippet,
+           uint64_t result,
+           std::shared_ptr<Object>* value) {
+    bool finished = false;
+    execute(snippet, 0, main_frame, nullptr, &finished);
+    if (!finished) {
+      return false;
+    }
+    if (result < main_frame->registers.size()) {
+      *value = main_frame->registers[result];
+    } else {
+      *value = nullptr;
+    }
+    return true;
+  }
+
+  // resumes the ready coroutines once without waiting; false if there
+  // are none left.
+  bool poll() {
+    return step(0);
+  }
+
+  // runs the remaining coroutines to the end.
+  void finish() {
+    while (step(-1)) {
+      continue;
+    }
+    return;
+  }
+
+ private:
+  bool on_main_thread() const {
+    return std::this_thread::get_id() == main_thread;
+  }
+
+  // resumes each ready coroutine once, after waiting for the fds up to
+  // timeout ms if none is ready. returns false if there are no coroutines.
+  // the queue is checked on each turn, in case a step runs inside another
+  // one and takes the coroutines which the outer one counted.
+  bool step(int timeout) {
+    if (coroutines.empty() && blocked_count == 0) {
+      return false;
+    }
+    poll_events(coroutines.empty() ? timeout : 0);
+    for (auto n = coroutines.size(); n > 0 && !coroutines.empty(); --n) {
+      auto task = std::move(coroutines.front());
+      coroutines.pop_front();
+      task->suspended = false;
+      auto value = execute(task->snippet,
+                           task->pc,
+                           task->frame,
+                           task.get());
+      if (!task->suspended) {
+        task->future->set_value(std::move(value));
+      } else if (task->blocked_fd != -1) {
+        auto fd = task->blocked_fd;
+        auto events = task->blocked_events;
+        task->blocked_fd = -1;
+        block(std::move(task), fd, events);
+      } else {
+        coroutines.push_back(std::move(task));
+      }
+    }
+    return true;
+  }
+
+  void block(std::shared_ptr<Task>&& task, int fd, uint32_t events) {
+    if (epoll_fd == -1) {
+      epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    auto& waiters = blocked[fd];
+    auto old_events = waiters.events();
+    if (events == EPOLLIN) {
+      waiters.readers.push_back(std::move(task));
+    } else {
+      waiters.writers.push_back(std::move(task));
+    }
+    blocked_count++;
+    if (!update(fd, old_events, waiters.events())) {
+      // can't be watched, e.g. a regular file; just let them retry.
+      wake(fd, EPOLLHUP);
+    }
+    return;
+  }
+
+  bool update(int fd, uint32_t old_events, uint32_t new_events) {
+    if (old_events == new_events) {
+      return true;
+    }
+    struct epoll_event ev;
+    ev.events = new_events;
+    ev.data.fd = fd;
+    int ctl = EPOLL_CTL_MOD;
+    if (old_events == 0) {
+      ctl = EPOLL_CTL_ADD;
+    } else if (new_events == 0) {
+      ctl = EPOLL_CTL_DEL;
+    }
+    return epoll_ctl(epoll_fd, ctl, fd, &ev) != -1;
+  }
+
+  // the fds are level-triggered, so it resumes one waiter per event;
+  // the poll reports the fd again if it is still ready.
+  void wake(int fd, uint32_t revents) {
+    auto it = blocked.find(fd);
+    if (it == blocked.end()) {
+      return;
+    }
+    auto& waiters = it->second;
+    auto old_events = waiters.events();
+    bool all = (revents & (EPOLLERR | EPOLLHUP)) != 0;
+    if (all || (revents & EPOLLIN) != 0) {
+      resume(&waiters.readers, all);
+    }
+    if (all || (revents & EPOLLOUT) != 0) {
+      resume(&waiters.writers, all);
+    }
+    update(fd, old_events, waiters.events());
+    if (waiters.events() == 0) {
+      blocked.erase(it);
+    }
+    return;
+  }
+
+  void resume(std::deque<std::shared_ptr<Task>>* tasks, bool all) {
+    while (!tasks->empty()) {
+      auto task = std::move(tasks->front());
+      tasks->pop_front();
+      blocked_count--;
+      if (task == nullptr) {
+        main_woken = true;
+      } else {
+        coroutines.push_back(std::move(task));
+      }
+      if (!all) {
+        break;
+      }
+    }
+    return;
+  }
+
+  void poll_events(int timeout) {
+    if (blocked_count == 0) {
+      return;
+    }
+    struct epoll_event events[64];
+    auto n = epoll_wait(epoll_fd, events, 64, timeout);
+    for (int i = 0; i < n; ++i) {
+      wake(events[i].data.fd, events[i].events);
+    }
+    return;
+  }
+
+  // blocks the caller until the fd gets ready, without stopping the
+  // coroutines if it is the main program.
+  void wait_fd(int fd, uint32_t events) {
+    if (on_main_thread()) {
+      main_woken = false;
+      block(nullptr, fd, events);
+      while (!main_woken) {
+        step(-1);
+      }
+    } else {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = static_cast<int16_t>(events);
+      pfd.revents = 0;
+      ::poll(&pfd, 1, -1);
+    }
+    return;
+  }
+
+  // a task which runs the lambda of a future or a spawn instruction on a
+  // frame of its own; nullptr if its body doesn't compile.
+  std::shared_ptr<Task> make_task(uint64_t slot,
+                                  const std::shared_ptr<Frame>& up,
+                                  const std::shared_ptr<Future>& future) {
+    auto lambda = lambdas().get(slot);
+    auto& body = lambda->compiled(file);
+    if (lambda->is_broken()) {
+      report("error: the body of the task didn't compile.\n");
+      return nullptr;
+    }
+    return std::make_shared<Task>(
+        body, 0, std::make_shared<Frame>(up), future);
+  }
+
+  // runs (pmap f l): f on each element of l as a task of the pool, and
+  // lists the values in the order of l; false if it fails.
+  bool pmap(const std::shared_ptr<Object>& f,
+            const std::shared_ptr<Object>& l,
+            std::shared_ptr<Object>* value) {
+    if (f == nullptr || f->type() != Type::procedure) {
+      report("error: not a procedure.\n");
+      return false;
+    }
+    auto procedure = static_cast<Procedure*>(f.get());
+    auto& lambda = procedure->get_lambda();
+    if (lambda.arity() != 1) {
+      report("error: wrong number of arguments.\n");
+      return false;
+    }
+    auto& body = lambda.compiled(file);
+    if (lambda.is_broken()) {
+      report("error: the body of the procedure didn't compile.\n");
+      return false;
+    }
+    // the list is checked before any task starts.
+    std::vector<std::shared_ptr<Task>> tasks{};
+    for (auto x = l; x != nullptr;) {
+      if (x->type() != Type::cell) {
+        report("error: not a list.\n");
+        return false;
+      }
+      auto cell = static_cast<Cell*>(x.get());
+      auto frame = std::make_shared<Frame>(procedure->get_frame());
+      frame->registers.resize(
+          std::max<std::size_t>(body.register_count, 1));
+      frame->registers[0] = cell->car();
+      tasks.push_back(std::make_shared<Task>(
+          body, 0, frame, std::make_shared<Future>()));
+      x = cell->cdr();
+    }
+    std::vector<std::shared_ptr<Future>> futures{};
+    for (auto&& task : tasks) {
+      futures.push_back(task->future);
+      scheduler.spawn(std::move(task));
+    }
+    value->reset();
+    for (auto it = futures.rbegin(); it != futures.rend(); ++it) {
+      wait(**it);
+      *value = std::allocate_shared<Cell>(LocalAllocator<Cell>(),
+                                          (*it)->get_value(),
+                                          std::move(*value));
+    }
+    return true;
+  }
+
+  // runs the other tasks and coroutines while the future is not ready.
+  void wait(const Future& future) {
+    while (!future.is_ready()) {
+      if (on_main_thread() && step(1)) {
+        continue;
+      }
+      if (!scheduler.run_one()) {
+        std::this_thread::yield();
+      }
+    }
+    return;
+  }
+
+  bool is_false(const std::shared_ptr<Object>& x) const {
+    return x != nullptr &&
+           x->type() == Type::token &&
+           static_cast<Token*>(x.get())->get_id() ==
+               static_cast<TokenID>(SpecialTokenID::f);
+  }
+
+  static String* as_string(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::string) {
+      return nullptr;
+    }
+    return static_cast<String*>(x.get());
+  }
+
+  static Number* as_number(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::number) {
+      return nullptr;
+    }
+    return static_cast<Number*>(x.get());
+  }
+
+  static Vector* as_vector(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::vector) {
+      return nullptr;
+    }
+    return static_cast<Vector*>(x.get());
+  }
+
+  static HashTable* as_hashtable(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::hashtable) {
+      return nullptr;
+    }
+    return static_cast<HashTable*>(x.get());
+  }
+
+  static F64Vector* as_f64vector(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::f64vector) {
+      return nullptr;
+    }
+    return static_cast<F64Vector*>(x.get());
+  }
+
+  // the value of a number or a flonum.
+  static bool as_real(const Object* x, double* value) {
+    if (x == nullptr) {
+      return false;
+    } else if (x->type() == Type::number) {
+      *value = static_cast<double>(static_cast<const Number*>(x)->get_value());
+      return true;
+    } else if (x->type() == Type::flonum) {
+      *value = static_cast<const Flonum*>(x)->get_value();
+      return true;
+    }
+    return false;
+  }
+
+  static std::shared_ptr<Object> make_number(int64_t x) {
+    return std::allocate_shared<Number>(LocalAllocator<Number>(), x);
+  }
+
+  static std::shared_ptr<Object> make_flonum(double x) {
+    return std::allocate_shared<Flonum>(LocalAllocator<Flonum>(), x);
+  }
+
+  // puts x in the register. the flonum there takes it in place if nothing
+  // else holds that one, so that the flonums of a loop stay in the boxes
+  // which it has already, instead of a new box for each value.
+  static void set_flonum(std::shared_ptr<Object>* reg, double x) {
+    auto old = reg->get();
+    if (old != nullptr && old->type() == Type::flonum &&
+        reg->use_count() == 1) {
+      static_cast<Flonum*>(old)->set_value(x);
+    } else {
+      *reg = make_flonum(x);
+    }
+    return;
+  }
+
+  const std::shared_ptr<Object>& truth(bool x) const {
+    return x ? true_object : false_object;
+  }
+
+  // a generic arithmetic on two numbers. the results which don't fit in
+  // a number become flonums, and so do the inexact quotients.
+  std::shared_ptr<Object> fixnum_arithmetic(ISA op,
+                                            int64_t x,
+                                            int64_t y) const {
+    int64_t z;
+    auto x_ = static_cast<double>(x);
+    auto y_ = static_cast<double>(y);
+    switch (op) {
+      case ISA::add:
+        return __builtin_add_overflow(x, y, &z) ? make_flonum(x_ + y_)
+                                                : make_number(z);
+      case ISA::sub:
+        return __builtin_sub_overflow(x, y, &z) ? make_flonum(x_ - y_)
+                                                : make_number(z);
+      case ISA::mul:
+        return __builtin_mul_overflow(x, y, &z) ? make_flonum(x_ * y_)
+                                                : make_number(z);
+      case ISA::div:
+      case ISA::mod:
+        if (y == 0) {
+          report("error: division by zero.\n");
+          return nullptr;
+        } else if (y == -1) {
+          // INT64_MIN / -1 overflows.
+          return op == ISA::mod ? make_number(0)
+                                : fixnum_arithmetic(ISA::sub, 0, x);
+        } else if (op == ISA::mod) {
+          return make_number(x % y);
+        }
+        return x % y == 0 ? make_number(x / y) : make_flonum(x_ / y_);
+      case ISA::num_eq:
+        return truth(x == y);
+      case ISA::lt:
+        return truth(x < y);
+      case ISA::le:
+        return truth(x <= y);
+      case ISA::gt:
+        return truth(x > y);
+      case ISA::ge:
+        return truth(x >= y);
+      default:
+        return nullptr;
+    }
+  }
+
+  std::shared_ptr<Object> flonum_arithmetic(ISA op,
+                                            double x,
+                                            double y) const {
+    switch (op) {
+      case ISA::add:
+        return make_flonum(x + y);
+      case ISA::sub:
+        return make_flonum(x - y);
+      case ISA::mul:
+        return make_flonum(x * y);
+      case ISA::div:
+        return make_flonum(x / y);
+      case ISA::mod:
+        return make_flonum(std::fmod(x, y));
+      case ISA::num_eq:
+        // x == y, as -Wfloat-equal doesn't take it for the intent.
+        return truth(x <= y && x >= y);
+      case ISA::lt:
+        return truth(x < y);
+      case ISA::le:
+        return truth(x <= y);
+      case ISA::gt:
+        return truth(x > y);
+      case ISA::ge:
+        return truth(x >= y);
+      default:
+        return nullptr;
+    }
+  }
+
+  // the numbers stay exact unless a flonum joins in.
+  std::shared_ptr<Object> arithmetic(ISA op,
+                                     const Object* x,
+                                     const Object* y) const {
+    double x_, y_;
+    if (x != nullptr && y != nullptr &&
+        x->type() == Type::number && y->type() == Type::number) {
+      return fixnum_arithmetic(op,
+                               static_cast<const Number*>(x)->get_value(),
+                               static_cast<const Number*>(y)->get_value());
+    } else if (as_real(x, &x_) && as_real(y, &y_)) {
+      return flonum_arithmetic(op, x_, y_);
+    }
+    report("error: not a number.\n");
+    return nullptr;
+  }
+
+  // the quickened form of an arithmetic for the operands, or op itself.
+  static ISA arithmetic_form(ISA op, const Object* x, const Object* y) {
+    if (x == nullptr || y == nullptr || x->type() != y->type()) {
+      return op;
+    }
+    auto type = x->type();
+    if (type != Type::number && type != Type::flonum) {
+      return op;
+    }
+    auto fixnum = type == Type::number;
+    switch (op) {
+      case ISA::add:
+        return fixnum ? ISA::add_fixnum : ISA::add_flonum;
+      case ISA::sub:
+        return fixnum ? ISA::sub_fixnum : ISA::sub_flonum;
+      case ISA::mul:
+        return fixnum ? ISA::mul_fixnum : ISA::mul_flonum;
+      case ISA::num_eq:
+        return fixnum ? ISA::num_eq_fixnum : ISA::num_eq_flonum;
+      case ISA::lt:
+        return fixnum ? ISA::lt_fixnum : ISA::lt_flonum;
+      default:
+        return op;
+    }
+  }
+
+  // the index if x is in [0, size), or -1.
+  static int64_t as_index(const std::shared_ptr<Object>& x, std::size_t size) {
+    auto k = as_number(x);
+    if (k == nullptr ||
+        k->get_value() < 0 ||
+        static_cast<uint64_t>(k->get_value()) >= size) {
+      return -1;
+    }
+    return k->get_value();
+  }
+
+  // the size of a new vector if x is in [0, 2^26], or -1; a larger one
+  // takes gigabytes, and a failed allocation would end the process.
+  static int64_t as_size(const std::shared_ptr<Object>& x) {
+    constexpr std::size_t limit = std::size_t{1} << 26;
+    return as_index(x, limit + 1);
+  }
+
+  // the quickened form of eq for the operands, or eq itself.
+  static ISA eq_form(const Object* x, const Object* y) {
+    if (x == nullptr || y == nullptr) {
+      return ISA::eq;
+    }
+    auto type = x->type();
+    if (type != y->type()) {
+      return ISA::eq;
+    } else if (type == Type::token) {
+      return ISA::eq_token;
+    } else if (type == Type::number) {
+      return ISA::eq_number;
+    }
+    return ISA::eq;
+  }
+
+  // the type feedback of a generic instruction: it counts the runs in a
+  // row which saw the operand types of the quickened form, and rewrites
+  // itself with that form once there are enough of them. a site which has
+  // missed the guards too often stays generic.
+  static void observe(Instruction* inst, ISA quickened) {
+    static constexpr uint32_t quicken_threshold = 8;
+    static constexpr uint32_t miss_limit = 4;
+    if (!passes().quickening ||
+        inst->misses.load(std::memory_order_relaxed) >= miss_limit) {
+      return;
+    } else if (generic_of(quickened) == quickened) {
+      if (inst->streak.load(std::memory_order_relaxed) != 0) {
+        inst->streak.store(0, std::memory_order_relaxed);
+      }
+      return;
+    }
+    auto streak = inst->streak.load(std::memory_order_relaxed) + 1;
+    if (streak < quicken_threshold) {
+      inst->streak.store(streak, std::memory_order_relaxed);
+      return;
+    }
+    // the quickened form reads only the operands, which never change, so
+    // the other threads may see the new instruction at any time.
+    inst->streak.store(0, std::memory_order_relaxed);
+    inst->instruction.store(quickened, std::memory_order_relaxed);
+    return;
+  }
+
+  // a quickened instruction missed its guard; it goes back to the generic
+  // form, which runs it again.
+  static void deoptimize(Instruction* inst) {
+    inst->misses.fetch_add(1, std::memory_order_relaxed);
+    inst->instruction.store(
+        generic_of(inst->instruction.load(std::memory_order_relaxed)),
+        std::memory_order_relaxed);
+    return;
+  }
+
+  // counts the instructions of a run, and adds them up when it leaves.
+  struct Tally {
+    uint64_t count;
+
+    ~Tally() {
+      metrics().add(Counter::dispatched, count);
+      return;
+    }
+  };
+
+  // pops the calls which a run left on the stack when it fails; a
+  // suspended coroutine keeps them.
+  struct Unwind {
+    CallStack* calls;
+    std::size_t base;
+    const Task* coroutine;
+
+    ~Unwind() {
+      if (coroutine != nullptr && coroutine->suspended) {
+        return;
+      }
+      while (calls->depth() > base) {
+        calls->pop();
+      }
+      return;
+    }
+  };
+
+  // returns the register of the done instruction, or nullptr. finished is
+  // set if it gets there or to the end of the snippet, that is, unless it
+  // fails. a coroutine may suspend itself in the middle; see
+  // Task::suspended. the calls run in this loop on the call stack of the
+  // thread, or of the coroutine, which may suspend in any of them then.
+  std::shared_ptr<Object> execute(
+      const Snippet& snippet,
+      std::size_t pc,
+      const std::shared_ptr<Frame>& frame,
+      Task* coroutine,
+      bool* finished = nullptr) {
+    auto entry = frame;
+    if (entry->registers.size() < snippet.register_count) {
+      entry->registers.resize(snippet.register_count);
+    }
+    auto& calls = coroutine != nullptr ? coroutine->calls : call_stack();
+    const std::size_t base = coroutine != nullptr ? 0 : calls.depth();
+    Unwind unwind{&calls, base, coroutine};
+    // the running call: its code, its registers, its frame if it has one
+    // yet, and the frame which its procedure was made in.
+    auto code = &snippet;
+    auto instructions = code->instructions.get();
+    auto r = entry->registers.data();
+    auto window = entry->registers.size();
+    auto current = &entry;
+    const std::shared_ptr<Frame>* up = &entry->up;
+    auto frame_of = [&]() -> const std::shared_ptr<Frame>& {
+      if (*current == nullptr) {
+        auto taken = std::make_shared<Frame>(*up);
+        taken->registers.assign(std::make_move_iterator(r),
+                                std::make_move_iterator(r + window));
+        r = taken->registers.data();
+        *current = std::move(taken);
+      }
+      return *current;
+    };
+    // goes on with the call on the top of the stack, or with the entry.
+    auto enter_top = [&]() {
+      if (calls.depth() == base) {
+        r = entry->registers.data();
+        window = entry->registers.size();
+        current = &entry;
+        up = &entry->up;
+      } else {
+        auto& caller = calls.top();
+        r = caller.frame != nullptr ? caller.frame->registers.data()
+                                    : caller.registers;
+        window = caller.size;
+        current = &caller.frame;
+        up = caller.up;
+      }
+      return;
+    };
+    auto suspend = [&](std::size_t at) {
+      coroutine->code = code;
+      coroutine->pc = at;
+      coroutine->suspended = true;
+      return;
+    };
+    if (coroutine != nullptr && calls.depth() > base) {
+      code = coroutine->code;
+      instructions = code->instructions.get();
+      enter_top();
+    }
+    Tally dispatched{0};
+    for (; pc < instructions->size(); ++pc) {
+      dispatched.count++;
+      auto& inst = (*instructions)[pc];
+      auto& o = inst.operand;
+      switch (inst.instruction.load(std::memory_order_relaxed)) {
+        case ISA::load_true:
+          r[o[0]] = true_object;
+          break;
+        case ISA::load_false:
+          r[o[0]] = false_object;
+          break;
+        case ISA::load_number:
+          r[o[0]] = std::make_shared<Number>(static_cast<int64_t>(o[1]));
+          break;
+        case ISA::load_character:
+          r[o[0]] = std::make_shared<Character>(static_cast<Unicode>(o[1]));
+          break;
+        case ISA::load_const:
+          r[o[0]] = constants().get(o[1]);
+          break;
+        case ISA::load_dynamic: {
+          std::lock_guard<std::mutex> lock(dynamic_mutex);
+          auto it = dynamic_table.find(o[1]);
+          if (it == dynamic_table.end()) {
+            report("error: unbound variable.\n");
+            return nullptr;
+          }
+          r[o[0]] = it->second;
+          break;
+        }
+        case ISA::load_up: {
+          auto outer = up->get();
+          for (uint64_t depth = 1; depth < o[1] && outer != nullptr; ++depth) {
+            outer = outer->up.get();
+          }
+          if (outer == nullptr || o[2] >= outer->registers.size()) {
+            report("error: unbound variable.\n");
+            return nullptr;
+          }
+          r[o[0]] = outer->registers[o[2]];
+          break;
         }
-        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
-        auto addx = ddx_->car();
-        auto dddx = ddx_->cdr();
-        snippet = compile(addx,
-                          file,
-                          shift_width + 1,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (dddx != nullptr) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::load_global:
+          r[o[0]] = globals.get(o[1]);
+          break;
+        case ISA::store_global: {
+          globals.set(o[1], r[o[0]]);
+          std::lock_guard<std::mutex> lock(dynamic_mutex);
+          dynamic_table[o[2]] = r[o[0]];
+          break;
         }
-        snippet.push_back(Instruction(ISA::cons,
-                                      shift_width,
-                                      shift_width,
-                                      shift_width + 1));
-      } else if (op == static_cast<TokenID>(SpecialTokenID::car)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::mov:
+          r[o[0]] = r[o[1]];
+          break;
+        case ISA::cons:
+          r[o[0]] = std::allocate_shared<Cell>(LocalAllocator<Cell>(),
+                                               r[o[1]],
+                                               r[o[2]]);
+          break;
+        case ISA::car:
+        case ISA::cdr: {
+          auto& x = r[o[1]];
+          if (x == nullptr || x->type() != Type::cell) {
+            report("error: not a pair.\n");
+            return nullptr;
+          }
+          auto cell = static_cast<Cell*>(x.get());
+          auto value = inst.instruction == ISA::car ? cell->car()
+                                                    : cell->cdr();
+          r[o[0]] = std::move(value);
+          break;
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        snippet = compile(adx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (ddx != nullptr) {
-          fprintf(stderr, "error.\n");
+        case ISA::atom:
+          if (r[o[1]] == nullptr || r[o[1]]->type() != Type::cell) {
+            r[o[0]] = true_object;
+          } else {
+            r[o[0]] = false_object;
+          }
+          break;
+        case ISA::eq: {
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          observe(&inst, eq_form(x, y));
+          r[o[0]] = is_eqv(x, y) ? true_object : false_object;
+          break;
         }
-        snippet.push_back(Instruction(ISA::car, shift_width, shift_width));
-      } else if (op == static_cast<TokenID>(SpecialTokenID::cdr)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::eq_token: {
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          if (eq_form(x, y) != ISA::eq_token) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          r[o[0]] = static_cast<Token*>(x)->get_id() ==
+                            static_cast<Token*>(y)->get_id()
+                        ? true_object
+                        : false_object;
+          break;
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        snippet = compile(adx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (ddx != nullptr) {
-          fprintf(stderr, "error.\n");
+        case ISA::eq_number: {
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          if (eq_form(x, y) != ISA::eq_number) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          r[o[0]] = static_cast<Number*>(x)->get_value() ==
+                            static_cast<Number*>(y)->get_value()
+                        ? true_object
+                        : false_object;
+          break;
         }
-        snippet.push_back(Instruction(ISA::cdr, shift_width, shift_width));
-      } else if (op == static_cast<TokenID>(SpecialTokenID::atom)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::br:
+          pc = code->labels->at(o[0]);
+          break;
+        case ISA::bfalse:
+          if (is_false(r[o[0]])) {
+            pc = code->labels->at(o[1]);
+          }
+          break;
+        case ISA::label:
+          break;
+        case ISA::future: {
+          auto future = std::make_shared<Future>();
+          auto task = make_task(o[1], o[2] != 0 ? frame_of() : nullptr,
+                                future);
+          if (task == nullptr) {
+            return nullptr;
+          }
+          scheduler.spawn(std::move(task));
+          r[o[0]] = std::move(future);
+          break;
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        snippet = compile(adx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (ddx != nullptr) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::touch: {
+          auto x = r[o[1]];
+          if (x != nullptr && x->type() == Type::future) {
+            auto future = static_cast<Future*>(x.get());
+            if (coroutine != nullptr && !future->is_ready()) {
+              suspend(pc);
+              return nullptr;
+            }
+            wait(*future);
+            x = future->get_value();
+          }
+          r[o[0]] = std::move(x);
+          break;
         }
-        snippet.push_back(Instruction(ISA::atom, shift_width, shift_width));
-      } else if (op == static_cast<TokenID>(SpecialTokenID::eq)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::pmap: {
+          std::shared_ptr<Object> value{};
+          if (!pmap(r[o[1]], r[o[2]], &value)) {
+            return nullptr;
+          }
+          r[o[0]] = std::move(value);
+          break;
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        snippet = compile(adx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (ddx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::done: {
+          if (calls.depth() == base) {
+            if (finished != nullptr) {
+              *finished = true;
+            }
+            return r[o[0]];
+          }
+          auto value = std::move(r[o[0]]);
+          auto& callee = calls.top();
+          code = callee.snippet;
+          pc = callee.pc;
+          auto result = callee.result;
+          calls.pop();
+          enter_top();
+          instructions = code->instructions.get();
+          r[result] = std::move(value);
+          break;
         }
-        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
-        auto addx = ddx_->car();
-        auto dddx = ddx_->cdr();
-        snippet = compile(addx,
-                          file,
-                          shift_width + 1,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        if (dddx != nullptr) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::spawn: {
+          if (!on_main_thread()) {
+            report("error: spawn out of the main thread.\n");
+            return nullptr;
+          }
+          auto future = std::make_shared<Future>();
+          auto task = make_task(o[1], o[2] != 0 ? frame_of() : nullptr,
+                                future);
+          if (task == nullptr) {
+            return nullptr;
+          }
+          coroutines.push_back(std::move(task));
+          r[o[0]] = std::move(future);
+          break;
+        }
+        case ISA::yield:
+          r[o[0]] = nullptr;
+          if (coroutine != nullptr) {
+            suspend(pc + 1);
+            return nullptr;
+          } else if (on_main_thread()) {
+            step(0);
+          } else {
+            std::this_thread::yield();
+          }
+          break;
+        case ISA::socketpair: {
+          int fds[2];
+          if (::socketpair(AF_UNIX,
+                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           0,
+                           fds) == -1) {
+            report("error: socketpair failed.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::allocate_shared<Cell>(
+              LocalAllocator<Cell>(),
+              std::make_shared<Number>(fds[0]),
+              std::make_shared<Number>(fds[1]));
+          break;
+        }
+        case ISA::read_byte:
+        case ISA::write_byte:
+        case ISA::close: {
+          auto& x = r[o[1]];
+          if (x == nullptr || x->type() != Type::number) {
+            report("error: not a file descriptor.\n");
+            return nullptr;
+          }
+          auto fd = static_cast<int>(
+              static_cast<Number*>(x.get())->get_value());
+          if (inst.instruction == ISA::close) {
+            r[o[0]] = ::close(fd) == 0 ? true_object : false_object;
+            break;
+          }
+          uint8_t byte = 0;
+          uint32_t events = EPOLLIN;
+          if (inst.instruction == ISA::write_byte) {
+            auto& y = r[o[2]];
+            if (y == nullptr || y->type() != Type::number) {
+              report("error: not a byte.\n");
+              return nullptr;
+            }
+            byte = static_cast<uint8_t>(
+                static_cast<Number*>(y.get())->get_value());
+            events = EPOLLOUT;
+          }
+          ssize_t n;
+          for (;;) {
+            if (inst.instruction == ISA::read_byte) {
+              n = ::read(fd, &byte, 1);
+            } else {
+              n = ::write(fd, &byte, 1);
+            }
+            if (n >= 0) {
+              break;
+            } else if (errno == EINTR) {
+              continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              if (coroutine != nullptr) {
+                // retries this instruction when the fd gets ready.
+                suspend(pc);
+                coroutine->blocked_fd = fd;
+                coroutine->blocked_events = events;
+                return nullptr;
+              }
+              wait_fd(fd, events);
+            } else {
+              report("error: %s\n", strerror(errno));
+              return nullptr;
+            }
+          }
+          if (n == 0) {
+            // the end of file
+            r[o[0]] = false_object;
+          } else {
+            r[o[0]] = std::make_shared<Number>(byte);
+          }
+          break;
+        }
+        case ISA::string_length:
+        case ISA::string_hash: {
+          auto x = as_string(r[o[1]]);
+          if (x == nullptr) {
+            report("error: not a string.\n");
+            return nullptr;
+          }
+          if (inst.instruction == ISA::string_length) {
+            r[o[0]] = std::make_shared<Number>(
+                static_cast<int64_t>(x->get_length()));
+          } else {
+            // keeps it a non-negative fixnum
+            r[o[0]] = std::make_shared<Number>(
+                static_cast<int64_t>(x->hash() >> 2));
+          }
+          break;
+        }
+        case ISA::string_ref: {
+          auto x = as_string(r[o[1]]);
+          auto k = as_number(r[o[2]]);
+          observe(&inst, x != nullptr && k != nullptr ? ISA::string_ref_number
+                                                      : ISA::string_ref);
+          if (x == nullptr || k == nullptr ||
+              k->get_value() < 0 ||
+              static_cast<uint64_t>(k->get_value()) >= x->get_length()) {
+            report("error: string-ref out of range.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<Character>(
+              x->ref(static_cast<std::size_t>(k->get_value())));
+          break;
+        }
+        case ISA::string_ref_number: {
+          auto x = as_string(r[o[1]]);
+          auto k = as_number(r[o[2]]);
+          if (x == nullptr || k == nullptr) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          auto at = static_cast<uint64_t>(k->get_value());
+          if (at >= x->get_length()) {
+            report("error: string-ref out of range.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<Character>(
+              x->ref(static_cast<std::size_t>(at)));
+          break;
+        }
+        case ISA::substring: {
+          auto x = as_string(r[o[0]]);
+          auto start = as_number(r[o[1]]);
+          auto end = as_number(r[o[2]]);
+          if (x == nullptr || start == nullptr || end == nullptr ||
+              start->get_value() < 0 ||
+              start->get_value() > end->get_value() ||
+              static_cast<uint64_t>(end->get_value()) > x->get_length()) {
+            report("error: substring out of range.\n");
+            return nullptr;
+          }
+          r[o[0]] = x->slice(static_cast<std::size_t>(start->get_value()),
+                             static_cast<std::size_t>(end->get_value()));
+          break;
+        }
+        case ISA::string_append:
+        case ISA::string_eq:
+        case ISA::string_contains: {
+          auto x = as_string(r[o[1]]);
+          auto y = as_string(r[o[2]]);
+          if (x == nullptr || y == nullptr) {
+            report("error: not a string.\n");
+            return nullptr;
+          }
+          if (inst.instruction == ISA::string_append) {
+            r[o[0]] = x->append(*y);
+          } else if (inst.instruction == ISA::string_eq) {
+            r[o[0]] = x->equals(*y) ? true_object : false_object;
+          } else {
+            auto k = x->find(*y);
+            if (k < 0) {
+              r[o[0]] = false_object;
+            } else {
+              r[o[0]] = std::make_shared<Number>(k);
+            }
+          }
+          break;
+        }
+        case ISA::string_split: {
+          auto x = as_string(r[o[1]]);
+          auto& y = r[o[2]];
+          if (x == nullptr || y == nullptr || y->type() != Type::character) {
+            report("error: string-split takes a string and a char.\n");
+            return nullptr;
+          }
+          auto pieces = x->split(static_cast<Character*>(y.get())->get_value());
+          std::shared_ptr<Object> list = nullptr;
+          for (auto it = pieces.rbegin(); it != pieces.rend(); ++it) {
+            list = std::allocate_shared<Cell>(LocalAllocator<Cell>(),
+                                              std::move(*it),
+                                              std::move(list));
+          }
+          r[o[0]] = std::move(list);
+          break;
+        }
+        case ISA::closure:
+          r[o[0]] = std::make_shared<Procedure>(
+              lambdas().get(o[1]), o[2] != 0 ? frame_of() : nullptr);
+          break;
+        case ISA::call: {
+          auto& f = r[o[0]];
+          if (f == nullptr || f->type() != Type::procedure) {
+            report("error: not a procedure.\n");
+            return nullptr;
+          }
+          auto procedure = static_cast<Procedure*>(f.get());
+          auto& lambda = procedure->get_lambda();
+          if (lambda.arity() != o[1]) {
+            report("error: wrong number of arguments.\n");
+            return nullptr;
+          }
+          // the first call compiles the body; the later ones just run it.
+          auto& body = lambda.compiled(file);
+          if (lambda.is_broken()) {
+            report("error: the body of the procedure didn't compile.\n");
+            return nullptr;
+          }
+          auto callee = calls.push(std::max<std::size_t>(
+              {body.register_count, o[1], 1}));
+          if (callee == nullptr) {
+            report("error: stack overflow.\n");
+            return nullptr;
+          }
+          callee->snippet = code;
+          callee->pc = pc;
+          callee->result = o[0];
+          callee->up = &procedure->get_frame();
+          for (uint64_t i = 0; i < o[1]; ++i) {
+            callee->registers[i] = std::move(r[o[0] + 1 + i]);
+          }
+          callee->procedure = std::move(f);
+          code = &body;
+          instructions = code->instructions.get();
+          r = callee->registers;
+          window = callee->size;
+          current = &callee->frame;
+          up = callee->up;
+          // the loop steps it to the first instruction of the body.
+          pc = static_cast<std::size_t>(-1);
+          break;
+        }
+        case ISA::make_vector: {
+          auto size = as_size(r[o[1]]);
+          if (size < 0) {
+            report("error: not a vector size.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<Vector>(static_cast<std::size_t>(size),
+                                             r[o[2]]);
+          break;
+        }
+        case ISA::vector_ref: {
+          auto v = as_vector(r[o[1]]);
+          observe(&inst, v != nullptr && as_number(r[o[2]]) != nullptr
+                             ? ISA::vector_ref_number
+                             : ISA::vector_ref);
+          auto k = v == nullptr ? -1 : as_index(r[o[2]], v->size());
+          if (k < 0) {
+            report("error: vector index out of range.\n");
+            return nullptr;
+          }
+          auto value = v->ref(static_cast<std::size_t>(k));
+          r[o[0]] = std::move(value);
+          break;
+        }
+        case ISA::vector_ref_number: {
+          auto v = as_vector(r[o[1]]);
+          auto k = as_number(r[o[2]]);
+          if (v == nullptr || k == nullptr) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          auto at = static_cast<uint64_t>(k->get_value());
+          if (at >= v->size()) {
+            report("error: vector index out of range.\n");
+            return nullptr;
+          }
+          auto value = v->ref(static_cast<std::size_t>(at));
+          r[o[0]] = std::move(value);
+          break;
+        }
+        case ISA::vector_set: {
+          auto v = as_vector(r[o[0]]);
+          auto k = v == nullptr ? -1 : as_index(r[o[1]], v->size());
+          if (k < 0) {
+            report("error: vector index out of range.\n");
+            return nullptr;
+          }
+          v->set(static_cast<std::size_t>(k), r[o[2]]);
+          break;
+        }
+        case ISA::vector_length: {
+          auto v = as_vector(r[o[1]]);
+          if (v == nullptr) {
+            report("error: not a vector.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<Number>(static_cast<int64_t>(v->size()));
+          break;
+        }
+        case ISA::make_hashtable:
+          r[o[0]] = std::make_shared<HashTable>(
+              static_cast<Equivalence>(o[1]));
+          break;
+        case ISA::hashtable_ref:
+        case ISA::hashtable_set: {
+          auto table = as_hashtable(r[o[0]]);
+          if (table == nullptr) {
+            report("error: not a hashtable.\n");
+            return nullptr;
+          }
+          if (inst.instruction == ISA::hashtable_set) {
+            table->set(r[o[1]], r[o[2]]);
+          } else {
+            auto found = table->find(r[o[1]]);
+            auto value = found == nullptr ? r[o[2]] : *found;
+            r[o[0]] = std::move(value);
+          }
+          break;
+        }
+        case ISA::hashtable_contains:
+        case ISA::hashtable_delete:
+        case ISA::hashtable_size: {
+          auto table = as_hashtable(r[o[1]]);
+          if (table == nullptr) {
+            report("error: not a hashtable.\n");
+            return nullptr;
+          }
+          if (inst.instruction == ISA::hashtable_contains) {
+            r[o[0]] = table->find(r[o[2]]) != nullptr ? true_object
+                                                      : false_object;
+          } else if (inst.instruction == ISA::hashtable_delete) {
+            r[o[0]] = table->erase(r[o[2]]) ? true_object : false_object;
+          } else {
+            r[o[0]] = std::make_shared<Number>(
+                static_cast<int64_t>(table->size()));
+          }
+          break;
+        }
+        case ISA::append: {
+          // copies the spine of the first list in front of the second one.
+          std::vector<std::shared_ptr<Object>> items{};
+          for (auto x = r[o[1]]; x != nullptr;) {
+            if (x->type() != Type::cell) {
+              report("error: not a list.\n");
+              return nullptr;
+            }
+            auto x_ = static_cast<Cell*>(x.get());
+            items.push_back(x_->car());
+            x = x_->cdr();
+          }
+          auto list = r[o[2]];
+          for (auto it = items.rbegin(); it != items.rend(); ++it) {
+            list = std::allocate_shared<Cell>(LocalAllocator<Cell>(),
+                                              std::move(*it),
+                                              std::move(list));
+          }
+          r[o[0]] = std::move(list);
+          break;
+        }
+        case ISA::add:
+        case ISA::sub:
+        case ISA::mul:
+        case ISA::div:
+        case ISA::mod:
+        case ISA::num_eq:
+        case ISA::lt:
+        case ISA::le:
+        case ISA::gt:
+        case ISA::ge: {
+          auto op = inst.instruction.load(std::memory_order_relaxed);
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          observe(&inst, arithmetic_form(op, x, y));
+          auto value = arithmetic(op, x, y);
+          if (value == nullptr) {
+            return nullptr;
+          }
+          r[o[0]] = std::move(value);
+          break;
+        }
+        case ISA::add_fixnum:
+        case ISA::sub_fixnum:
+        case ISA::mul_fixnum:
+        case ISA::num_eq_fixnum:
+        case ISA::lt_fixnum: {
+          auto op = inst.instruction.load(std::memory_order_relaxed);
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          if (x == nullptr || y == nullptr ||
+              x->type() != Type::number || y->type() != Type::number) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          r[o[0]] = fixnum_arithmetic(generic_of(op),
+                                      static_cast<Number*>(x)->get_value(),
+                                      static_cast<Number*>(y)->get_value());
+          break;
         }
-        snippet.push_back(Instruction(ISA::eq,
-                                      shift_width,
-                                      shift_width,
-                                      shift_width + 1));
-      } else if (op == static_cast<TokenID>(SpecialTokenID::define)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::add_flonum:
+        case ISA::sub_flonum:
+        case ISA::mul_flonum:
+        case ISA::num_eq_flonum:
+        case ISA::lt_flonum: {
+          auto op = inst.instruction.load(std::memory_order_relaxed);
+          auto x = r[o[1]].get();
+          auto y = r[o[2]].get();
+          if (x == nullptr || y == nullptr ||
+              x->type() != Type::flonum || y->type() != Type::flonum) {
+            deoptimize(&inst);
+            --pc;
+            continue;
+          }
+          auto x_ = static_cast<Flonum*>(x)->get_value();
+          auto y_ = static_cast<Flonum*>(y)->get_value();
+          if (op == ISA::add_flonum) {
+            set_flonum(&r[o[0]], x_ + y_);
+          } else if (op == ISA::sub_flonum) {
+            set_flonum(&r[o[0]], x_ - y_);
+          } else if (op == ISA::mul_flonum) {
+            set_flonum(&r[o[0]], x_ * y_);
+          } else {
+            r[o[0]] = flonum_arithmetic(generic_of(op), x_, y_);
+          }
+          break;
         }
-        auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-        auto adx = dx_->car();
-        auto ddx = dx_->cdr();
-        if (adx->type() != Type::token) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::make_f64vector: {
+          auto size = as_size(r[o[1]]);
+          double fill;
+          if (size < 0 || !as_real(r[o[2]].get(), &fill)) {
+            report("error: make-f64vector takes a size and a number.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<F64Vector>(
+              static_cast<std::size_t>(size), fill);
+          break;
         }
-        auto adx_ = std::dynamic_pointer_cast<Token>(adx);
-        if (scope->define(adx_->get_id()) == false) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::f64vector_ref: {
+          auto v = as_f64vector(r[o[1]]);
+          auto k = v == nullptr ? -1 : as_index(r[o[2]], v->size());
+          if (k < 0) {
+            report("error: f64vector index out of range.\n");
+            return nullptr;
+          }
+          set_flonum(&r[o[0]], v->ref(static_cast<std::size_t>(k)));
+          break;
         }
-        if (ddx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::f64vector_set: {
+          auto v = as_f64vector(r[o[0]]);
+          auto k = v == nullptr ? -1 : as_index(r[o[1]], v->size());
+          double x;
+          if (k < 0) {
+            report("error: f64vector index out of range.\n");
+            return nullptr;
+          } else if (!as_real(r[o[2]].get(), &x)) {
+            report("error: not a number.\n");
+            return nullptr;
+          }
+          v->set(static_cast<std::size_t>(k), x);
+          break;
         }
-        auto ddx_ = std::dynamic_pointer_cast<Cell>(ddx);
-        auto addx = ddx_->car();
-        auto dddx = ddx_->car();
-        snippet = compile(addx,
-                          file,
-                          shift_width,
-                          std::move(snippet),
-                          scope,
-                          max_label_id);
-        auto reg_num = scope->find(adx_->get_id());
-        if (reg_num != shift_width) {
-          snippet.push_back(Instruction(ISA::mov, reg_num, shift_width));
+        case ISA::f64vector_length: {
+          auto v = as_f64vector(r[o[1]]);
+          if (v == nullptr) {
+            report("error: not a f64vector.\n");
+            return nullptr;
+          }
+          r[o[0]] = std::make_shared<Number>(static_cast<int64_t>(v->size()));
+          break;
         }
-      } else if (op == static_cast<TokenID>(SpecialTokenID::cond)) {
-        if (dx == nullptr || dx->type() != Type::cell) {
-          fprintf(stderr, "error.\n");
-          return {};
+        case ISA::list_to_f64vector: {
+          std::vector<double> elements{};
+          for (auto x = r[o[1]].get(); x != nullptr;) {
+            double element;
+            if (x->type() != Type::cell ||
+                !as_real(static_cast<Cell*>(x)->car().get(), &element)) {
+              report("error: not a list of numbers.\n");
+              return nullptr;
+            }
+            elements.push_back(element);
+            x = static_cast<Cell*>(x)->cdr().get();
+          }
+          r[o[0]] = std::make_shared<F64Vector>(std::move(elements));
+          break;
         }
-        uint64_t endif_label_id = *max_label_id + 1;
-        *max_label_id += 2;
-        while (dx != nullptr) {
-          auto dx_ = std::dynamic_pointer_cast<Cell>(dx);
-          auto adx = dx_->car();
-          dx = dx_->cdr();
-          if (adx->type() != Type::cell) {
-            fprintf(stderr, "error.\n");
-            return {};
+        case ISA::f64vector_add:
+        case ISA::f64vector_sub:
+        case ISA::f64vector_mul:
+        case ISA::f64vector_div:
+        case ISA::f64vector_dot: {
+          auto x = as_f64vector(r[o[1]]);
+          auto y = as_f64vector(r[o[2]]);
+          if (x == nullptr || y == nullptr) {
+            report("error: not a f64vector.\n");
+            return nullptr;
+          } else if (x->size() != y->size()) {
+            report("error: f64vectors of different lengths.\n");
+            return nullptr;
           }
-          auto adx_ = std::dynamic_pointer_cast<Cell>(adx);
-          auto aadx = adx_->car();
-          auto dadx = adx_->cdr();
-          if (dadx->type() != Type::cell) {
-            fprintf(stderr, "error.\n");
-            return {};
+          auto n = x->size();
+          auto op = inst.instruction.load(std::memory_order_relaxed);
+          if (op == ISA::f64vector_dot) {
+            r[o[0]] = make_flonum(
+                f64_fold<F64Fold::dot>(x->data(), y->data(), n, 0.0));
+            break;
           }
-          auto dadx_ = std::dynamic_pointer_cast<Cell>(dadx);
-          auto adadx = dadx_->car();
-          auto ddadx = dadx_->cdr();
-          if (ddadx != nullptr) {
-            fprintf(stderr, "error.\n");
-            return {};
+          auto z = std::make_shared<F64Vector>(n, 0.0);
+          if (op == ISA::f64vector_add) {
+            f64_map<F64Op::add>(x->data(), y->data(), z->data(), n);
+          } else if (op == ISA::f64vector_sub) {
+            f64_map<F64Op::sub>(x->data(), y->data(), z->data(), n);
+          } else if (op == ISA::f64vector_mul) {
+            f64_map<F64Op::mul>(x->data(), y->data(), z->data(), n);
+          } else {
+            f64_map<F64Op::div>(x->data(), y->data(), z->data(), n);
           }
-          // (cond (...) (aadx adadx) ...)
-          snippet.push_back(Instruction(ISA::label, *max_label_id));
-          auto false_label_id = *max_label_id + 1;
-          *max_label_id += 1;
-          snippet = compile(aadx,
-                            file,
-                            shift_width,
-                            std::move(snippet),
-                            scope,
-                            max_label_id);
-          snippet.push_back(Instruction(ISA::bfalse,
-                                        shift_width,
-                                        false_label_id));
-          snippet = compile(adadx,
-                            file,
-                            shift_width,
-                            std::move(snippet),
-                            scope,
-                            max_label_id);
-          snippet.push_back(Instruction(ISA::br, endif_label_id));
+          r[o[0]] = std::move(z);
+          break;
+        }
+        case ISA::f64vector_sum:
+        case ISA::f64vector_min:
+        case ISA::f64vector_max: {
+          auto v = as_f64vector(r[o[1]]);
+          if (v == nullptr) {
+            report("error: not a f64vector.\n");
+            return nullptr;
+          }
+          auto n = v->size();
+          auto op = inst.instruction.load(std::memory_order_relaxed);
+          if (op == ISA::f64vector_sum) {
+            r[o[0]] = make_flonum(
+                f64_fold<F64Fold::sum>(v->data(), v->data(), n, 0.0));
+            break;
+          } else if (n == 0) {
+            report("error: empty f64vector.\n");
+            return nullptr;
+          } else if (op == ISA::f64vector_min) {
+            r[o[0]] = make_flonum(
+                f64_fold<F64Fold::min>(v->data(), v->data(), n, v->ref(0)));
+          } else {
+            r[o[0]] = make_flonum(
+                f64_fold<F64Fold::max>(v->data(), v->data(), n, v->ref(0)));
+          }
+          break;
         }
-        snippet.push_back(Instruction(ISA::label, endif_label_id));
-        snippet.push_back(Instruction(ISA::label, *max_label_id));
       }
     }
+    if (finished != nullptr) {
+      *finished = true;
+    }
+    return nullptr;
   }
-  return std::move(snippet);
+};
+
+// the state which lives across the top-level forms: the symbols of the file,
+// the scope and the labels of the compiler, the macros and the machine.
+// in the eager mode, the bodies of the lambdas are compiled as soon as their
+// top-level forms are, instead of on their first calls.
+class Session {
+ public:
+  // a top-level form, compiled to run on the registers from base on;
+  // failed if it didn't expand or compile. the errors of compile_all wait
+  // in diagnostics until the form runs, so they come out in source order.
+  struct Compiled {
+    Snippet snippet;
+    uint64_t base;
+    bool failed;
+    std::string diagnostics;
+  };
+
+ private:
+  File file;
+  std::shared_ptr<Scope> scope;
+  Expander expander;
+  Machine machine;
+  const bool eager;
+
+ public:
+  Session(std::vector<uint8_t>&& stream, bool eager_)
+      : file(std::move(stream)),
+        scope(std::make_shared<Scope>()),
+        expander(file),
+        machine(file),
+        eager(eager_) {
+    return;
+  }
+
+  File& get_file() {
+    return file;
+  }
+
+  // expands, compiles and runs a top-level form; the code goes to out if
+  // it is given. false if the form fails; the error is reported then.
+  bool evaluate(const std::shared_ptr<Object>& form,
+                Serializer* out,
+                std::shared_ptr<Object>* value) {
+    auto base = scope->base();
+    Compiled compiled{{}, base, false, {}};
+    {
+      auto errors = error_log().count;
+      auto expanded = expand(form);
+      std::lock_guard<std::recursive_mutex> lock(compiler_mutex());
+      compiled.snippet = compile_form(expanded, scope, base);
+      compiled.failed = error_log().count != errors;
+    }
+    return run(compiled, out, value);
+  }
+
+  // compiles the forms of a whole program on jobs threads. a serial pass
+  // expands them and declares the globals of their defines in order; then
+  // each form is compiled on its own scope, which sees the globals of the
+  // forms up to it, as if the forms before it had been compiled. the
+  // lambdas which the forms define are known to the global scope after
+  // all of them, so the top-level code inlines only those of its own form.
+  std::vector<Compiled> compile_all(
+      const std::vector<std::shared_ptr<Object>>& forms,
+      std::size_t jobs) {
+    std::vector<std::shared_ptr<Object>> expanded{};
+    std::vector<std::shared_ptr<Scope>> scopes{};
+    std::vector<bool> unexpanded{};
+    std::vector<std::string> diagnostics(forms.size());
+    for (auto&& form : forms) {
+      auto errors = error_log().count;
+      error_log().capture = &diagnostics[expanded.size()];
+      expanded.push_back(expand(form));
+      error_log().capture = nullptr;
+      unexpanded.push_back(error_log().count != errors);
+      auto first = scope->base();
+      declare(expanded.back());
+      scopes.push_back(std::make_shared<Scope>(scope, first, scope->base()));
+    }
+    auto base = scope->base();
+    std::vector<Compiled> compiled(forms.size(),
+                                   Compiled{{}, base, false, {}});
+    std::atomic<std::size_t> next{0};
+    auto work = [&]() {
+      for (auto i = next++; i < forms.size(); i = next++) {
+        auto errors = error_log().count;
+        compiled[i].diagnostics = std::move(diagnostics[i]);
+        error_log().capture = &compiled[i].diagnostics;
+        compiled[i].snippet = compile_form(expanded[i], scopes[i], base);
+        error_log().capture = nullptr;
+        compiled[i].failed = unexpanded[i] || error_log().count != errors;
+      }
+      return;
+    };
+    {
+      // the bodies which the inliner compiles lock it in turn.
+      std::vector<std::thread> threads{};
+      for (std::size_t i = 1; i < jobs; ++i) {
+        threads.emplace_back(work);
+      }
+      work();
+      for (auto&& thread : threads) {
+        thread.join();
+      }
+    }
+    for (auto&& form_scope : scopes) {
+      scope->merge(*form_scope);
+    }
+    return compiled;
+  }
+
+  // runs a compiled top-level form; the code goes to out if it is given.
+  // false if the form fails; the error is reported then.
+  bool run(const Compiled& compiled,
+           Serializer* out,
+           std::shared_ptr<Object>* value) {
+    auto& snippet = compiled.snippet;
+    auto base = compiled.base;
+    fputs(compiled.diagnostics.c_str(), stderr);
+    if (out != nullptr) {
+      snippet.print(out);
+    }
+    if (compiled.failed) {
+      return false;
+    }
+    if (eager) {
+      // the lambdas of the form, and those in their bodies in turn.
+      std::vector<std::shared_ptr<Lambda>> pending(*snippet.closures);
+      while (!pending.empty()) {
+        auto lambda = std::move(pending.back());
+        pending.pop_back();
+        auto& closures = *lambda->compiled(file).closures;
+        pending.insert(pending.end(), closures.begin(), closures.end());
+      }
+    }
+
+    // run
+    Span span("eval", Counter::eval_ns);
+    return machine.run(snippet, base, value);
+  }
+
+  bool poll() {
+    return machine.poll();
+  }
+
+  void finish() {
+    machine.finish();
+    if (passes().feedback) {
+      for (std::size_t slot = 0; slot < lambdas().size(); ++slot) {
+        auto lambda = lambdas().get(slot);
+        if (lambda != nullptr) {
+          lambda->print_feedback(stderr);
+        }
+      }
+    }
+    return;
+  }
+
+ private:
+  std::shared_ptr<Object> expand(const std::shared_ptr<Object>& form) {
+    Span span("expand", Counter::expand_ns);
+    return expander.expand(form);
+  }
+
+  // the labels belong to the snippet, so each form counts its own.
+  Snippet compile_form(const std::shared_ptr<Object>& expanded,
+                       const std::shared_ptr<Scope>& form_scope,
+                       uint64_t base) const {
+    Span span("compile", Counter::compile_ns);
+    uint64_t max_label_id = 0;
+    auto snippet =
+        compile(expanded, file, base, {}, form_scope, &max_label_id);
+    auto pinned = std::max<uint64_t>(base + 1, form_scope->base());
+    optimize(&snippet, file, *form_scope, true, pinned, nullptr, "top-level");
+    snippet.link();
+    return snippet;
+  }
+
+  // defines the global of a top-level define, as compile() would.
+  void declare(const std::shared_ptr<Object>& x) {
+    if (x == nullptr || x->type() != Type::cell) {
+      return;
+    }
+    auto x_ = static_cast<Cell*>(x.get());
+    auto define = static_cast<TokenID>(SpecialTokenID::define);
+    if (x_->car() == nullptr ||
+        x_->car()->type() != Type::token ||
+        static_cast<Token*>(x_->car().get())->get_id() != define ||
+        x_->cdr() == nullptr ||
+        x_->cdr()->type() != Type::cell) {
+      return;
+    }
+    auto name = static_cast<Cell*>(x_->cdr().get())->car();
+    auto value = static_cast<Cell*>(x_->cdr().get())->cdr();
+    if (name != nullptr && name->type() == Type::cell) {
+      // (define (f x ...) body ...)
+      name = static_cast<Cell*>(name.get())->car();
+    } else if (value == nullptr || value->type() != Type::cell) {
+      // (define x) defines nothing.
+      return;
+    }
+    if (name != nullptr && name->type() == Type::token) {
+      scope->define(static_cast<Token*>(name.get())->get_id());
+    }
+    return;
+  }
+};
+
+// set by the signals; the loops look at them between the forms.
+volatile sig_atomic_t dump_requested = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+void on_signal(int signal_number) {
+  if (signal_number == SIGUSR1) {
+    dump_requested = 1;
+  } else {
+    stop_requested = 1;
+  }
+  return;
 }
 
-void eval(std::vector<uint8_t>&& stream) {
-  File file(std::move(stream));
-  auto scope = std::make_shared<Scope>();
-  uint64_t max_label_id = 0;
-  for (;;) {
+void handle(int signal_number) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  // the reads and writes of the programs go on; epoll_wait returns anyway.
+  action.sa_flags = SA_RESTART;
+  sigaction(signal_number, &action, nullptr);
+  return;
+}
+
+// SIGUSR1 dumps the metrics on demand.
+void dump_if_requested() {
+  if (dump_requested != 0) {
+    dump_requested = 0;
+    metrics().dump(stderr);
+  }
+  return;
+}
+
+// with more than one job, the whole program is read and compiled before
+// the first form runs; see Session::compile_all.
+void eval(std::vector<uint8_t>&& stream, bool eager, std::size_t jobs) {
+  Session session(std::move(stream), eager);
+  Serializer out(session.get_file(), STDOUT_FILENO);
+  auto read = [&session]() {
+    Span span("read", Counter::read_ns);
+    return session.get_file().read();
+  };
+  std::vector<std::shared_ptr<Object>> forms{};
+  std::vector<Session::Compiled> compiled{};
+  if (jobs > 1) {
+    for (auto list = read(); list != nullptr; list = read()) {
+      forms.push_back(std::move(list));
+    }
+    compiled = session.compile_all(forms, jobs);
+  }
+  for (std::size_t i = 0;; ++i) {
     // parse
-    auto list = file.read();
+    auto list = jobs > 1 ? (i < forms.size() ? forms[i] : nullptr) : read();
     if (list == nullptr) {
       break;
     }
 
     // print
-    list->print();
-    puts("");
+    out.write(list);
+    out.text("\n");
 
-    // compile
-    auto snippet = compile(list, file, scope->base(), {}, scope, &max_label_id);
-    snippet.print();
-    puts("");
+    std::shared_ptr<Object> result;
+    auto ok = jobs > 1 ? session.run(compiled[i], &out, &result)
+                       : session.evaluate(list, &out, &result);
+    if (ok) {
+      out.text("=> ");
+      out.write(result);
+      out.text("\n\n");
+    } else {
+      // the error itself went to stderr.
+      out.text("error\n\n");
+    }
+    out.flush();
+    dump_if_requested();
   }
+  session.finish();
   return;
 }
 
+// the end of the first datum in the bytes, or 0 if they don't hold a whole
+// one yet. it knows just enough of the lexer of File to skip the strings,
+// the characters and the comments; the reader gets the datum afterwards.
+std::size_t form_end(const std::vector<uint8_t>& bytes) {
+  auto delimiter = [](uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '(' ||
+           c == ')' || c == '"' || c == ';' || c == '\'';
+  };
+  auto size = bytes.size();
+  std::size_t depth = 0;
+  for (std::size_t k = 0; k < size; ++k) {
+    switch (bytes[k]) {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+      case '\'':
+      case '`':
+      case ',':
+        continue;
+      case ';':
+        while (k < size && bytes[k] != '\n') {
+          ++k;
+        }
+        if (k == size) {
+          return 0;
+        }
+        continue;
+      case '(':
+        ++depth;
+        continue;
+      case ')':
+        // a stray one is a datum of its own, which the reader rejects.
+        if (depth > 0) {
+          --depth;
+        }
+        break;
+      case '"':
+        for (++k; k < size && bytes[k] != '"'; ++k) {
+          if (bytes[k] == '\\') {
+            ++k;
+          }
+        }
+        if (k >= size) {
+          return 0;
+        }
+        break;
+      default:
+        if (bytes[k] == '#' && k + 1 < size && bytes[k + 1] == '(') {
+          // #( stays with its list, so the reader rejects them as one.
+          continue;
+        }
+        if (bytes[k] == '#' && k + 1 < size && bytes[k + 1] == '\\') {
+          // a character takes one code point, whatever it is.
+          if (k + 2 >= size) {
+            return 0;
+          }
+          k += 2;
+          while (k + 1 < size && (bytes[k + 1] & 0xc0) == 0x80) {
+            ++k;
+          }
+          break;
+        }
+        // an atom may go on in the next read unless a delimiter ends it.
+        while (k + 1 < size && !delimiter(bytes[k + 1])) {
+          ++k;
+        }
+        if (k + 1 == size) {
+          return 0;
+        }
+        break;
+    }
+    if (depth == 0) {
+      return k + 1;
+    }
+  }
+  return 0;
+}
+
+// a client of the server; the results wait in output until it takes them.
+struct Connection {
+  std::vector<uint8_t> input;
+  std::vector<char> output;
+  bool closing;
+};
+
+// serves one warm session on a unix domain socket. each connection sends
+// the forms as in a source file, and may send any number of them ahead;
+// it gets back one line for each, in the order of the forms: "=> value",
+// or "error: ..." if the form doesn't read, compile or run. the forms run
+// one at a time, so they all share the globals and macros; a global can't
+// be defined again.
+// SIGINT or SIGTERM stops it.
+int serve(const char* path, bool eager) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "error: the socket path is too long.\n");
+    return 1;
+  }
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+  unlink(path);
+  if (listener == -1 ||
+      bind(listener,
+           reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    auto err = errno;
+    fprintf(stderr, "error: cannot listen on '%s'.\n", path);
+    fprintf(stderr, "info: %s\n", strerror(err));
+    return 1;
+  }
+  auto epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  auto watch = [epoll_fd](int fd, uint32_t events, int ctl) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, ctl, fd, &ev);
+    return;
+  };
+  watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+  handle(SIGINT);
+  handle(SIGTERM);
+
+  Session session({}, eager);
+  std::map<int, Connection> connections{};
+  // sends what the socket takes now; the rest waits for EPOLLOUT.
+  auto send_output = [&watch](int fd, Connection* connection) {
+    auto& output = connection->output;
+    std::size_t sent = 0;
+    while (sent < output.size()) {
+      auto n = send(fd, output.data() + sent, output.size() - sent,
+                    MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        // the peer is gone.
+        output.clear();
+        connection->closing = true;
+        return false;
+      }
+      sent += static_cast<std::size_t>(n);
+    }
+    output.erase(output.begin(),
+                 output.begin() + static_cast<std::ptrdiff_t>(sent));
+    watch(fd, output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+    return !(output.empty() && connection->closing);
+  };
+  std::array<struct epoll_event, 64> events;
+  std::array<uint8_t, 64 * 1024> chunk;
+  while (stop_requested == 0) {
+    // the coroutines left by the forms go on while the server is idle.
+    auto busy = session.poll();
+    auto n = epoll_wait(epoll_fd, events.data(),
+                        static_cast<int>(events.size()), busy ? 1 : -1);
+    dump_if_requested();
+    auto ready = n < 0 ? 0 : static_cast<std::size_t>(n);
+    for (std::size_t i = 0; i < ready; ++i) {
+      auto fd = events[i].data.fd;
+      if (fd == listener) {
+        for (;;) {
+          auto client = accept4(listener, nullptr, nullptr,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (client == -1) {
+            break;
+          }
+          connections[client] = Connection{{}, {}, false};
+          watch(client, EPOLLIN, EPOLL_CTL_ADD);
+        }
+        continue;
+      }
+      auto it = connections.find(fd);
+      if (it == connections.end()) {
+        continue;
+      }
+      auto& connection = it->second;
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 &&
+          !connection.closing) {
+        for (;;) {
+          auto size = read(fd, chunk.data(), chunk.size());
+          if (size > 0) {
+            connection.input.insert(connection.input.end(),
+                                    chunk.data(),
+                                    chunk.data() + size);
+            continue;
+          } else if (size < 0 && errno == EINTR) {
+            continue;
+          } else if (size == 0 ||
+                     (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // the last form may end at the end of the stream.
+            connection.input.push_back('\n');
+            connection.closing = true;
+          }
+          break;
+        }
+        Serializer out(session.get_file(), &connection.output);
+        for (auto end = form_end(connection.input);
+             end != 0;
+             end = form_end(connection.input)) {
+          auto& file = session.get_file();
+          file.append(connection.input.data(), end);
+          connection.input.erase(
+              connection.input.begin(),
+              connection.input.begin() + static_cast<std::ptrdiff_t>(end));
+          std::shared_ptr<Object> form;
+          {
+            Span span("read", Counter::read_ns);
+            form = file.read();
+          }
+          std::shared_ptr<Object> result;
+          auto ok = false;
+          if (!file.eof()) {
+            // the reader stopped in the middle; the rest of the datum goes
+            // with it, so that the replies keep to the data.
+            file.skip();
+            report("error: the form doesn't read.\n");
+          } else {
+            ok = session.evaluate(form, nullptr, &result);
+          }
+          if (ok) {
+            out.text("=> ");
+            out.write(result);
+            out.text("\n");
+          } else {
+            // the client gets the message of the error, on one line.
+            std::string message = error_log().last;
+            while (!message.empty() && message.back() == '\n') {
+              message.pop_back();
+            }
+            std::replace(message.begin(), message.end(), '\n', ' ');
+            out.text(message.c_str());
+            out.text("\n");
+          }
+          out.flush();
+        }
+      }
+      if (!send_output(fd, &connection)) {
+        close(fd);
+        connections.erase(it);
+      }
+    }
+  }
+  for (auto&& connection : connections) {
+    close(connection.first);
+  }
+  close(epoll_fd);
+  close(listener);
+  unlink(path);
+  return 0;
+}
+
+// dumps the metrics and writes the trace at the exit, if they are asked for.
+int finish(int status, bool dump, const char* trace_path) {
+  if (dump) {
+    metrics().dump(stderr);
+  }
+  if (trace_path != nullptr && !trace().write(trace_path)) {
+    auto err = errno;
+    fprintf(stderr, "error: cannot write '%s'.\n", trace_path);
+    fprintf(stderr, "info: %s\n", strerror(err));
+    return 1;
+  }
+  return status;
+}
+
+// reads a decimal count from 1 to max; the whole text must be the digits.
+bool parse_count(const char* text, std::size_t max, std::size_t* count) {
+  if (*text < '0' || *text > '9') {
+    return false;
+  }
+  errno = 0;
+  char* end = nullptr;
+  auto value = strtoull(text, &end, 10);
+  if (errno != 0 || *end != '\0' || value == 0 || value > max) {
+    return false;
+  }
+  *count = static_cast<std::size_t>(value);
+  return true;
+}
+
 int main(int argc, char** argv) {
-  // check the counts
-  if (argc != 2) {
-    printf("usage: %s source.lisp\n", argv[0]);
+  // check the options
+  bool eager = false;
+  const char* file_name = nullptr;
+  const char* socket_path = nullptr;
+  const char* trace_path = nullptr;
+  bool dump = false;
+  std::size_t jobs = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--eager") == 0) {
+      eager = true;
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      dump = true;
+    } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_path = argv[i] + 8;
+      trace().enable();
+    } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+      socket_path = argv[i] + 8;
+    } else if (strcmp(argv[i], "--dump-ir") == 0) {
+      passes().dump = true;
+    } else if (strcmp(argv[i], "--no-quickening") == 0) {
+      passes().quickening = false;
+    } else if (strcmp(argv[i], "--feedback") == 0) {
+      passes().feedback = true;
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      // the threads which compile the top-level forms of a program.
+      if (!parse_count(argv[i] + 7, 1024, &jobs)) {
+        fprintf(stderr, "error: --jobs takes a number from 1 to 1024.\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--stack-limit=", 14) == 0) {
+      // the MiB which the call stack of each thread may take.
+      std::size_t mib = 0;
+      if (!parse_count(argv[i] + 14, SIZE_MAX >> 20, &mib)) {
+        fprintf(stderr, "error: --stack-limit takes a positive number.\n");
+        return 1;
+      }
+      stack_limit() = mib << 20;
+    } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+      // --passes=inline,cse,escape,dce,regalloc picks the optimizations;
+      // --passes=none leaves the snippets as compile() makes them.
+      auto list = std::string(argv[i] + 9) + ",";
+      auto has = [&list](const char* pass) {
+        return list.find(std::string(pass) + ",") != std::string::npos;
+      };
+      passes().inlining = has("inline");
+      passes().cse = has("cse");
+      passes().escape = has("escape");
+      passes().dce = has("dce");
+      passes().allocation = has("regalloc");
+      passes().ir = !has("none");
+    } else if (file_name == nullptr) {
+      file_name = argv[i];
+    } else {
+      file_name = nullptr;
+      break;
+    }
+  }
+  if (passes().dump) {
+    // the dumps come out in the order of the forms.
+    jobs = 1;
+  }
+  if (file_name == nullptr && socket_path == nullptr) {
+    printf("usage: %s [--eager] [--dump-ir] [--passes=...]\n"
+           "       [--no-quickening] [--feedback] [--metrics]\n"
+           "       [--stack-limit=MiB] [--jobs=N] [--trace=trace.json]\n"
+           "       source.lisp\n"
+           "       %s [options] --serve=socket-path\n",
+           argv[0], argv[0]);
     return 0;
   }
+  handle(SIGUSR1);
+  if (file_name == nullptr) {
+    auto status = serve(socket_path, eager);
+    return finish(status, dump, trace_path);
+  }
 
   // open the file
-  auto file_name = argv[1];
   auto fd = open(file_name, O_RDONLY);
   if (fd == -1) {
     auto err = errno;
@@ -1034,7 +8601,7 @@ int main(int argc, char** argv) {
   close(fd);
 
   // do something
-  eval(std::move(file));
+  eval(std::move(file), eager, jobs);
 
-  return 0;
+  return finish(0, dump, trace_path);
 }
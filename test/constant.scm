@@ -0,0 +1,5 @@
+(define a '((1 "one") (2 "two") (x . y)))
+(define b '((1 "one") (2 "two") (x . y)))
+(eq a b)
+(eq (car (cdr a)) (car (cdr b)))
+'()
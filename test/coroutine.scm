@@ -0,0 +1,14 @@
+(define s (socketpair))
+(define reader (spawn (cons (read-byte (cdr s)) (read-byte (cdr s)))))
+(define writer (spawn (cons (write-byte (car s) 65) (cons (yield) (write-byte (car s) 66)))))
+(touch reader)
+(touch writer)
+(define echo (spawn (write-byte (cdr s) (read-byte (cdr s)))))
+(write-byte (car s) 67)
+(read-byte (car s))
+(define (recv fd n) (cond ((= n 0) (read-byte fd)) (#t (recv fd (- n 1)))))
+(define deep (spawn (recv (cdr s) 3)))
+(define late (spawn (write-byte (car s) 68)))
+(touch deep)
+(close (car s))
+(read-byte (cdr s))
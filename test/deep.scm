@@ -0,0 +1,28 @@
+(define (down n) (cond ((= n 0) 0) (#t (+ 1 (down (- n 1))))))
+(down 1000000)
+(define (adders n acc)
+  (cond ((= n 0) acc)
+        (#t (cons (lambda (x) (+ x n)) (adders (- n 1) acc)))))
+(define (apply-all fs x)
+  (cond ((eq fs '()) x)
+        (#t ((car fs) (apply-all (cdr fs) x)))))
+(apply-all (adders 5000 '()) 0)
+(define (spread n)
+  (cond ((= n 0) '())
+        (#t (cons (future (* n n)) (spread (- n 1))))))
+(define (gather fs)
+  (cond ((eq fs '()) 0)
+        (#t (+ (touch (car fs)) (gather (cdr fs))))))
+(gather (spread 1000))
+(define s (socketpair))
+(define (pause n)
+  (cond ((= n 0) (read-byte (car s))) (#t (+ n (pause (- n 1))))))
+(define (resume n)
+  (cond ((= n 0) (car (cons (yield) (write-byte (cdr s) 1))))
+        (#t (resume (- n 1)))))
+(define paused (spawn (pause 10000)))
+(touch (spawn (resume 10000)))
+(touch paused)
+(define (forever n) (+ 1 (forever n)))
+(forever 0)
+(down 10)
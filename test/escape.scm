@@ -0,0 +1,22 @@
+(define (pt x y) (cons x y))
+(define (px p) (car p))
+(define (py p) (cdr p))
+(define (add p q) (pt (+ (px p) (px q)) (+ (py p) (py q))))
+(define (dot p q) (+ (* (px p) (px q)) (* (py p) (py q))))
+(define (f i) (dot (add (pt i 1) (pt 2 i)) (pt i i)))
+(f 3)
+(define (nested x) (car (cdr (car (cons (cons 1 (cons x 2)) 3)))))
+(nested 'a)
+(define (fresh x) (cons (atom (cons x x)) (eq (cons x x) (cons x x))))
+(fresh 1)
+(define (same x) (define c (cons x x)) (cons (eq c c) (car c)))
+(same 2)
+(define (kept x) (define c (cons x x)) (cond ((eq x 0) c) (#t (car c))))
+(kept 0)
+(kept 1)
+(define (passed x) (px (cons x (cons x x))))
+(passed 4)
+(define (returned x) (cdr (cons x (cons x x))))
+(returned 5)
+(define (loop i acc) (cond ((= i 0) acc) (#t (loop (- i 1) (+ acc (f i))))))
+(loop 1000 0)
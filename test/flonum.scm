@@ -0,0 +1,33 @@
+1.5
+-2.25e3
+(+ 1 2)
+(+ 1 2.5)
+(- 0.1 0.3)
+(* 4611686018427387904 4)
+(/ 6 3)
+(/ 1 3)
+(% 7 3)
+(= 1 1.0)
+(< 1.5 2)
+(define (fsum l acc) (cond ((atom l) acc) (#t (fsum (cdr l) (+ acc (car l))))))
+(fsum '(1 2.5 3 4.25 5 6 7 8 9 10) 0)
+(fsum '(1 2 3 4 5 6 7 8 9 10) 0)
+(define u (list->f64vector '(1 2 3 4 5 6 7 8 9)))
+(define v (make-f64vector 9 0.5))
+(make-f64vector 100000000000000 0.5)
+(f64vector-set! v 8 -1.5)
+u
+(f64vector-add u v)
+(f64vector-sub u v)
+(f64vector-mul u v)
+(f64vector-div u v)
+(f64vector-dot u v)
+(f64vector-sum u)
+(f64vector-min v)
+(f64vector-max u)
+(f64vector-ref u 2)
+(f64vector-length u)
+(define (keep i acc l) (cond ((= i 0) l) (#t (keep (- i 1) (+ acc 0.5) (cons acc l)))))
+(keep 4 0.25 '())
+(define (horner i x) (cond ((= i 0) x) (#t (horner (- i 1) (* 0.01 (+ (* x (+ (* x 1.5) 2.5)) 4.5))))))
+(horner 3 0.5)
@@ -0,0 +1,25 @@
+(define a (future (cons 10 20)))
+(define b (future (car (cons 30 (future (cons 40 50))))))
+(cons (touch a) (touch b))
+(touch (cdr (cons 60 (future (cond ((eq 1 2) 70)
+                                   ((cond ((eq 3 3) #f) (#t #t)) 80)
+                                   (#t 90))))))
+(define offset 100)
+(pmap (lambda (x) (+ (* x x) offset)) (quote (1 2 3 4)))
+(define ok (lambda (q d qs)
+             (cond ((eq qs (quote ())) #t)
+                   ((eq (car qs) q) #f)
+                   ((eq (car qs) (+ q d)) #f)
+                   ((eq (car qs) (- q d)) #f)
+                   (#t (ok q (+ d 1) (cdr qs))))))
+(define try (lambda (n q k qs)
+              (cond ((eq q n) 0)
+                    ((ok q 1 qs) (+ (queens n (+ k 1) (cons q qs))
+                                    (try n (+ q 1) k qs)))
+                    (#t (try n (+ q 1) k qs)))))
+(define queens (lambda (n k qs) (cond ((eq k n) 1) (#t (try n 0 k qs)))))
+(define iota (lambda (i n)
+               (cond ((eq i n) (quote ())) (#t (cons i (iota (+ i 1) n))))))
+(define sum (lambda (l)
+              (cond ((eq l (quote ())) 0) (#t (+ (car l) (sum (cdr l)))))))
+(sum (pmap (lambda (q) (queens 6 1 (cons q (quote ())))) (iota 0 6)))
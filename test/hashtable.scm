@@ -0,0 +1,34 @@
+(define v (make-vector 3 0))
+(vector-set! v 1 (cons 1 2))
+(vector-ref v 1)
+(vector-length v)
+(make-vector 100000000000000 0)
+(define h (make-eqv-hashtable))
+(hashtable-set! h 42 "answer")
+(hashtable-ref h 42 #f)
+(hashtable-ref h 43 #f)
+(define e (make-equal-hashtable))
+(hashtable-set! e (cons 1 (cons 2 3)) "list")
+(hashtable-set! e "key" v)
+(hashtable-ref e (cons 1 (cons 2 3)) #f)
+(hashtable-ref e (substring "a key" 2 5) #f)
+(hashtable-contains? h (cons 1 (cons 2 3)))
+(hashtable-size e)
+(hashtable-delete! e "key")
+(hashtable-size e)
+(define (next x) (% (+ (* x 75) 74) 65537))
+(define (seen-h h x i m k c)
+  (cond ((eq i m) c)
+        ((hashtable-contains? h (% x k)) (seen-h h (next x) (+ i 1) m k c))
+        (#t (seen-h h (next x) (+ i 1) m k
+                    (car (cons (+ c 1) (hashtable-set! h (% x k) #t)))))))
+(define (assv x l)
+  (cond ((eq l (quote ())) #f)
+        ((eq (car (car l)) x) (car l))
+        (#t (assv x (cdr l)))))
+(define (seen-a a x i m k c)
+  (cond ((eq i m) c)
+        ((assv (% x k) a) (seen-a a (next x) (+ i 1) m k c))
+        (#t (seen-a (cons (cons (% x k) #t) a) (next x) (+ i 1) m k (+ c 1)))))
+(seen-h (make-eqv-hashtable) 1 0 400 100 0)
+(seen-a (quote ()) 1 0 400 100 0)
@@ -0,0 +1,7 @@
+(define (pick x) (cond ((atom x) (car '(a b))) ((eq (car x) 'q) (car (cdr x))) (#t (cdr x))))
+(pick 'z)
+(pick '(q r s))
+(pick '(p r s))
+(define (both x) (cons (pick x) (pick (cdr x))))
+(both '(q q r))
+(cond ((atom '(1)) 1) ((eq 'a 'a) (cons (pick '(q 7)) (pick '(q 7)))))
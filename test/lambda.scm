@@ -0,0 +1,22 @@
+(define (null? x) (eq x '()))
+(define (append2 a b)
+  (cond ((null? a) b)
+        (#t (cons (car a) (append2 (cdr a) b)))))
+(append2 '(1 2 3) '(4 5))
+(define (reverse l)
+  (define (loop l acc)
+    (cond ((null? l) acc)
+          (#t (loop (cdr l) (cons (car l) acc)))))
+  (loop l '()))
+(reverse '(a b c d))
+(define (make-pair-with x) (lambda (y) (cons x y)))
+(define with-1 (make-pair-with 1))
+(with-1 2)
+((lambda (a b) (cons b a)) 1 2)
+(define (twice f x) (f (f x)))
+(twice (lambda (l) (cons 'z l)) '())
+; the lambdas defined inside a call, which outlive it or not
+(define (make-adder n) (define (add x) (+ x n)) add)
+((make-adder 5) 10)
+(define (parity n) (define (ev k) (cond ((= k 0) #t) (#t (od (- k 1))))) (define (od k) (cond ((= k 0) #f) (#t (ev (- k 1))))) (ev n))
+(parity 7)
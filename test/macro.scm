@@ -0,0 +1,15 @@
+(define-syntax swap
+  (syntax-rules ()
+    ((_ a b) (cons b a))))
+(swap 1 2)
+(define-syntax my-list
+  (syntax-rules ()
+    ((_) '())
+    ((_ x rest ...) (cons x (my-list rest ...)))))
+(my-list 1 2 3)
+(define x 10)
+(define y (my-list 20 30))
+`(a b (c d) e)
+`(a ,x c)
+`(a ,@y ,x . ,x)
+`(1 `(2 ,(3 ,x)))
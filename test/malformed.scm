@@ -0,0 +1,11 @@
+; the malformed forms are reported and the session goes on
+(define x 5)
+(() 1)
+(cons 1)
+(eq 1)
+(define y)
+(define y 6)
+(cond ())
+(cond (1))
+(cond (#t 1) . 2)
+(cons x y)
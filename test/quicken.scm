@@ -0,0 +1,6 @@
+(define (count-eq x l acc) (cond ((atom l) acc) ((eq x (car l)) (count-eq x (cdr l) (cons 1 acc))) (#t (count-eq x (cdr l) acc))))
+(define toks '(a b c a b c a b c a b c a b c a b c))
+(define mixed '(a 1 #\c a 2 "s" a 1 #\c b 3 c a 1 #\c b 2 c))
+(count-eq 'a toks '())
+(count-eq 'a mixed '())
+(count-eq 1 mixed '())
@@ -0,0 +1,23 @@
+(define s "héllo, wörld, and a rather long tail to leave the inline storage")
+(string-length s)
+(string-ref s 1)
+(string-ref s 9)
+(substring s 7 12)
+(substring s 14 60)
+(string-append "foo" "bar")
+(string=? (substring s 0 5) "héllo")
+(string-contains s "wörld")
+(string-contains s "zzz")
+(string-split s #\,)
+(eq (string-hash "abc") (string-hash (substring "xabc" 1 4)))
+; the literals in a body which is compiled on its first call
+(define (countdown n) (cond ((= n 0) "done") (#t (countdown (- n 1)))))
+((car (cons countdown '())) 3)
+; the literals are never symbols or special tokens
+(string-length "")
+(string-length "car")
+(define abc 5)
+(string-append "abc" "")
+"xyz"
+(define (f xyz) xyz)
+(f 3)